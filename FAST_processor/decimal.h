@@ -0,0 +1,160 @@
+#ifndef FAST_DECIMAL_H
+#define FAST_DECIMAL_H
+
+#include "fast.h"
+
+/* Exact conversion between FAST decimals (mantissa x 10^exponent) and fix16.
+ *
+ * The mantissa is a FAST int64 (up to DECIMAL_MANTISSA_GROUPS 7-bit groups),
+ * so a feed may send 1.5 as 15e-1 or as 150000000e-8. A fix16 holds
+ * raw / 2^FIX16_FRAC_BITS. Decoding computes
+ * raw = round(mantissa * 2^FIX16_FRAC_BITS * 10^exponent) with integer
+ * arithmetic only:
+ * - exponent >= 0 multiplies by a power of ten from a constexpr table;
+ * - exponent = -k < 0 splits 10^k into 2^k * 5^k, so the dividend is the
+ *   mantissa shifted left by FIX16_FRAC_BITS - k and the divisor is 5^k. A
+ *   dividend of 2^DECIMAL_SATURATION_BITS or more saturates whatever k is, so
+ *   the division only ever sees DECIMAL_DIVIDEND_BITS bits and is a multiply
+ *   by a constexpr-generated reciprocal followed by a shift. The reciprocal
+ *   is ceil(2^s / 5^k) with s = DECIMAL_DIVIDEND_BITS + ceil(log2(5^k)),
+ *   which is exact for every dividend below 2^DECIMAL_DIVIDEND_BITS
+ *   (Granlund-Montgomery), so no divider or floating-point core is
+ *   instantiated.
+ * Rounding is to nearest with ties away from zero. Results outside the fix16
+ * range saturate. Exponents above DECIMAL_MAX_EXPONENT always saturate a
+ * non-zero mantissa; exponents below -DECIMAL_MAX_SCALE are finer than any
+ * price of the feed and the decoder rejects them (decimal_exponent_valid).
+ *
+ * Encoding picks the fewest decimals (0 to DECIMAL_ENCODE_DIGITS) whose
+ * decimal decodes back to the same fix16. Three decimals always do, because
+ * 10^-3 is finer than half an LSB of fix16 (2^-9).
+ */
+
+#define FIX16_FRAC_BITS         8
+#define DECIMAL_MANTISSA_BITS   64  // FAST int64
+#define DECIMAL_MANTISSA_GROUPS 10  // 7-bit groups of an int64 on the wire
+#define DECIMAL_EXPONENT_BITS   7   // one 7-bit group
+#define DECIMAL_MAX_EXPONENT    2   // 10^3 is already outside the fix16 range
+#define DECIMAL_MAX_SCALE       8   // finest exponent the decoder accepts
+#define DECIMAL_SATURATION_BITS 34  // 2^34 / 5^8 > 2^15: larger dividends saturate
+#define DECIMAL_DIVIDEND_BITS   35  // dividend + 5^8 / 2 < 2^35
+#define DECIMAL_ENCODE_DIGITS   3
+
+typedef ap_int<DECIMAL_MANTISSA_BITS> decimal_mantissa;
+typedef ap_int<DECIMAL_EXPONENT_BITS> decimal_exponent;
+
+constexpr uint64_t decimal_pow(unsigned base, unsigned k) {
+    return k == 0 ? 1 : base * decimal_pow(base, k - 1);
+}
+
+constexpr unsigned decimal_ceil_log2(uint64_t value, unsigned bits = 0) {
+    return (1ULL << bits) >= value ? bits : decimal_ceil_log2(value, bits + 1);
+}
+
+constexpr unsigned decimal_reciprocal_shift(unsigned k) {
+    return DECIMAL_DIVIDEND_BITS + decimal_ceil_log2(decimal_pow(5, k));
+}
+
+constexpr uint64_t decimal_reciprocal(unsigned k) {
+    return ((1ULL << decimal_reciprocal_shift(k)) + decimal_pow(5, k) - 1) / decimal_pow(5, k);
+}
+
+static const ap_uint<10> DECIMAL_POW10[DECIMAL_ENCODE_DIGITS + 1] = {
+    decimal_pow(10, 0), decimal_pow(10, 1), decimal_pow(10, 2), decimal_pow(10, 3)
+};
+
+static const ap_uint<19> DECIMAL_POW5[DECIMAL_MAX_SCALE + 1] = {
+    decimal_pow(5, 0), decimal_pow(5, 1), decimal_pow(5, 2),
+    decimal_pow(5, 3), decimal_pow(5, 4), decimal_pow(5, 5),
+    decimal_pow(5, 6), decimal_pow(5, 7), decimal_pow(5, 8)
+};
+
+static const ap_uint<36> DECIMAL_RECIPROCAL[DECIMAL_MAX_SCALE + 1] = {
+    decimal_reciprocal(0), decimal_reciprocal(1), decimal_reciprocal(2),
+    decimal_reciprocal(3), decimal_reciprocal(4), decimal_reciprocal(5),
+    decimal_reciprocal(6), decimal_reciprocal(7), decimal_reciprocal(8)
+};
+
+static const ap_uint<6> DECIMAL_RECIPROCAL_SHIFT[DECIMAL_MAX_SCALE + 1] = {
+    decimal_reciprocal_shift(0), decimal_reciprocal_shift(1), decimal_reciprocal_shift(2),
+    decimal_reciprocal_shift(3), decimal_reciprocal_shift(4), decimal_reciprocal_shift(5),
+    decimal_reciprocal_shift(6), decimal_reciprocal_shift(7), decimal_reciprocal_shift(8)
+};
+
+// round(magnitude * 2^FIX16_FRAC_BITS / 10^scale), ties away from zero, for
+// scale <= DECIMAL_MAX_SCALE. Anything from 2^DECIMAL_SATURATION_BITS / 5^scale
+// up is outside fix16 and comes back as 2^16.
+inline ap_uint<DECIMAL_SATURATION_BITS> decimal_divide_pow10(ap_uint<DECIMAL_MANTISSA_BITS> magnitude, ap_uint<4> scale) {
+#pragma HLS INLINE
+    ap_uint<DECIMAL_MANTISSA_BITS + FIX16_FRAC_BITS> shifted =
+            ap_uint<DECIMAL_MANTISSA_BITS + FIX16_FRAC_BITS>(magnitude) << (FIX16_FRAC_BITS - scale);
+    if ((shifted >> DECIMAL_SATURATION_BITS) != 0) {
+        return 0x10000;
+    }
+    // 5^scale is odd, so there are no exact ties and half of it rounds
+    ap_uint<DECIMAL_DIVIDEND_BITS> dividend = ap_uint<DECIMAL_DIVIDEND_BITS>(shifted) + (DECIMAL_POW5[scale] >> 1);
+    ap_uint<72> product = ap_uint<72>(dividend) * DECIMAL_RECIPROCAL[scale];
+    return product >> DECIMAL_RECIPROCAL_SHIFT[scale];
+}
+
+// Exponents a feed may send. Coarser ones saturate every non-zero price and
+// finer ones are not used by the feed, so the decoder rejects the message.
+inline bool decimal_exponent_valid(decimal_exponent exponent) {
+#pragma HLS INLINE
+    return exponent >= -DECIMAL_MAX_SCALE && exponent <= DECIMAL_MAX_EXPONENT;
+}
+
+inline fix16 decimal_to_fix16(decimal_mantissa mantissa, decimal_exponent exponent) {
+#pragma HLS INLINE
+    bool negative = mantissa < 0;
+    // -mantissa wraps for the most negative int64, whose magnitude is still 2^63 unsigned
+    ap_uint<DECIMAL_MANTISSA_BITS> magnitude = negative ? ap_uint<DECIMAL_MANTISSA_BITS>(-mantissa) : ap_uint<DECIMAL_MANTISSA_BITS>(mantissa);
+
+    ap_uint<DECIMAL_SATURATION_BITS> raw_magnitude;
+    if (exponent > DECIMAL_MAX_EXPONENT) {
+        raw_magnitude = magnitude != 0 ? 0x10000 : 0;
+    } else if (exponent >= 0) {
+        // 2^16 and up saturates at every exponent
+        ap_uint<16> low = magnitude;
+        raw_magnitude = (magnitude >> 16) != 0 ? ap_uint<DECIMAL_SATURATION_BITS>(0x10000)
+                                               : ap_uint<DECIMAL_SATURATION_BITS>((ap_uint<34>(low) << FIX16_FRAC_BITS) * DECIMAL_POW10[exponent]);
+    } else if (exponent < -DECIMAL_MAX_SCALE) {
+        raw_magnitude = 0;
+    } else {
+        raw_magnitude = decimal_divide_pow10(magnitude, -exponent);
+    }
+
+    // Saturate to [-2^15, 2^15 - 1]
+    ap_uint<16> limit = negative ? 0x8000 : 0x7FFF;
+    ap_uint<16> clamped = raw_magnitude > limit ? limit : ap_uint<16>(raw_magnitude);
+    fix16 value;
+    value.range(15, 0) = negative ? ap_uint<16>(-clamped) : clamped;
+    return value;
+}
+
+inline void fix16_to_decimal(fix16 value, decimal_mantissa& mantissa, decimal_exponent& exponent) {
+#pragma HLS INLINE
+    ap_int<16> raw = value.range(15, 0);
+    bool negative = raw < 0;
+    ap_uint<16> magnitude = negative ? ap_uint<16>(-raw) : ap_uint<16>(raw);
+
+    // All candidate scales are tried side by side; the shortest exact one wins
+    ap_uint<DECIMAL_MANTISSA_BITS> best = 0;
+    ap_uint<2> best_scale = DECIMAL_ENCODE_DIGITS;
+    bool found = false;
+    for (unsigned k = 0; k <= DECIMAL_ENCODE_DIGITS; k++) {
+#pragma HLS UNROLL
+        ap_uint<26> scaled = ap_uint<26>(magnitude) * DECIMAL_POW10[k];
+        ap_uint<DECIMAL_MANTISSA_BITS> candidate = (scaled + (1 << (FIX16_FRAC_BITS - 1))) >> FIX16_FRAC_BITS;
+        ap_uint<DECIMAL_SATURATION_BITS> back = decimal_divide_pow10(candidate, k);
+        if (!found && back == magnitude) {
+            found = true;
+            best = candidate;
+            best_scale = k;
+        }
+    }
+    mantissa = negative ? decimal_mantissa(-best) : decimal_mantissa(best);
+    exponent = -decimal_exponent(best_scale);
+}
+
+#endif  // FAST_DECIMAL_H
@@ -6,16 +6,19 @@ the encoded data correctly.
 decode_uint8 Function: This inline function decodes an 8-bit unsigned integer from the encoded message. It extracts a byte from 
 the encoded message, applying a mask to retrieve only the relevant bits, and advances the message offset.
 
-decode_uint32 Function: This inline function decodes a 32-bit unsigned integer. It iteratively calls decode_uint8 to construct the 
-integer, checking for the stop bit to know when the value ends.
+stop_bit_mask Function: Collects the stop bit of all 16 message bytes into one 16-bit mask in a single step (one pmovmskb 
+on SSE2 hosts). Every field boundary is then read from the mask instead of testing STOP_BIT byte by byte.
 
-decode_decimal_to_fix16 Function: It decodes a fixed-point number from the message. The function first decodes an exponent and a 
-mantissa, then combines them to form the decimal number. This function is essential for interpreting price information, which often 
+decode_uint32 Function: This inline function decodes a 32-bit unsigned integer. It concatenates the 7-bit groups up to the 
+field end taken from the stop-bit mask.
+
+decode_decimal_to_fix16 Function: It decodes a fixed-point number from the message. The function first decodes a signed exponent 
+and a signed mantissa, then scales them exactly into a fix16 with the integer scaler from decimal.h. This function is essential for interpreting price information, which often 
 requires high precision.
 
 decode_fast_message Function: The core function that orchestrates the decoding process. It unpacks two 64-bit packets into a byte 
-array, interpreting the data based on the FAST protocol. The function then sequentially decodes different parts of the message, 
-including price, size, order ID, and type, storing them in a provided order structure.
+array, interpreting the data based on the FAST protocol. The field ends are taken from the stop-bit mask 
+up front, then price, size, order ID, and type are decoded and stored in a provided order structure.
 
 Error Handling: The decode_fast_message function includes a preliminary check for invalid input packets, ensuring that the decoding 
 process only proceeds with valid data.
@@ -25,8 +28,12 @@ aiming to optimize the FPGA's parallel processing capabilities.
  */
 
 #include "decoder.h"
+#include "decimal.h"
 #include <cstdint> 
 #include <array>   
+#if defined(__SSE2__) && !defined(__SYNTHESIS__)
+#include <emmintrin.h>
+#endif
 
 // Constants for bit manipulation
 #define STOP_BIT    0x80
@@ -35,43 +42,52 @@ aiming to optimize the FPGA's parallel processing capabilities.
 #define NUMBER_OF_VALID_BITS_IN_BYTE    7
 #define BYTE_SHIFT  8  // Define BYTE_SHIFT for clarity
 
+inline uint16_t Fast_Decoder::stop_bit_mask(const uint8_t *encoded_message) {
+#if defined(__SSE2__) && !defined(__SYNTHESIS__)
+    // pmovmskb collects the MSB of all 16 bytes at once
+    return static_cast<uint16_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(encoded_message))));
+#else
+    uint16_t mask = 0;
+    #pragma HLS UNROLL
+    for (int i = 0; i < MESSAGE_BUFF_SIZE; ++i) {
+        mask |= static_cast<uint16_t>((encoded_message[i] & STOP_BIT) >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
 inline uint8_t Fast_Decoder::decode_uint8(const uint8_t *encoded_message, unsigned &message_offset) {
     return encoded_message[message_offset++] & VALID_DATA;
 }
 
-inline uint32_t Fast_Decoder::decode_uint32(const uint8_t *encoded_message, unsigned &message_offset) {
+inline uint32_t Fast_Decoder::decode_uint32(const uint8_t *encoded_message, unsigned &message_offset, unsigned field_end) {
     uint32_t value = 0;
     #pragma HLS UNROLL factor=5
     for (int i = 0; i < 5; ++i) {
-        uint8_t byte = decode_uint8(encoded_message, message_offset);
-        value = (value << NUMBER_OF_VALID_BITS_IN_BYTE) | byte;
-        if (encoded_message[message_offset - 1] & STOP_BIT) {
-            break;
+        if (message_offset <= field_end) {
+            value = (value << NUMBER_OF_VALID_BITS_IN_BYTE) | decode_uint8(encoded_message, message_offset);
         }
     }
     return value;
 }
 
-inline fix16 Fast_Decoder::decode_decimal_to_fix16(const uint8_t *encoded_message, unsigned &message_offset) {
+inline fix16 Fast_Decoder::decode_decimal_to_fix16(const uint8_t *encoded_message, unsigned &message_offset, unsigned mantissa_end) {
     #pragma HLS PIPELINE
-    int8_t exponent = static_cast<int8_t>(encoded_message[message_offset] & VALID_DATA);
-    if (encoded_message[message_offset] & SIGN_BIT) {
-        exponent = -exponent;
-    }
+    // Both parts are signed FAST integers: bit 6 of the first byte is the sign
+    decimal_exponent exponent = encoded_message[message_offset] & VALID_DATA;
     message_offset++;
 
-    uint32_t mantissa = 0;
-    #pragma HLS UNROLL factor=3
-    for (int i = 0; i < 3; i++) {
-        mantissa = (mantissa << NUMBER_OF_VALID_BITS_IN_BYTE) | (encoded_message[message_offset] & VALID_DATA);
-        if (encoded_message[message_offset++] & STOP_BIT) {
-            break;
+    // The mantissa is an int64 of up to DECIMAL_MANTISSA_GROUPS groups
+    int64_t mantissa = (encoded_message[message_offset] & SIGN_BIT) ? -1 : 0;
+    #pragma HLS UNROLL factor=10
+    for (int i = 0; i < DECIMAL_MANTISSA_GROUPS; i++) {
+        if (message_offset <= mantissa_end) {
+            mantissa = static_cast<int64_t>(static_cast<uint64_t>(mantissa) << NUMBER_OF_VALID_BITS_IN_BYTE) |
+                       decode_uint8(encoded_message, message_offset);
         }
     }
 
-    // Simplify or use a lookup table for pow(10, exponent) if possible
-    fix16 value = mantissa * pow(10, exponent); // Ensure pow is optimized for fixed-point
-    return value;
+    return decimal_to_fix16(mantissa, exponent);
 }
 
 void Fast_Decoder::decode_fast_message(uint64_t &first_packet, uint64_t &second_packet, order &decoded_message) {
@@ -92,10 +108,26 @@ void Fast_Decoder::decode_fast_message(uint64_t &first_packet, uint64_t &second_
         encoded_message[i + NUM_BYTES_IN_PACKET] = static_cast<uint8_t>(second_packet >> (BYTE_SHIFT * i));
     }
 
-    // Direct decoding, assuming offset based on protocol specifics
-    unsigned message_offset = 2;
-    decoded_message.price = decode_decimal_to_fix16(encoded_message, message_offset);
-    decoded_message.size = decode_uint8(encoded_message, message_offset);
-    decoded_message.orderID = decode_uint32(encoded_message, message_offset);
+    // All field ends come from one mask: the k-th set bit ends field k
+    uint16_t stop_bits = stop_bit_mask(encoded_message);
+    unsigned field_end[MESSAGE_STOP_BITS];
+    for (unsigned k = 0; k < MESSAGE_STOP_BITS; k++) {
+        // Lowest set bit, from an unrolled scan rather than a ctz builtin
+        field_end[k] = MESSAGE_BUFF_SIZE - 1;
+        #pragma HLS UNROLL
+        for (int i = MESSAGE_BUFF_SIZE - 1; i >= 0; --i) {
+            if ((stop_bits >> i) & 1) {
+                field_end[k] = i;
+            }
+        }
+        stop_bits &= stop_bits - 1;
+    }
+
+    // Presence map and template ID are followed by exponent, mantissa, size, orderID and type
+    unsigned message_offset = field_end[1] + 1;
+    decoded_message.price = decode_decimal_to_fix16(encoded_message, message_offset, field_end[3]);
+    message_offset = field_end[3] + 1;
+    decoded_message.size = decode_uint32(encoded_message, message_offset, field_end[4]);
+    decoded_message.orderID = decode_uint32(encoded_message, message_offset, field_end[5]);
     decoded_message.type = decode_uint8(encoded_message, message_offset);
 }
@@ -18,14 +18,17 @@ public:
                                     order & decoded_message);
 
 private:
+    // Gathers the stop bit of every message byte into one mask (bit i = byte i)
+    static inline uint16_t stop_bit_mask(const uint8_t *encoded_message);
+
     // Decodes a uint8_t value from the encoded message
     static inline uint8_t decode_uint8(const uint8_t *encoded_message, unsigned &message_offset);
     
-    // Decodes a uint32_t value from the encoded message
-    static inline uint32_t decode_uint32(const uint8_t *encoded_message, unsigned &message_offset);
+    // Decodes a uint32_t value that ends at field_end from the encoded message
+    static inline uint32_t decode_uint32(const uint8_t *encoded_message, unsigned &message_offset, unsigned field_end);
     
-    // Decodes a fix16 decimal value from the encoded message
-    static inline fix16 decode_decimal_to_fix16(const uint8_t *encoded_message, unsigned &message_offset);
+    // Decodes a fix16 decimal value whose mantissa ends at mantissa_end from the encoded message
+    static inline fix16 decode_decimal_to_fix16(const uint8_t *encoded_message, unsigned &message_offset, unsigned mantissa_end);
     
     // Decodes a 2-bit unsigned integer value from the encoded message
     static void decode_uint_to_uint2(const uint8_t encoded_message[MESSAGE_BUFF_SIZE],
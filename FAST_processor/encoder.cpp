@@ -11,12 +11,11 @@
   3.The encoded data is carefully assembled into larger packets for transmission, adhering to the requirements of 
   the FAST protocol and the needs of high-frequency trading systems.*/
 #include "encoder.h"
+#include "decimal.h"
 #include <ap_fixed.h>
 #include <cstdint> 
 
 
-#define pow(x,y)  exp(y*log(x))
-
 #define PRICE_FIELD_EXP_NUM		0
 #define PRICE_FIELD_MAN_NUM		1
 #define SIZE_FIELD_NUM			2
@@ -93,12 +92,16 @@ void Fast_Encoder::encode_decimal_from_fix16(const fix16& decoded_fix16,
                                              unsigned exponent_offset,
                                              unsigned& mantissa_offset,
                                              uint8_t encoded_message[BUFF_SIZE_2]) {
+    // Shortest decimal that decodes back to the same fix16, no floating point
+    decimal_mantissa mantissa;
+    decimal_exponent exponent;
+    fix16_to_decimal(decoded_fix16, mantissa, exponent);
+
     // Encode exponent
-    encoded_message[exponent_offset] = 0xF8; // exponent is always -8
+    encoded_message[exponent_offset] = STOP_BIT2 | (exponent.to_int() & VALID_DATA2);
 
     // Encode mantissa
-    int64_t mantissa = static_cast<int64_t>(static_cast<float>(decoded_fix16) * std::pow(10, 8));
-    encode_signed_int(encoded_message, mantissa_offset, mantissa);
+    encode_signed_int(encoded_message, mantissa_offset, mantissa.to_int());
 }
 
 // Generic encoding functions for integers with variable length encoding
@@ -116,11 +119,22 @@ void encode_generic_integer(uint64_t value, unsigned& offset, uint8_t encoded_me
     }
 }
 
-// Simplifying the encoding functions using the generic integer encoding
+// Signed integers use as many 7-bit groups as needed for bit 6 of the first one to hold the sign,
+// up to the DECIMAL_MANTISSA_GROUPS groups the decoder takes for a full int64
 void Fast_Encoder::encode_signed_int(uint8_t encoded_message[BUFF_SIZE_2],
                                      unsigned& mantissa_offset,
                                      int64_t mantissa) {
-    encode_generic_integer(mantissa, mantissa_offset, encoded_message);
+    int groups = 1;
+    while (groups < DECIMAL_MANTISSA_GROUPS && (mantissa >= (int64_t(1) << (7 * groups - 1)) || mantissa < -(int64_t(1) << (7 * groups - 1)))) {
+        groups++;
+    }
+    for (int group = groups - 1; group >= 0; --group) {
+        uint8_t byte = (mantissa >> (group * 7)) & VALID_DATA2;
+        if (group == 0) {
+            byte |= STOP_BIT2;
+        }
+        encoded_message[mantissa_offset++] = byte;
+    }
 }
 
 void Fast_Encoder::encode_uint_from_uint32(uint32_t decoded_uint32,
@@ -38,6 +38,11 @@ public:
                                     unsigned& message_offset,
                                     ap_uint<8> encoded_message[BUFF_SIZE_2]); // Adjusted type
 
+    // FAST int64: the full range, in up to 10 groups
+    static void encode_signed_int(uint8_t encoded_message[BUFF_SIZE_2],
+                                  unsigned& mantissa_offset,
+                                  int64_t mantissa);
+
 
 private:
     // Function prototypes adjusted to match the optimized implementation
@@ -46,10 +51,6 @@ private:
                                           unsigned& mantissa_offset,
                                           uint8_t encoded_message[BUFF_SIZE_2]);
 
-    static void encode_signed_int(uint8_t encoded_message[BUFF_SIZE_2],
-                                  unsigned& mantissa_offset,
-                                  int64_t mantissa);
-
     static void encode_uint_from_uint32(uint32_t decoded_uint32,
                                         unsigned& message_offset,
                                         uint8_t encoded_message[BUFF_SIZE_2]);
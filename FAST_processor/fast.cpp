@@ -1,12 +1,23 @@
 /*How does this work:
 
   1.The system waits for packets on the reception path, handling metadata and buffering packet data for decoding.
+  Every port of PORT_TABLE is opened at startup. Packets arrive on two redundant feeds; an arbiter forwards the
+  first copy of every sequence number of each channel, drops the duplicate and reports sequence gaps. Decoded
+  orders go to the book streams of their channel.
   
-  2.Upon receiving complete packet data (either in one or two parts), the system decodes the FAST message into 
-  an order and handles it accordingly.
+  2.The receive path accepts one AXI word per invocation into a small byte buffer. A datagram may carry any number
+  of messages: each invocation retires the message at the head of the buffer (its fields are located at once from
+  the stop-bit vector of the window with a prefix count, then gathered side by side), writes
+  it to the book tagged with the datagram's timestamp, and appends the next AXI word behind it. Messages are decoded
+  with the template dictionary of templates.h: the presence map and the field operators (copy, increment, delta,
+  default) of the template decide which fields are on the wire and what the absent ones are.
+  Malformed messages (unknown template, no stop bit within MESSAGE_BUFF_SIZE bytes, type out of range, price
+  exponent out of range or mantissa wider than an int64) are dropped in the same pass and counted per error class
+  in AXI-lite registers.
   
-  3.On the transmission side, the system encodes orders into FAST protocol messages and prepares them for network 
-  transmission in AXI word structures.
+  3.On the transmission side, the system encodes orders into FAST protocol messages (template 1, every field sent,
+  each field as short as its value allows) and packs consecutive orders for the same destination into one frame,
+  sent when it is full, when the destination changes or after a flush timeout.
   
   4.The entire process is managed through state machines that ensure correct sequencing of operations and handling 
   of network protocols.*/
@@ -14,8 +25,8 @@
 #include "fast.h"
 #include "decoder.h"
 #include "encoder.h"
-
-#define PORT 750
+#include "decimal.h"
+#include "templates.h"
 
 #define STOP_BIT    0x80
 #define VALID_DATA  0x7F
@@ -23,144 +34,734 @@
 
 #define NUMBER_OF_VALID_BITS_IN_BYTE    7
 
-#define pow(x,y)  exp(y*log(x))
+#define FEED_A                  0
+#define FEED_B                  1
+#define NUM_FEEDS               2
+
+#define PMAP_FIELD_NUM          0
+#define TEMPLATE_ID_FIELD_NUM   1   // only when the presence map carries it
+
+// Collects the stop bit (MSB) of every byte in the window into one vector,
+// ignoring bytes outside `valid`.
+ap_uint<MESSAGE_BUFF_SIZE> stop_bit_vector(const ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE],
+                                           ap_uint<MESSAGE_BUFF_SIZE> valid) {
+#pragma HLS INLINE
+    ap_uint<MESSAGE_BUFF_SIZE> stop_bits = 0;
+    for (unsigned i = 0; i < MESSAGE_BUFF_SIZE; i++) {
+#pragma HLS UNROLL
+        stop_bits[i] = encoded_message[i][BYTE - 1];
+    }
+    return stop_bits & valid;
+}
 
-#define PRICE_FIELD_EXP_NUM     0
-#define PRICE_FIELD_MAN_NUM     1
-#define SIZE_FIELD_NUM          2
-#define ORDER_ID_FIELD_NUM      3
-#define TYPE_FIELD_NUM          4
+// Derives the last byte of every field from the stop-bit vector at once.
+// An inclusive prefix count (log2(MESSAGE_BUFF_SIZE) adder stages) gives each
+// byte the number of stop bits up to and including it; byte i ends field k
+// when it carries a stop bit and its count is k + 1. No field position depends
+// on the previous field's offset. fields_found is the number of terminated
+// fields in the window.
+void locate_fields(ap_uint<MESSAGE_BUFF_SIZE> stop_bits,
+                   ap_uint<4> field_end[MESSAGE_STOP_BITS],
+                   ap_uint<5>& fields_found) {
+#pragma HLS INLINE
+    ap_uint<5> stop_count[MESSAGE_BUFF_SIZE];
+#pragma HLS ARRAY_PARTITION variable=stop_count complete dim=1
+    for (unsigned i = 0; i < MESSAGE_BUFF_SIZE; i++) {
+#pragma HLS UNROLL
+        stop_count[i] = stop_bits[i];
+    }
 
-void decode_and_process_order(const ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE], order& temp_order) {
-    // Assuming definitions of these constants are available
-    // NUMBER_OF_VALID_BITS_IN_BYTE, STOP_BIT, VALID_DATA
+    PREFIX_COUNT:
+    for (unsigned distance = 1; distance < MESSAGE_BUFF_SIZE; distance <<= 1) {
+#pragma HLS UNROLL
+        ap_uint<5> next_count[MESSAGE_BUFF_SIZE];
+        for (unsigned i = 0; i < MESSAGE_BUFF_SIZE; i++) {
+#pragma HLS UNROLL
+            next_count[i] = i >= distance ? ap_uint<5>(stop_count[i] + stop_count[i - distance]) : stop_count[i];
+        }
+        for (unsigned i = 0; i < MESSAGE_BUFF_SIZE; i++) {
+#pragma HLS UNROLL
+            stop_count[i] = next_count[i];
+        }
+    }
 
-    unsigned message_offset = 2;  // Starting offset after metadata
-    fix16 price_buff = 0;
-    uint8 size_buff = 0;
-    uint32 orderID_buff = 0;
-    uint3 order_type_buff = 0;
+    for (unsigned k = 0; k < MESSAGE_STOP_BITS; k++) {
+#pragma HLS UNROLL
+        ap_uint<4> end = 0;
+        for (unsigned i = 0; i < MESSAGE_BUFF_SIZE; i++) {
+#pragma HLS UNROLL
+            // At most one byte matches, so the selection reduces to an OR
+            if (stop_bits[i] && stop_count[i] == k + 1) {
+                end |= i;
+            }
+        }
+        field_end[k] = end;
+    }
+    fields_found = stop_count[MESSAGE_BUFF_SIZE - 1];
+}
 
-    // Decode Price Field
-    ap_int<7> decoded_exponent = (encoded_message[message_offset++] & 0x7F);
-    ap_uint<21> decoded_mantissa = 0;
+// Gathers the 7-bit groups of the field that spans bytes start..end. Only the
+// last MAX_BYTES bytes of a longer field are kept.
+template <int W, int MAX_BYTES>
+ap_uint<W> gather_field(const ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE],
+                        ap_uint<4> start,
+                        ap_uint<4> end) {
+#pragma HLS INLINE
+    ap_uint<W> value = 0;
+    for (int j = 0; j < MAX_BYTES; j++) {
+#pragma HLS UNROLL
+        int position = end - j;
+        if (position >= (int)start) {
+            value |= ap_uint<W>(encoded_message[position] & VALID_DATA) << (NUMBER_OF_VALID_BITS_IN_BYTE * j);
+        }
+    }
+    return value;
+}
 
-    // Decode Mantissa Field
-    if ((encoded_message[message_offset] & STOP_BIT) != STOP_BIT) {
-        decoded_mantissa = (decoded_mantissa << NUMBER_OF_VALID_BITS_IN_BYTE) | (encoded_message[message_offset++]);
+// Same as gather_field for a signed FAST integer: bit 6 of the field's first
+// byte is its sign.
+template <int W, int MAX_BYTES>
+ap_int<W> gather_signed_field(const ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE],
+                              ap_uint<4> start,
+                              ap_uint<4> end) {
+#pragma HLS INLINE
+    ap_uint<W> value = gather_field<W, MAX_BYTES>(encoded_message, start, end);
+    ap_uint<4> length = end - start + 1;
+    if ((encoded_message[start] & SIGN_BIT) == SIGN_BIT) {
+        for (int j = 0; j < W; j++) {
+#pragma HLS UNROLL
+            if (j >= NUMBER_OF_VALID_BITS_IN_BYTE * length.to_int()) {
+                value[j] = 1;
+            }
+        }
     }
+    return value;
+}
 
-    if ((encoded_message[message_offset] & STOP_BIT) != STOP_BIT) {
-        decoded_mantissa = (decoded_mantissa << NUMBER_OF_VALID_BITS_IN_BYTE) | (encoded_message[message_offset++]);
+// Gathers wire field k, which starts right after field k - 1 ends
+template <int W, int MAX_BYTES, bool SIGNED>
+ap_uint<W> gather_wire_field(const ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE],
+                             const ap_uint<4> field_end[MESSAGE_STOP_BITS],
+                             ap_uint<3> k) {
+#pragma HLS INLINE
+    ap_uint<4> start = field_end[k - 1] + 1;
+    if (SIGNED) {
+        return gather_signed_field<W, MAX_BYTES>(encoded_message, start, field_end[k]);
     }
+    return gather_field<W, MAX_BYTES>(encoded_message, start, field_end[k]);
+}
 
-    // Extract last byte of data
-    decoded_mantissa = (decoded_mantissa << NUMBER_OF_VALID_BITS_IN_BYTE) | (encoded_message[message_offset++] & VALID_DATA);
-    
-    // Assuming powers_of_ten is defined and accessible
-    float powers_of_ten[4] = { 1, 0.1, 0.01, 0.001 };
-    price_buff = decoded_mantissa * (powers_of_ten[(-1 * decoded_exponent)]);
+// Which value fields of template T are on the wire. The presence map bits of
+// the fields follow the template ID bit, in field order, and only operators
+// that use one take one, so every bit position is a constant.
+template <class T>
+void template_presence(ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> pmap,
+                       bool transmitted[ORDER_VALUE_FIELDS]) {
+#pragma HLS INLINE
+    const int price_bit = PMAP_TEMPLATE_ID_BIT - 1;
+    const int size_bit = price_bit - T::price_op::uses_pmap;
+    const int order_id_bit = size_bit - T::size_op::uses_pmap;
+    const int type_bit = order_id_bit - T::order_id_op::uses_pmap;
+    transmitted[PRICE_VALUE_NUM] = !T::price_op::uses_pmap || pmap[price_bit];
+    transmitted[SIZE_VALUE_NUM] = !T::size_op::uses_pmap || pmap[size_bit];
+    transmitted[ORDER_ID_VALUE_NUM] = !T::order_id_op::uses_pmap || pmap[order_id_bit];
+    transmitted[TYPE_VALUE_NUM] = !T::type_op::uses_pmap || pmap[type_bit];
+}
 
-    // Decode Size Field
-    if ((encoded_message[message_offset] & STOP_BIT) != STOP_BIT) {
-        size_buff = (size_buff << NUMBER_OF_VALID_BITS_IN_BYTE) | (encoded_message[message_offset++]);
-    }
-    size_buff = (size_buff << NUMBER_OF_VALID_BITS_IN_BYTE) | (encoded_message[message_offset++] & VALID_DATA);
+// Number of value fields (stop bits) a message of template T carries
+template <class T>
+ap_uint<3> template_fields(ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> pmap) {
+#pragma HLS INLINE
+    bool transmitted[ORDER_VALUE_FIELDS];
+    template_presence<T>(pmap, transmitted);
+    return (transmitted[PRICE_VALUE_NUM] ? 2 : 0) + transmitted[SIZE_VALUE_NUM] +
+           transmitted[ORDER_ID_VALUE_NUM] + transmitted[TYPE_VALUE_NUM];
+}
 
-    // Decode Order ID Field
-    for (unsigned i = 0; i < 4; i++) {
-        if ((encoded_message[message_offset] & STOP_BIT) == STOP_BIT) {
-            break;
-        }
-        orderID_buff = (orderID_buff << NUMBER_OF_VALID_BITS_IN_BYTE) | (encoded_message[message_offset++]);
-    }
-    orderID_buff = (orderID_buff << NUMBER_OF_VALID_BITS_IN_BYTE) | (encoded_message[message_offset++] & VALID_DATA);
+// Wire field k is a single byte
+bool single_byte_field(const ap_uint<4> field_end[MESSAGE_STOP_BITS], ap_uint<3> k) {
+#pragma HLS INLINE
+    return field_end[k] == ap_uint<4>(field_end[k - 1] + 1);
+}
 
-    // Decode Type Field
-    order_type_buff = (encoded_message[message_offset] & VALID_DATA);
+// Decoder of template T. Every channel has its own dictionary (the previous
+// value of every field), which holds the initial values of the template until
+// the channel's first order of T and afterwards only moves when `commit` is
+// set and the message is valid, i.e. when the order is written out. The
+// checks run on the gathered fields in the same pass: the exponent has to be
+// one byte within [-DECIMAL_MAX_SCALE, DECIMAL_MAX_EXPONENT], the mantissa an
+// int64 of at most DECIMAL_MANTISSA_GROUPS bytes and the type one byte up to
+// MAX_ORDER_TYPE.
+template <class T>
+void decode_template(const ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE],
+                     const ap_uint<4> field_end[MESSAGE_STOP_BITS],
+                     ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> pmap,
+                     ap_uint<2> header_fields,
+                     ap_uint<8> channel,
+                     bool commit,
+                     order& temp_order,
+                     bool& price_valid,
+                     bool& type_valid) {
+#pragma HLS INLINE
+    typedef typename T::price_op price_op;
+    typedef typename T::size_op size_op;
+    typedef typename T::order_id_op order_id_op;
+    typedef typename T::type_op type_op;
+
+    static bool dictionary_set[NUM_CHANNELS] = {};
+    static decimal_exponent dictionary_exponent[NUM_CHANNELS];
+    static decimal_mantissa dictionary_mantissa[NUM_CHANNELS];
+    static uint8 dictionary_size[NUM_CHANNELS];
+    static uint32 dictionary_orderID[NUM_CHANNELS];
+    static uint8 dictionary_type[NUM_CHANNELS];
+#pragma HLS ARRAY_PARTITION variable=dictionary_set complete dim=1
+#pragma HLS ARRAY_PARTITION variable=dictionary_exponent complete dim=1
+#pragma HLS ARRAY_PARTITION variable=dictionary_mantissa complete dim=1
+#pragma HLS ARRAY_PARTITION variable=dictionary_size complete dim=1
+#pragma HLS ARRAY_PARTITION variable=dictionary_orderID complete dim=1
+#pragma HLS ARRAY_PARTITION variable=dictionary_type complete dim=1
+
+    bool set = dictionary_set[channel];
+    decimal_exponent previous_exponent = set ? dictionary_exponent[channel] : decimal_exponent(price_op::initial_exponent);
+    decimal_mantissa previous_mantissa = set ? dictionary_mantissa[channel] : decimal_mantissa(price_op::initial_value);
+    uint8 previous_size = set ? dictionary_size[channel] : uint8(size_op::initial_value);
+    uint32 previous_orderID = set ? dictionary_orderID[channel] : uint32(order_id_op::initial_value);
+    uint8 previous_type = set ? dictionary_type[channel] : uint8(type_op::initial_value);
+
+    bool transmitted[ORDER_VALUE_FIELDS];
+#pragma HLS ARRAY_PARTITION variable=transmitted complete dim=1
+    template_presence<T>(pmap, transmitted);
+
+    // Absent fields take no stop bit, so each field sits right after the
+    // last transmitted one and all of them are still gathered side by side.
+    ap_uint<3> exp_field = header_fields;
+    ap_uint<3> man_field = exp_field + 1;
+    ap_uint<3> size_field = exp_field + (transmitted[PRICE_VALUE_NUM] ? 2 : 0);
+    ap_uint<3> id_field = size_field + transmitted[SIZE_VALUE_NUM];
+    ap_uint<3> type_field = id_field + transmitted[ORDER_ID_VALUE_NUM];
+
+    decimal_exponent exponent = price_op::apply(transmitted[PRICE_VALUE_NUM],
+            decimal_exponent(gather_wire_field<DECIMAL_EXPONENT_BITS, 1, true>(encoded_message, field_end, exp_field)),
+            previous_exponent, decimal_exponent(price_op::initial_exponent));
+    decimal_mantissa mantissa = price_op::apply(transmitted[PRICE_VALUE_NUM],
+            decimal_mantissa(gather_wire_field<DECIMAL_MANTISSA_BITS, DECIMAL_MANTISSA_GROUPS, true>(encoded_message, field_end, man_field)),
+            previous_mantissa, decimal_mantissa(price_op::initial_value));
+    uint8 size_buff = size_op::apply(transmitted[SIZE_VALUE_NUM],
+            gather_wire_field<8, 2, size_op::signed_wire>(encoded_message, field_end, size_field),
+            previous_size, uint8(size_op::initial_value));
+    uint32 orderID_buff = order_id_op::apply(transmitted[ORDER_ID_VALUE_NUM],
+            gather_wire_field<32, 5, order_id_op::signed_wire>(encoded_message, field_end, id_field),
+            previous_orderID, uint32(order_id_op::initial_value));
+    // Gathered wider than an order type so out-of-range values are seen
+    uint8 order_type_buff = type_op::apply(transmitted[TYPE_VALUE_NUM],
+            gather_wire_field<8, 1, type_op::signed_wire>(encoded_message, field_end, type_field),
+            previous_type, uint8(type_op::initial_value));
+
+    // The mantissa has to fit the int64 it is gathered into: at most
+    // DECIMAL_MANTISSA_GROUPS groups, the first of which then only carries
+    // the sign extension of bit 63
+    ap_uint<4> man_start = field_end[man_field - 1] + 1;
+    ap_uint<4> man_groups = field_end[man_field] - man_start + 1;
+    ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> man_top = encoded_message[man_start] & VALID_DATA;
+    bool mantissa_fits = man_groups < DECIMAL_MANTISSA_GROUPS ||
+                         (man_groups == DECIMAL_MANTISSA_GROUPS && (man_top == 0 || man_top == VALID_DATA));
+    price_valid = (!transmitted[PRICE_VALUE_NUM] || (single_byte_field(field_end, exp_field) && mantissa_fits)) &&
+                  decimal_exponent_valid(exponent);
+    type_valid = (!transmitted[TYPE_VALUE_NUM] || single_byte_field(field_end, type_field)) &&
+                 order_type_buff <= MAX_ORDER_TYPE;
+
+    if (commit && price_valid && type_valid) {
+        dictionary_set[channel] = true;
+        dictionary_exponent[channel] = exponent;
+        dictionary_mantissa[channel] = mantissa;
+        dictionary_size[channel] = size_buff;
+        dictionary_orderID[channel] = orderID_buff;
+        dictionary_type[channel] = order_type_buff;
+    }
 
-    // Assigning decoded values to temp_order
-    temp_order.price = price_buff;
+    // Exact integer scaling of mantissa x 10^exponent, no floating point
+    temp_order.price = decimal_to_fix16(mantissa, exponent);
     temp_order.size = size_buff;
     temp_order.orderID = orderID_buff;
     temp_order.type = order_type_buff;
 }
 
+// Template dictionary lookup: every template is decoded side by side and the
+// template ID selects the result.
+bool known_template(ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> template_id) {
+#pragma HLS INLINE
+    return template_id == order_template::id || template_id == order_update_template::id;
+}
+
+ap_uint<3> message_value_fields(ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> template_id,
+                                ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> pmap) {
+#pragma HLS INLINE
+    return template_id == order_update_template::id ? template_fields<order_update_template>(pmap)
+                                                    : template_fields<order_template>(pmap);
+}
+
+void decode_and_process_order(const ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE],
+                              const ap_uint<4> field_end[MESSAGE_STOP_BITS],
+                              ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> pmap,
+                              ap_uint<2> header_fields,
+                              ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> template_id,
+                              ap_uint<8> channel,
+                              bool commit,
+                              order& temp_order,
+                              bool& price_valid,
+                              bool& type_valid) {
+#pragma HLS INLINE
+    order full_order;
+    order update_order;
+    bool full_price_valid, full_type_valid;
+    bool update_price_valid, update_type_valid;
+    decode_template<order_template>(encoded_message, field_end, pmap, header_fields, channel,
+                                    commit && template_id == order_template::id, full_order,
+                                    full_price_valid, full_type_valid);
+    decode_template<order_update_template>(encoded_message, field_end, pmap, header_fields, channel,
+                                           commit && template_id == order_update_template::id, update_order,
+                                           update_price_valid, update_type_valid);
+    bool update = template_id == order_update_template::id;
+    temp_order = update ? update_order : full_order;
+    price_valid = update ? update_price_valid : full_price_valid;
+    type_valid = update ? update_type_valid : full_type_valid;
+}
+
+// Number of 7-bit groups an unsigned field takes, from its leading zeros
+template <int W>
+ap_uint<3> unsigned_groups(ap_uint<W> value) {
+#pragma HLS INLINE
+    ap_uint<6> significant = W - value.countLeadingZeros();
+    return significant == 0 ? ap_uint<3>(1)
+                            : ap_uint<3>((significant + NUMBER_OF_VALID_BITS_IN_BYTE - 1) / NUMBER_OF_VALID_BITS_IN_BYTE);
+}
+
+// Same for a signed field, whose first group also has to hold the sign bit
+template <int W>
+ap_uint<3> signed_groups(ap_int<W> value) {
+#pragma HLS INLINE
+    ap_uint<W> magnitude_bits = value;
+    if (value < 0) {
+        magnitude_bits = ~magnitude_bits;
+    }
+    ap_uint<6> significant = W - magnitude_bits.countLeadingZeros() + 1;
+    return (significant + NUMBER_OF_VALID_BITS_IN_BYTE - 1) / NUMBER_OF_VALID_BITS_IN_BYTE;
+}
+
+// Writes the low `groups` 7-bit groups of value from offset on, most
+// significant first, with the stop bit on the last byte
+template <int W, int MAX_BYTES>
+void scatter_field(ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE],
+                   ap_uint<4>& offset,
+                   ap_uint<W> value,
+                   ap_uint<3> groups) {
+#pragma HLS INLINE
+    for (int j = 0; j < MAX_BYTES; j++) {
+#pragma HLS UNROLL
+        if (j < groups.to_int()) {
+            ap_uint<8> byte = (value >> (NUMBER_OF_VALID_BITS_IN_BYTE * j)) & VALID_DATA;
+            if (j == 0) {
+                byte |= STOP_BIT;
+            }
+            encoded_message[offset + groups - 1 - j] = byte;
+        }
+    }
+    offset += groups;
+}
+
+// Channel subscribed on `port`: every entry of the port table is compared at once
+void lookup_channel(ap_uint<16> port, ap_uint<8>& channel, bool& subscribed) {
+#pragma HLS INLINE
+    channel = 0;
+    subscribed = false;
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+#pragma HLS UNROLL
+        if (port == PORT_TABLE[c]) {
+            channel |= c;
+            subscribed = true;
+        }
+    }
+}
+
+// Takes the first copy of every packet from feed A or B. The first beat of
+// each packet is read as soon as it arrives and decided in the same
+// invocation: a sequence number below the next expected one is a duplicate
+// and the packet is dropped, otherwise it is forwarded with its header masked
+// out of `keep` (one feed at a time, A first when both copies arrive
+// together, so the B copy is dropped in that same invocation). A sequence
+// number past the expected one is reported on seq_gap_out. Every channel has
+// its own sequence, and packets for ports we did not subscribe to are dropped.
+void feedArbiter(stream<axiWord>& lbRxDataIn,
+                 stream<metadata>& lbRxMetadataIn,
+                 stream<ap_uint<64> >& tagsIn,
+                 stream<axiWord>& lbRxDataInB,
+                 stream<metadata>& lbRxMetadataInB,
+                 stream<ap_uint<64> >& tagsInB,
+                 stream<axiWord>& arbDataOut,
+                 stream<metadata>& arbMetadataOut,
+                 stream<ap_uint<64> >& arbTagsOut,
+                 stream<sequence_gap>& seq_gap_out) {
+#pragma HLS PIPELINE II=1
+
+    enum Feed_State {
+        HEAD = 0, FORWARD, DROP
+    };
+    static Feed_State feed_state[NUM_FEEDS] = { HEAD, HEAD };
+#pragma HLS ARRAY_PARTITION variable=feed_state complete dim=1
+
+    // First beat of the next packet of each feed, waiting for a decision
+    static bool head_valid[NUM_FEEDS] = { false, false };
+    static axiWord head_beat[NUM_FEEDS];
+    static metadata head_metadata[NUM_FEEDS];
+    static ap_uint<64> head_tag[NUM_FEEDS];
+#pragma HLS ARRAY_PARTITION variable=head_valid complete dim=1
+#pragma HLS ARRAY_PARTITION variable=head_beat complete dim=1
+#pragma HLS ARRAY_PARTITION variable=head_metadata complete dim=1
+#pragma HLS ARRAY_PARTITION variable=head_tag complete dim=1
+
+    // The first packet of a channel sets its sequence
+    static bool synced[NUM_CHANNELS];
+    static ap_uint<32> expected_sequence[NUM_CHANNELS];
+#pragma HLS ARRAY_PARTITION variable=synced complete dim=1
+#pragma HLS ARRAY_PARTITION variable=expected_sequence complete dim=1
+
+    // Body beats of packets already decided. Only one feed forwards at a time.
+    bool forwarded = false;
+    if (feed_state[FEED_A] != HEAD && !lbRxDataIn.empty() &&
+        (feed_state[FEED_A] == DROP || !arbDataOut.full())) {
+        axiWord beat = lbRxDataIn.read();
+        if (feed_state[FEED_A] == FORWARD) {
+            arbDataOut.write(beat);
+            forwarded = true;
+        }
+        if (beat.last) {
+            feed_state[FEED_A] = HEAD;
+        }
+    }
+    if (feed_state[FEED_B] != HEAD && !lbRxDataInB.empty() &&
+        (feed_state[FEED_B] == DROP || !arbDataOut.full())) {
+        axiWord beat = lbRxDataInB.read();
+        if (feed_state[FEED_B] == FORWARD) {
+            arbDataOut.write(beat);
+            forwarded = true;
+        }
+        if (beat.last) {
+            feed_state[FEED_B] = HEAD;
+        }
+    }
+    bool output_free = !forwarded && feed_state[FEED_A] != FORWARD && feed_state[FEED_B] != FORWARD &&
+                       !arbDataOut.full() && !arbMetadataOut.full() && !arbTagsOut.full() &&
+                       !seq_gap_out.full();
+
+    // First beats of new packets
+    if (feed_state[FEED_A] == HEAD && !head_valid[FEED_A] && !lbRxDataIn.empty() &&
+        !lbRxMetadataIn.empty() && !tagsIn.empty()) {
+        head_beat[FEED_A] = lbRxDataIn.read();
+        head_metadata[FEED_A] = lbRxMetadataIn.read();
+        head_tag[FEED_A] = tagsIn.read();
+        head_valid[FEED_A] = true;
+    }
+    if (feed_state[FEED_B] == HEAD && !head_valid[FEED_B] && !lbRxDataInB.empty() &&
+        !lbRxMetadataInB.empty() && !tagsInB.empty()) {
+        head_beat[FEED_B] = lbRxDataInB.read();
+        head_metadata[FEED_B] = lbRxMetadataInB.read();
+        head_tag[FEED_B] = tagsInB.read();
+        head_valid[FEED_B] = true;
+    }
+
+    // Forward the earliest new packet; the distance to the expected sequence
+    // number is signed so the comparison survives wrap-around
+    ap_uint<8> channel[NUM_FEEDS];
+    bool subscribed[NUM_FEEDS];
+    ap_uint<32> sequence[NUM_FEEDS];
+    ap_int<32> distance[NUM_FEEDS];
+    bool channel_synced[NUM_FEEDS];
+    bool fresh[NUM_FEEDS];
+    for (unsigned f = 0; f < NUM_FEEDS; f++) {
+        lookup_channel(head_metadata[f].destinationSocket.port, channel[f], subscribed[f]);
+        sequence[f] = head_beat[f].data(BYTE * PACKET_HEADER_SIZE - 1, 0);
+        distance[f] = sequence[f] - expected_sequence[channel[f]];
+        channel_synced[f] = synced[channel[f]];
+        fresh[f] = head_valid[f] && subscribed[f] && (!channel_synced[f] || distance[f] >= 0);
+    }
+    // Packets of different channels are not ordered against each other
+    bool same_channel = channel[FEED_A] == channel[FEED_B];
+    bool take_b = fresh[FEED_B] &&
+                  (!fresh[FEED_A] || (same_channel && channel_synced[FEED_B] && distance[FEED_B] < distance[FEED_A]));
+    unsigned chosen = take_b ? FEED_B : FEED_A;
+    if (fresh[chosen] && output_free) {
+        if (channel_synced[chosen] && distance[chosen] != 0) {
+            sequence_gap gap = { head_metadata[chosen].destinationSocket.port,
+                                 expected_sequence[channel[chosen]], sequence[chosen] };
+            seq_gap_out.write(gap);
+        }
+        axiWord payload = head_beat[chosen];
+        payload.keep &= ~ap_uint<8>((1 << PACKET_HEADER_SIZE) - 1);
+        arbDataOut.write(payload);
+        arbMetadataOut.write(head_metadata[chosen]);
+        arbTagsOut.write(head_tag[chosen]);
+        expected_sequence[channel[chosen]] = sequence[chosen] + 1;
+        synced[channel[chosen]] = true;
+        feed_state[chosen] = head_beat[chosen].last ? HEAD : FORWARD;
+        head_valid[chosen] = false;
+    }
+
+    // Drop duplicates, including the other copy of a packet forwarded above,
+    // and packets of channels we did not subscribe to
+    for (unsigned f = 0; f < NUM_FEEDS; f++) {
+        ap_int<32> behind = sequence[f] - expected_sequence[channel[f]];
+        if (head_valid[f] && (!subscribed[f] || (synced[channel[f]] && behind < 0))) {
+            feed_state[f] = head_beat[f].last ? HEAD : DROP;
+            head_valid[f] = false;
+        }
+    }
+}
+
 void rxPath(stream<axiWord>& lbRxDataIn,
             stream<metadata>& lbRxMetadataIn,
             stream<ap_uint<16>>& lbRequestPortOpenOut,
             stream<bool>& lbPortOpenReplyIn,
-            stream<metadata>& metadata_to_book,
+            stream<metadata> metadata_to_book[NUM_CHANNELS],
             stream<ap_uint<64>>& tagsIn,
-            stream<ap_uint<64>>& time_to_book,
-            stream<order>& order_to_book) {
+            stream<ap_uint<64>> time_to_book[NUM_CHANNELS],
+            stream<order> order_to_book[NUM_CHANNELS],
+            ap_uint<32>& drops_unknown_template,
+            ap_uint<32>& drops_unterminated,
+            ap_uint<32>& drops_bad_type,
+            ap_uint<32>& drops_bad_price) {
 #pragma HLS PIPELINE II=1
 
     static enum Rx_State {
-        PORT_OPEN = 0, PORT_REPLY, READ_FIRST, READ_SECOND, WRITE, FUNC, FUNC_2
+        PORT_OPEN = 0, PORT_REPLY, STREAM
     } next_state;
 
-    static ap_uint<32> openPortWaitTime = 100;
-    // The encoded_message array is declared statically and partitioned for parallel access.
-    static ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE] = {0};
+    // Every port of PORT_TABLE is requested back to back, then all replies are awaited
+    static ap_uint<8> ports_requested = 0;
+    static ap_uint<8> ports_replied = 0;
+    // The encoded_message array is partitioned so the whole message is decoded in one pass.
+    ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE];
 #pragma HLS ARRAY_PARTITION variable=encoded_message complete dim=1
 
-    static order temp_order = {0, 0, 0, 0};
-    static ap_uint<64> first_packet = 0;
-    static ap_uint<64> second_packet = 0;
+    // Bytes of the current datagram that have not been decoded yet. Every
+    // invocation can both retire the message at the head of the buffer and
+    // append the next axiWord behind it, so read, decode and write overlap.
+    static ap_uint<8> frame_buffer[FRAME_BUFF_SIZE];
+#pragma HLS ARRAY_PARTITION variable=frame_buffer complete dim=1
+    static ap_uint<5> buffered = 0;
+    static bool in_frame = false;       // metadata and tag of the datagram have been read
+    static bool frame_done = false;     // the beat carrying `last` has been appended
+    static bool frame_dropped = false;  // unterminated message or unknown port: skip to the end of the datagram
+    static metadata frame_metadata;
+    static ap_uint<64> frame_time = 0;
+    static ap_uint<8> frame_channel = 0;
+    // Template ID of the previous message of every channel (copy operator of
+    // the presence map); 0 until the channel's first message, which copies
+    // template 1
+    static ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> last_template_id[NUM_CHANNELS] = {};
+#pragma HLS ARRAY_PARTITION variable=last_template_id complete dim=1
+    // Malformed messages dropped, one counter per error class
+    static ap_uint<32> unknown_template_count = 0;
+    static ap_uint<32> unterminated_count = 0;
+    static ap_uint<32> bad_type_count = 0;
+    static ap_uint<32> bad_price_count = 0;
 
     switch (next_state) {
     case PORT_OPEN:
-        if (!lbRequestPortOpenOut.full() && openPortWaitTime == 0) {
-            lbRequestPortOpenOut.write(PORT);
-            next_state = PORT_REPLY;
-        } else {
-            openPortWaitTime--;
+        if (!lbRequestPortOpenOut.full()) {
+            lbRequestPortOpenOut.write(PORT_TABLE[ports_requested]);
+            ports_requested++;
+            if (ports_requested == NUM_CHANNELS) {
+                next_state = PORT_REPLY;
+            }
         }
         break;
     case PORT_REPLY:
         if (!lbPortOpenReplyIn.empty()) {
             lbPortOpenReplyIn.read();  // Reading to clear the stream but not storing as it's unused
-            next_state = READ_FIRST;
+            ports_replied++;
+            if (ports_replied == NUM_CHANNELS) {
+                next_state = STREAM;
+            }
         }
         break;
-    case READ_FIRST:
-        if (!lbRxDataIn.empty() && !lbRxMetadataIn.empty() &&
-            !metadata_to_book.full() && !tagsIn.empty() &&
-            !time_to_book.full()) {
-            time_to_book.write(tagsIn.read());
-            metadata tempMetadata = lbRxMetadataIn.read();
-            std::swap(tempMetadata.sourceSocket, tempMetadata.destinationSocket);
-            metadata_to_book.write(tempMetadata);
-            axiWord tempWord = lbRxDataIn.read();
-            first_packet = tempWord.data;
-            next_state = tempWord.last ? FUNC : READ_SECOND;
+    case STREAM: {
+        // Field layout of the message at the head of the buffer, found from
+        // its stop-bit vector in one step
+        ap_uint<MESSAGE_BUFF_SIZE> valid = 0;
+        for (unsigned i = 0; i < MESSAGE_BUFF_SIZE; i++) {
+            encoded_message[i] = frame_buffer[i];
+            valid[i] = i < buffered;
         }
-        break;
-    case FUNC:
-    case FUNC_2:  // FUNC and FUNC_2 can share the same decoding logic
-        for (unsigned i = 0; i < NUM_BYTES_IN_PACKET; i++) {
-            encoded_message[i] = first_packet >> (BYTE * i);
-            encoded_message[i + NUM_BYTES_IN_PACKET] = second_packet >> (BYTE * i);
+        ap_uint<4> field_end[MESSAGE_STOP_BITS];
+#pragma HLS ARRAY_PARTITION variable=field_end complete dim=1
+        ap_uint<5> fields_found;
+        locate_fields(stop_bit_vector(encoded_message, valid), field_end, fields_found);
+
+        // The presence map says whether the template ID is sent or copied
+        // from the previous message, and the template and presence map
+        // together give the number of fields of the message.
+        ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> pmap = encoded_message[PMAP_FIELD_NUM] & VALID_DATA;
+        bool template_id_sent = pmap[PMAP_TEMPLATE_ID_BIT];
+        ap_uint<2> header_fields = template_id_sent ? 2 : 1;
+        ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE> template_id = template_id_sent
+                ? gather_field<NUMBER_OF_VALID_BITS_IN_BYTE, 1>(encoded_message, field_end[PMAP_FIELD_NUM] + 1, field_end[TEMPLATE_ID_FIELD_NUM])
+                : last_template_id[frame_channel] != 0 ? last_template_id[frame_channel]
+                                                       : ap_uint<NUMBER_OF_VALID_BITS_IN_BYTE>(order_template::id);
+        bool header_complete = fields_found >= header_fields;
+        ap_uint<3> message_fields = header_fields + message_value_fields(template_id, pmap);
+        bool unknown = header_complete && !known_template(template_id);
+        bool complete = header_complete && !unknown && fields_found >= message_fields;
+        ap_uint<5> message_length = field_end[message_fields - 1] + 1;
+
+        // Orders go to the book of the datagram's channel
+        bool book_full = false;
+        for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+            if (c == frame_channel &&
+                (order_to_book[c].full() || metadata_to_book[c].full() || time_to_book[c].full())) {
+                book_full = true;
+            }
         }
-        // The decoding process is encapsulated in a function for clarity and potential reuse.
-        decode_and_process_order(encoded_message, temp_order);
-        next_state = WRITE;
-        break;
-    case READ_SECOND:
-        if (!lbRxDataIn.empty()) {
-            axiWord tempWord = lbRxDataIn.read();
-            second_packet = tempWord.data;
-            next_state = tempWord.last ? FUNC_2 : READ_SECOND;
+
+        // A malformed message is dropped in the same pass it is decoded in and
+        // never waits for the book
+        order temp_order;
+        bool price_valid, type_valid;
+        decode_and_process_order(encoded_message, field_end, pmap, header_fields, template_id, frame_channel,
+                                 complete && !book_full, temp_order, price_valid, type_valid);
+        bool well_formed = price_valid && type_valid;
+        bool consume = complete && (!well_formed || !book_full);
+        bool emit = complete && well_formed && !book_full;
+        if (emit) {
+            temp_order.instrument = frame_channel;
+            for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+                if (c == frame_channel) {
+                    order_to_book[c].write(temp_order);
+                    metadata_to_book[c].write(frame_metadata);
+                    time_to_book[c].write(frame_time);
+                }
+            }
+            last_template_id[frame_channel] = template_id;
         }
-        break;
-    case WRITE:
-        if (!order_to_book.full()) {
-            order_to_book.write(temp_order);
-            next_state = READ_FIRST;
+
+        ap_uint<5> consumed = consume ? message_length : ap_uint<5>(0);
+        ap_uint<5> remaining = buffered - consumed;
+
+        // Anything after the last stop bit of a finished datagram is padding
+        // or a truncated message and is discarded.
+        bool residual_has_stop_bit = false;
+        for (unsigned i = 0; i < FRAME_BUFF_SIZE; i++) {
+            if (i >= consumed && i < buffered && (frame_buffer[i] & STOP_BIT) == STOP_BIT) {
+                residual_has_stop_bit = true;
+            }
+        }
+        // Without a known template the message length is unknown, so like a
+        // message with no stop bit within MESSAGE_BUFF_SIZE it ends the
+        // datagram. A partial message left at the end of a datagram is dropped
+        // as unterminated as well.
+        bool overlong = !complete && buffered >= MESSAGE_BUFF_SIZE;
+        bool truncated = frame_done && !complete && residual_has_stop_bit;
+        if (unknown) {
+            unknown_template_count++;
+        } else if (overlong || truncated) {
+            unterminated_count++;
+        }
+        if (complete && !price_valid) {
+            bad_price_count++;
+        } else if (complete && !type_valid) {
+            bad_type_count++;
+        }
+
+        bool unterminated = overlong || unknown;
+        bool frame_finished = frame_done &&
+                              (frame_dropped || !complete || (consume && !residual_has_stop_bit));
+        if (frame_finished) {
+            in_frame = false;
+            frame_done = false;
+            frame_dropped = false;
+            remaining = 0;
+        } else if (unterminated) {
+            frame_dropped = true;
+            remaining = 0;
+        }
+
+        for (unsigned i = 0; i < FRAME_BUFF_SIZE; i++) {
+            frame_buffer[i] = (i + consumed < FRAME_BUFF_SIZE) ? frame_buffer[i + consumed] : ap_uint<8>(0);
+        }
+
+        bool can_read = !frame_done && !lbRxDataIn.empty() &&
+                        remaining <= FRAME_BUFF_SIZE - NUM_BYTES_IN_PACKET &&
+                        (in_frame || (!lbRxMetadataIn.empty() && !tagsIn.empty()));
+        if (can_read) {
+            if (!in_frame) {
+                frame_time = tagsIn.read();
+                metadata tempMetadata = lbRxMetadataIn.read();
+                bool subscribed;
+                lookup_channel(tempMetadata.destinationSocket.port, frame_channel, subscribed);
+                std::swap(tempMetadata.sourceSocket, tempMetadata.destinationSocket);
+                frame_metadata = tempMetadata;
+                in_frame = true;
+                // Nothing of a datagram for another port is decoded
+                frame_dropped = !subscribed;
+            }
+            axiWord tempWord = lbRxDataIn.read();
+            // keep is contiguous but need not start at byte 0 (the packet
+            // header is masked out of the first beat): count its bits and
+            // find the lowest one side by side
+            ap_uint<4> valid_bytes = 0;
+            ap_uint<4> first_byte = NUM_BYTES_IN_PACKET;
+            for (int i = NUM_BYTES_IN_PACKET - 1; i >= 0; i--) {
+#pragma HLS UNROLL
+                if (tempWord.keep[i]) {
+                    valid_bytes = valid_bytes + 1;
+                    first_byte = i;
+                }
+            }
+            if (!frame_dropped) {
+                for (unsigned i = 0; i < NUM_BYTES_IN_PACKET; i++) {
+                    if (i < valid_bytes) {
+                        frame_buffer[remaining + i] = tempWord.data >> (BYTE * (first_byte + i));
+                    }
+                }
+                remaining += valid_bytes;
+            }
+            frame_done = tempWord.last;
         }
+        buffered = remaining;
         break;
     }
+    }
+
+    drops_unknown_template = unknown_template_count;
+    drops_unterminated = unterminated_count;
+    drops_bad_type = bad_type_count;
+    drops_bad_price = bad_price_count;
+}
+
+// Encodes an order as a template 1 message (every field sent). Every field
+// length comes from a leading-zero count, so all of them are known at once
+// and the offsets are a short sum.
+void encode_order(const order& decoded_message,
+                  ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE],
+                  ap_uint<5>& message_length) {
+#pragma HLS INLINE
+    for (unsigned i = 0; i < MESSAGE_BUFF_SIZE; i++) {
+        encoded_message[i] = 0;
+    }
+
+    decimal_mantissa mantissa;
+    decimal_exponent exponent;
+    fix16_to_decimal(decoded_message.price, mantissa, exponent);
+
+    encoded_message[PMAP_FIELD_NUM] = 0xFC; // Presence map: template ID and all fields are present.
+    encoded_message[TEMPLATE_ID_FIELD_NUM] = STOP_BIT | order_template::id;
+
+    ap_uint<4> message_offset = 2;
+    scatter_field<DECIMAL_EXPONENT_BITS, 1>(encoded_message, message_offset, exponent, 1);
+    scatter_field<DECIMAL_MANTISSA_BITS, 3>(encoded_message, message_offset, mantissa, signed_groups<DECIMAL_MANTISSA_BITS>(mantissa));
+    scatter_field<8, 2>(encoded_message, message_offset, decoded_message.size, unsigned_groups<8>(decoded_message.size));
+    scatter_field<32, 5>(encoded_message, message_offset, decoded_message.orderID, unsigned_groups<32>(decoded_message.orderID));
+    scatter_field<3, 1>(encoded_message, message_offset, decoded_message.type, 1);
+    message_length = message_offset;
 }
 
 void txPath(stream<metadata> &metadata_from_book,
@@ -172,102 +773,105 @@ void txPath(stream<metadata> &metadata_from_book,
             stream<order> &order_from_book) {
 #pragma HLS PIPELINE II=1
 
-    static enum Tx_State {
-        READ = 0, WRITE_FIRST, WRITE_SECOND
-    } next_state;
-
-    static uint16_t lbPacketLength = 0;
-    static axiWord second_packet = {0, 0xFF, 1};
-    static axiWord first_packet = {0, 0xFF, 0};
-
-    switch (next_state) {
-    case READ:
-        if (!metadata_from_book.empty() && !time_from_book.empty() &&
-            !order_from_book.empty() && !lbTxMetadataOut.full() &&
-            !lbTxLengthOut.full() && !tagsOut.full()) {
-
-            tagsOut.write(time_from_book.read());
-            lbTxMetadataOut.write(metadata_from_book.read());
-
-            order decoded_message = order_from_book.read();
-            ap_uint<64> first_packet_data;
-            ap_uint<64> second_packet_data;
-
-            //Encoding Logic Starts
-            ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE] = { 0. };
-        #pragma HLS ARRAY_PARTITION variable=encoded_message complete dim=1
-
-            encoded_message[0] = 0xFC; // Presence map: all fields are present.
-            encoded_message[1] = 0x81; // template id = 1
-            encoded_message[2] = 0x80; // exponent is always 0
-            encoded_message[3] = 0x81; //price is always 1
-
-            unsigned message_offset = 4;
-            if ((decoded_message.size & 0x80) == 0x80)
-            {
-                encoded_message[message_offset++] = 0x01;
+    // Mirror of the receive side: consecutive orders for the same destination
+    // are appended to one frame, which is flushed when the next order would
+    // not fit in TX_BATCH_MTU, when it goes to another destination, or after
+    // TX_FLUSH_TIMEOUT invocations without a new order. A full beat is only
+    // sent while more than one beat of bytes is pending, so the beat carrying
+    // `last` is never empty.
+    static ap_uint<8> frame_buffer[FRAME_BUFF_SIZE];
+#pragma HLS ARRAY_PARTITION variable=frame_buffer complete dim=1
+    static ap_uint<5> buffered = 0;
+    static ap_uint<16> frame_length = 0;
+    static bool frame_open = false;     // metadata of the frame has been written
+    static bool closing = false;        // no more orders go into the frame
+    static ap_uint<16> idle_count = 0;
+    static metadata frame_metadata;
+
+    // Order read and encoded in the previous invocation, waiting for room
+    static ap_uint<8> staged_message[MESSAGE_BUFF_SIZE];
+#pragma HLS ARRAY_PARTITION variable=staged_message complete dim=1
+    static ap_uint<5> staged_length = 0;
+    static bool staged = false;
+    static metadata staged_metadata;
+
+    // Send one beat of the frame
+    bool send_last = frame_open && closing && buffered <= NUM_BYTES_IN_PACKET &&
+                     !lbTxDataOut.full() && !lbTxLengthOut.full();
+    bool send_full = buffered > NUM_BYTES_IN_PACKET && !lbTxDataOut.full();
+    ap_uint<5> sent = 0;
+    if (send_last || send_full) {
+        axiWord beat;
+        beat.data = 0;
+        beat.keep = 0;
+        for (int i = NUM_BYTES_IN_PACKET - 1; i >= 0; i--) {
+            beat.data = (beat.data << BYTE) | frame_buffer[i];
+            beat.keep[i] = i < buffered.to_int();
+        }
+        beat.last = send_last;
+        lbTxDataOut.write(beat);
+        sent = send_last ? buffered : ap_uint<5>(NUM_BYTES_IN_PACKET);
+        if (send_last) {
+            lbTxLengthOut.write(frame_length);
+            frame_length = 0;
+            frame_open = false;
+            closing = false;
+        }
+    }
+    for (unsigned i = 0; i < FRAME_BUFF_SIZE; i++) {
+        frame_buffer[i] = (i + sent < FRAME_BUFF_SIZE) ? frame_buffer[i + sent] : ap_uint<8>(0);
+    }
+    ap_uint<5> remaining = buffered - sent;
+
+    // Append the staged order, or close the frame when it does not belong in it
+    bool appended = false;
+    if (staged) {
+        bool other_destination = frame_open &&
+                (staged_metadata.destinationSocket.port != frame_metadata.destinationSocket.port ||
+                 staged_metadata.destinationSocket.addr != frame_metadata.destinationSocket.addr);
+        bool too_long = frame_open && frame_length + staged_length > TX_BATCH_MTU;
+        if (other_destination || too_long) {
+            closing = true;
+        } else if (!closing && remaining + staged_length <= FRAME_BUFF_SIZE &&
+                   (frame_open || !lbTxMetadataOut.full())) {
+            if (!frame_open) {
+                lbTxMetadataOut.write(staged_metadata);
+                frame_metadata = staged_metadata;
+                frame_open = true;
             }
-            encoded_message[message_offset++] = (0x80 | (decoded_message.size & 0x7F));
-
-            bool triggered = false; //triggered
-
-            unsigned max_bytes_need_for_uint32 = 5;
-            for (unsigned i = 0; i < max_bytes_need_for_uint32 - 1; i++)
-            {
-                uint8 curr_byte = (0x00
-                        | (decoded_message.orderID
-                                >> NUMBER_OF_VALID_BITS_IN_BYTE
-                                        * (max_bytes_need_for_uint32 - 1 - i) & 0x7F));
-                if (curr_byte != 0x00 || triggered == true)
-                {
-                    encoded_message[message_offset++] = (0x00
-                            | (decoded_message.orderID
-                                    >> NUMBER_OF_VALID_BITS_IN_BYTE
-                                                    * (max_bytes_need_for_uint32 - 1 - i)
-                                            & 0x7F));
-                    triggered = true;
+            for (unsigned i = 0; i < MESSAGE_BUFF_SIZE; i++) {
+                if (i < staged_length) {
+                    frame_buffer[remaining + i] = staged_message[i];
                 }
             }
-            encoded_message[message_offset++] = (0x80 | (decoded_message.orderID & 0x7F));
-
-            encoded_message[message_offset++] = (0x80 | decoded_message.type);
-
-            for (int i = NUM_BYTES_IN_PACKET - 1; i >= 0; i--) {
-                first_packet_data = (first_packet_data << BYTE) | encoded_message[i];
-                 second_packet_data = (second_packet_data << BYTE) | encoded_message[i + NUM_BYTES_IN_PACKET];
-             }
-
-            //Encoding logic ends
-
-            // Buffer the 128-bit encoded message in two 64-bit packets
-            first_packet.data = first_packet_data;
-            second_packet.data = second_packet_data;
-
-            // Transition to the next state
-            next_state = WRITE_FIRST;
-        }
-        break;
-    case WRITE_FIRST:
-        if (!lbTxDataOut.full()) {
-            lbTxDataOut.write(first_packet);
-
-            // Efficiently count the number of bits set in first_packet.keep
-            lbPacketLength = __builtin_popcount(first_packet.keep.to_uint()); // Assuming HLS supports __builtin_popcount
-            next_state = WRITE_SECOND;
+            remaining += staged_length;
+            frame_length += staged_length;
+            staged = false;
+            appended = true;
+            // Not even the shortest message fits any more
+            if (frame_length + TX_MIN_MESSAGE_SIZE > TX_BATCH_MTU) {
+                closing = true;
+            }
         }
-        break;
-    case WRITE_SECOND:
-        if (!lbTxDataOut.full()) {
-            lbTxDataOut.write(second_packet);
-
-            // Add the number of bits set in second_packet.keep to lbPacketLength
-            lbPacketLength += __builtin_popcount(second_packet.keep.to_uint());
-            lbTxLengthOut.write(lbPacketLength); // Write the total length
+    }
 
-            // Reset state to READ for next operation
-            next_state = READ;
+    if (appended) {
+        idle_count = 0;
+    } else if (frame_open && !closing) {
+        idle_count++;
+        if (idle_count >= TX_FLUSH_TIMEOUT) {
+            closing = true;
         }
-        break;
+    }
+    buffered = remaining;
+
+    // Read and encode the next order; its timestamp goes out right away
+    if (!staged && !metadata_from_book.empty() && !time_from_book.empty() &&
+        !order_from_book.empty() && !tagsOut.full()) {
+        tagsOut.write(time_from_book.read());
+        staged_metadata = metadata_from_book.read();
+        encode_order(order_from_book.read(), staged_message, staged_length);
+        staged = true;
     }
 }
 
@@ -280,12 +884,20 @@ void fast_protocol(stream<axiWord>& lbRxDataIn,
                    stream<ap_uint<16> > &lbTxLengthOut,
                    stream<ap_uint<64> > &tagsIn,
                    stream<ap_uint<64> > &tagsOut,
-                   stream<metadata> &metadata_to_book,
+                   stream<metadata> metadata_to_book[NUM_CHANNELS],
                    stream<metadata> &metadata_from_book,
-                   stream<ap_uint<64> > &time_to_book,
+                   stream<ap_uint<64> > time_to_book[NUM_CHANNELS],
                    stream<ap_uint<64> > &time_from_book,
-                   stream<order> &order_to_book,
-                   stream<order> &order_from_book)
+                   stream<order> order_to_book[NUM_CHANNELS],
+                   stream<order> &order_from_book,
+                   stream<axiWord>& lbRxDataInB,
+                   stream<metadata>& lbRxMetadataInB,
+                   stream<ap_uint<64> > &tagsInB,
+                   stream<sequence_gap> &seq_gap_out,
+                   ap_uint<32> &drops_unknown_template,
+                   ap_uint<32> &drops_unterminated,
+                   ap_uint<32> &drops_bad_type,
+                   ap_uint<32> &drops_bad_price)
 {
 #pragma HLS INTERFACE ap_ctrl_none port=return
 #pragma HLS DATAFLOW
@@ -307,14 +919,48 @@ void fast_protocol(stream<axiWord>& lbRxDataIn,
 #pragma HLS INTERFACE axis port=order_to_book
 #pragma HLS INTERFACE axis port=order_from_book
 
-    rxPath(lbRxDataIn,
-           lbRxMetadataIn,
+#pragma HLS INTERFACE axis port=lbRxDataInB
+#pragma HLS INTERFACE axis port=lbRxMetadataInB
+#pragma HLS INTERFACE axis port=tagsInB
+#pragma HLS INTERFACE axis port=seq_gap_out
+
+    // Malformed-message drop counters
+#pragma HLS INTERFACE s_axilite port=drops_unknown_template bundle=CTRL_BUS
+#pragma HLS INTERFACE s_axilite port=drops_unterminated bundle=CTRL_BUS
+#pragma HLS INTERFACE s_axilite port=drops_bad_type bundle=CTRL_BUS
+#pragma HLS INTERFACE s_axilite port=drops_bad_price bundle=CTRL_BUS
+
+    // Arbitrated feed: one copy of every packet, header masked out
+    static stream<axiWord> arbDataOut("arbDataOut");
+    static stream<metadata> arbMetadataOut("arbMetadataOut");
+    static stream<ap_uint<64> > arbTagsOut("arbTagsOut");
+#pragma HLS STREAM variable=arbDataOut depth=4
+#pragma HLS STREAM variable=arbMetadataOut depth=2
+#pragma HLS STREAM variable=arbTagsOut depth=2
+
+    feedArbiter(lbRxDataIn,
+                lbRxMetadataIn,
+                tagsIn,
+                lbRxDataInB,
+                lbRxMetadataInB,
+                tagsInB,
+                arbDataOut,
+                arbMetadataOut,
+                arbTagsOut,
+                seq_gap_out);
+
+    rxPath(arbDataOut,
+           arbMetadataOut,
            lbRequestPortOpenOut,
            lbPortOpenReplyIn,
            metadata_to_book,
-           tagsIn,
+           arbTagsOut,
            time_to_book,
-           order_to_book);
+           order_to_book,
+           drops_unknown_template,
+           drops_unterminated,
+           drops_bad_type,
+           drops_bad_price);
 
     txPath(metadata_from_book,
            lbTxDataOut,
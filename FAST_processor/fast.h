@@ -44,6 +44,28 @@ struct metadata
     sockaddr_in destinationSocket;
 };
 
+/* Channels the feed handler subscribes to. Every port of the table is opened
+ * at startup, and the orders of each channel (the destination port of the
+ * datagram) go to their own book streams.
+ */
+#define NUM_CHANNELS    2
+const ap_uint<16> PORT_TABLE[NUM_CHANNELS] = { 750, 751 };
+
+/* Market data is published on two redundant feeds (A and B). Every packet
+ * starts with a PACKET_HEADER_SIZE-byte little-endian sequence number, so the
+ * first copy of each packet is decoded and the other one is dropped.
+ */
+#define PACKET_HEADER_SIZE  4
+
+// Packets from `expected` up to `received` - 1 of the channel on `port` were
+// lost on both feeds
+struct sequence_gap
+{
+    ap_uint<16> port;
+    ap_uint<32> expected;
+    ap_uint<32> received;
+};
+
 ////////////////////////////////
 // Encoder/ Decoder Interface //
 ////////////////////////////////
@@ -63,6 +85,25 @@ struct metadata
  */
 #define MESSAGE_BUFF_SIZE   16  // size in bytes
 
+/* A datagram carries any number of back-to-back messages. Every message is
+ * terminated by the stop bit of its last field; a message with every field
+ * present ends at its MESSAGE_STOP_BITS-th stop bit (presence map, template ID
+ * and the five value fields), and the presence map and template of a message
+ * (templates.h) tell how many of them it has. The receive buffer holds one
+ * maximum message plus the beat being appended behind it.
+ */
+#define MESSAGE_STOP_BITS   7
+#define FRAME_BUFF_SIZE     (MESSAGE_BUFF_SIZE + NUM_BYTES_IN_PACKET)
+
+/* Outbound orders for the same destination are batched into one frame of at
+ * most TX_BATCH_MTU bytes (a UDP payload in a standard Ethernet frame). A
+ * frame that is not full is sent TX_FLUSH_TIMEOUT invocations after its last
+ * order. A TX_BATCH_MTU of 0 sends every order in its own frame.
+ */
+#define TX_BATCH_MTU        1472
+#define TX_FLUSH_TIMEOUT    32
+#define TX_MIN_MESSAGE_SIZE 7   // template 1 message with one byte per field
+
 #define NUMBER_OF_FIELDS    6   // all fields are mandatory
 // decimal mantissa and exponent count as
 // Separate fields
@@ -93,14 +134,19 @@ typedef ap_uint<16> uint16;
  * - the "size", i.e. the number of shares
  * - the "orderID" unique id tag for each order
  * - the "order_type" (0 for market sell, 1 for market buy,
- *                     2 for limited sell, and 3 for limited buy)
+ *                     2 for limited sell, 3 for limited buy,
+ *                     4 to remove an ask, 5 to remove a bid,
+ *                     6 to modify an ask and 7 to modify a bid)
  */
+#define MAX_ORDER_TYPE      7   // messages with a higher type are dropped
+
 struct order
 {
     ap_fixed<16, 8> price;
     ap_uint<8> size;
     ap_uint<32> orderID;
     ap_uint<3> type;
+    ap_uint<10> instrument;     // book of the order: the channel it came in on
 };
 
 void fast_protocol(stream<axiWord>& lbRxDataIn,
@@ -112,10 +158,18 @@ void fast_protocol(stream<axiWord>& lbRxDataIn,
                    stream<ap_uint<16> > &lbTxLengthOut,
                    stream<ap_uint<64> > &tagsIn,
                    stream<ap_uint<64> > &tagsOut,
-                   stream<metadata> &metadata_to_book,
+                   stream<metadata> metadata_to_book[NUM_CHANNELS],
                    stream<metadata> &metadata_from_book,
-                   stream<ap_uint<64> > &time_to_book,
+                   stream<ap_uint<64> > time_to_book[NUM_CHANNELS],
                    stream<ap_uint<64> > &time_from_book,
-                   stream<order> &order_to_book,
-                   stream<order> &order_from_book);
+                   stream<order> order_to_book[NUM_CHANNELS],
+                   stream<order> &order_from_book,
+                   stream<axiWord>& lbRxDataInB,
+                   stream<metadata>& lbRxMetadataInB,
+                   stream<ap_uint<64> > &tagsInB,
+                   stream<sequence_gap> &seq_gap_out,
+                   ap_uint<32> &drops_unknown_template,
+                   ap_uint<32> &drops_unterminated,
+                   ap_uint<32> &drops_bad_type,
+                   ap_uint<32> &drops_bad_price);
 #endif
@@ -5,15 +5,83 @@
 #include <vector>
 #include <stdlib.h>
 #include "fast.h"
+#include "decimal.h"
+#include "decoder.h"
+#include "encoder.h"
 
 using namespace std;
 
+// Length of a FAST message: it ends at the stop bit of its last field
+unsigned message_length(const vector<ap_uint<8> > &message)
+{
+    unsigned stop_bits = 0;
+    for (unsigned i = 0; i < message.size(); i++)
+    {
+        if (message[i] & 0x80)
+        {
+            if (++stop_bits == MESSAGE_STOP_BITS)
+            {
+                return i + 1;
+            }
+        }
+    }
+    return message.size();
+}
+
+// Signed FAST integer: 7-bit groups, most significant first, as few as hold
+// the value and its sign, with the stop bit on the last byte
+vector<ap_uint<8> > fast_int64(long long value)
+{
+    unsigned groups = 1;
+    while (groups < 10 && (value >= (1LL << (7 * groups - 1)) || value < -(1LL << (7 * groups - 1))))
+    {
+        groups++;
+    }
+    vector<ap_uint<8> > bytes;
+    for (int g = groups - 1; g >= 0; g--)
+    {
+        bytes.push_back((value >> (7 * g)) & 0x7F);    // arithmetic shift: the top group sign-extends
+    }
+    bytes.back() |= 0x80;
+    return bytes;
+}
+
+// Beats of a market data packet: the little-endian sequence number header,
+// then the payload
+vector<axiWord> feed_packet(ap_uint<32> sequence, const vector<ap_uint<8> > &payload)
+{
+    vector<ap_uint<8> > bytes;
+    for (unsigned i = 0; i < PACKET_HEADER_SIZE; i++)
+    {
+        bytes.push_back(sequence >> (BYTE * i));
+    }
+    bytes.insert(bytes.end(), payload.begin(), payload.end());
+
+    vector<axiWord> beats;
+    for (unsigned offset = 0; offset < bytes.size(); offset += NUM_BYTES_IN_PACKET)
+    {
+        axiWord beat = { 0, 0, 0 };
+        for (unsigned i = 0; i < NUM_BYTES_IN_PACKET && offset + i < bytes.size(); i++)
+        {
+            beat.data |= ap_uint<64>(bytes[offset + i]) << (BYTE * i);
+            beat.keep |= 1 << i;
+        }
+        beat.last = offset + NUM_BYTES_IN_PACKET >= bytes.size();
+        beats.push_back(beat);
+    }
+    return beats;
+}
+
 std::string getOrderType(int type) {
         switch(type) {
         case 0: return "Market Sell";
         case 1: return "Market Buy";
         case 2: return "Limited Sell";
         case 3: return "Limited Buy";
+        case 4: return "Remove Sell";
+        case 5: return "Remove Buy";
+        case 6: return "Modify Sell";
+        case 7: return "Modify Buy";
         default: return "Unknown Type";
         }
     }
@@ -48,10 +116,10 @@ int main(int argc, char *argv[])
     stream<metadata> lbRxMetadataIn;
     stream<uint16> lbRequestPortOpenOut;
     stream<bool> lbPortOpenReplyIn;
-    stream<metadata> metadata_to_book;
+    stream<metadata> metadata_to_book[NUM_CHANNELS];
     stream<uint64> tagsIn;
-    stream<uint64> time_to_book;
-    stream<order> order_to_book;
+    stream<uint64> time_to_book[NUM_CHANNELS];
+    stream<order> order_to_book[NUM_CHANNELS];
 
     // Transmit path stream parameters
     stream<metadata> metadata_from_book;
@@ -62,19 +130,33 @@ int main(int argc, char *argv[])
     stream<uint64> tagsOut;
     stream<order> order_from_book;
 
+    // Redundant feed B and the gap report
+    stream<axiWord> lbRxDataInB;
+    stream<metadata> lbRxMetadataInB;
+    stream<uint64> tagsInB;
+    stream<sequence_gap> seq_gap_out;
+
+    // Malformed-message drop counters (AXI-lite registers)
+    ap_uint<32> drops_unknown_template = 0;
+    ap_uint<32> drops_unterminated = 0;
+    ap_uint<32> drops_bad_type = 0;
+    ap_uint<32> drops_bad_price = 0;
+    unsigned feed_sequence = 0;
+
+    // Messages kept for the back-to-back burst benchmark and the
+    // multi-message datagram test
+    vector<vector<ap_uint<8> > > burst_messages;
+    vector<order> expected_orders;
+
     // Load FAST message
     unsigned num_test_cases;
     ifs >> num_test_cases;
     for (unsigned j = 0; j < num_test_cases; j++)
     {
-        ap_uint<64> first_packet = 0;
-        ap_uint<64> second_packet = 0;
         ap_uint<8> encoded_message[MESSAGE_BUFF_SIZE] = { 0. };
-        order decoded_message = { 0, 0, 0, 0 };
+        order decoded_message = { 0, 0, 0, 0, 0 };
 
-        axiWord first_packet_buff;
-        axiWord second_packet_buff;
-        metadata metadata_buff;
+        metadata metadata_buff = {};
         ap_uint<64> time_buff;
         ap_uint<16> lbRequestPortOpenOut_buff;
         ap_uint<16> length_buff;
@@ -84,86 +166,66 @@ int main(int argc, char *argv[])
             ifs >> encoded_message[i];
         }
 
-        for (int i = NUM_BYTES_IN_PACKET - 1; i >= 0; i--)
-        {
-            first_packet = (first_packet << BYTE) | encoded_message[i];
-            second_packet = (second_packet << BYTE)
-                    | encoded_message[i + NUM_BYTES_IN_PACKET];
-        }
+        burst_messages.push_back(vector<ap_uint<8> >(encoded_message, encoded_message + MESSAGE_BUFF_SIZE));
 
-        while (true)
+        // One message per packet on feed A
+        if (j == 0)
         {
-            if (!lbRxDataIn.full() && !lbRxMetadataIn.full() && !tagsIn.full())
+            for (unsigned c = 0; c < NUM_CHANNELS; c++)
             {
-                if (j == 0)
-                {
-                    lbPortOpenReplyIn.write(true);
-                }
-                first_packet_buff.data = first_packet;
-                first_packet_buff.keep = 0xFF;
-                first_packet_buff.last = 0;
-                lbRxDataIn.write(first_packet_buff);
-                lbRxMetadataIn.write(metadata_buff);
-                tagsIn.write(time_buff);
-                fast_protocol(lbRxDataIn,
-                              lbRxMetadataIn,
-                              lbRequestPortOpenOut,
-                              lbPortOpenReplyIn,
-                              lbTxDataOut,
-                              lbTxMetadataOut,
-                              lbTxLengthOut,
-                              tagsIn,
-                              tagsOut,
-                              metadata_to_book,
-                              metadata_from_book,
-                              time_to_book,
-                              time_from_book,
-                              order_to_book,
-                              order_from_book);
-                break;
+                lbPortOpenReplyIn.write(true);
             }
         }
-
-        while (true)
+        vector<axiWord> rx_beats = feed_packet(feed_sequence++, burst_messages.back());
+        metadata_buff.destinationSocket.port = PORT_TABLE[0];
+        lbRxMetadataIn.write(metadata_buff);
+        tagsIn.write(time_buff);
+        for (unsigned b = 0; b < rx_beats.size(); b++)
         {
-            if (!lbRxDataIn.full())
-            {
-                second_packet_buff.data = second_packet;
-                second_packet_buff.keep = 0xFF;
-                second_packet_buff.last = 1;
-                lbRxDataIn.write(second_packet_buff);
-                fast_protocol(lbRxDataIn,
-                              lbRxMetadataIn,
-                              lbRequestPortOpenOut,
-                              lbPortOpenReplyIn,
-                              lbTxDataOut,
-                              lbTxMetadataOut,
-                              lbTxLengthOut,
-                              tagsIn,
-                              tagsOut,
-                              metadata_to_book,
-                              metadata_from_book,
-                              time_to_book,
-                              time_from_book,
-                              order_to_book,
-                              order_from_book);
-                break;
-            }
+            lbRxDataIn.write(rx_beats[b]);
+            fast_protocol(lbRxDataIn,
+                          lbRxMetadataIn,
+                          lbRequestPortOpenOut,
+                          lbPortOpenReplyIn,
+                          lbTxDataOut,
+                          lbTxMetadataOut,
+                          lbTxLengthOut,
+                          tagsIn,
+                          tagsOut,
+                          metadata_to_book,
+                          metadata_from_book,
+                          time_to_book,
+                          time_from_book,
+                          order_to_book,
+                          order_from_book,
+                          lbRxDataInB,
+                          lbRxMetadataInB,
+                          tagsInB,
+                          seq_gap_out,
+                          drops_unknown_template,
+                          drops_unterminated,
+                          drops_bad_type,
+                          drops_bad_price);
         }
 
         while (true)
         {
-            if (!metadata_to_book.empty() && !time_to_book.empty()
-                    && !order_to_book.empty())
+            if (!metadata_to_book[0].empty() && !time_to_book[0].empty()
+                    && !order_to_book[0].empty())
             {
-                if (!lbRequestPortOpenOut.empty() && j == 0)
+                for (unsigned c = 0; j == 0 && c < NUM_CHANNELS; c++)
                 {
                     lbRequestPortOpenOut_buff = lbRequestPortOpenOut.read();
                     cout << "Port: " << lbRequestPortOpenOut_buff << endl;
+                    if (lbRequestPortOpenOut_buff != PORT_TABLE[c])
+                    {
+                        cout << "ERROR port: " << lbRequestPortOpenOut_buff << " != " << PORT_TABLE[c] << endl;
+                        return 1;
+                    }
                 }
-                metadata_buff = metadata_to_book.read();
-                time_buff = time_to_book.read();
-                decoded_message = order_to_book.read();
+                metadata_buff = metadata_to_book[0].read();
+                time_buff = time_to_book[0].read();
+                decoded_message = order_to_book[0].read();
                 break;
             }
             else
@@ -182,7 +244,15 @@ int main(int argc, char *argv[])
                               time_to_book,
                               time_from_book,
                               order_to_book,
-                              order_from_book);
+                              order_from_book,
+                              lbRxDataInB,
+                              lbRxMetadataInB,
+                              tagsInB,
+                              seq_gap_out,
+                              drops_unknown_template,
+                              drops_unterminated,
+                              drops_bad_type,
+                              drops_bad_price);
             }
         }
 
@@ -196,6 +266,8 @@ int main(int argc, char *argv[])
         ofs >> size;
         ofs >> orderID;
         ofs >> type;
+        order expected = { price, size, orderID, type, 0 };
+        expected_orders.push_back(expected);
 
         std::cout << "Order:" << j << std::endl;
         std::cout << std::left << std::setw(15) << "Size:" << decoded_message.size << std::endl;
@@ -233,7 +305,15 @@ int main(int argc, char *argv[])
                               time_to_book,
                               time_from_book,
                               order_to_book,
-                              order_from_book);
+                              order_from_book,
+                              lbRxDataInB,
+                              lbRxMetadataInB,
+                              tagsInB,
+                              seq_gap_out,
+                              drops_unknown_template,
+                              drops_unterminated,
+                              drops_bad_type,
+                              drops_bad_price);
                 break;
             }
         }
@@ -241,113 +321,105 @@ int main(int argc, char *argv[])
         auto end = std::chrono::high_resolution_clock::now();
         auto encoding_latency = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
 
-        // Receive first packet
-        while (true)
+        // Receive the frame: beats up to the one carrying last, then its length
+        vector<axiWord> tx_beats;
+        while (tx_beats.empty() || !tx_beats.back().last)
         {
-            if (!lbTxMetadataOut.empty() && !lbTxDataOut.empty()
-                    && !tagsOut.empty())
+            if ((!tx_beats.empty() || (!lbTxMetadataOut.empty() && !tagsOut.empty()))
+                    && !lbTxDataOut.empty())
             {
-                metadata_buff = lbTxMetadataOut.read();
-                first_packet_buff = lbTxDataOut.read();
-                time_buff = tagsOut.read();
-                fast_protocol(lbRxDataIn,
-                              lbRxMetadataIn,
-                              lbRequestPortOpenOut,
-                              lbPortOpenReplyIn,
-                              lbTxDataOut,
-                              lbTxMetadataOut,
-                              lbTxLengthOut,
-                              tagsIn,
-                              tagsOut,
-                              metadata_to_book,
-                              metadata_from_book,
-                              time_to_book,
-                              time_from_book,
-                              order_to_book,
-                              order_from_book);
-                break;
-            } else {
-                fast_protocol(lbRxDataIn,
-                              lbRxMetadataIn,
-                              lbRequestPortOpenOut,
-                              lbPortOpenReplyIn,
-                              lbTxDataOut,
-                              lbTxMetadataOut,
-                              lbTxLengthOut,
-                              tagsIn,
-                              tagsOut,
-                              metadata_to_book,
-                              metadata_from_book,
-                              time_to_book,
-                              time_from_book,
-                              order_to_book,
-                              order_from_book);
+                if (tx_beats.empty())
+                {
+                    metadata_buff = lbTxMetadataOut.read();
+                    time_buff = tagsOut.read();
+                }
+                tx_beats.push_back(lbTxDataOut.read());
             }
-        }
-
-        // Receive second packet
-        cout << "Success: all encoded packets received for the order! Encoding Latency: " << encoding_latency << " nanoseconds. Decoding test starts! Order message breakdown:" << endl;
-        while (true)
-        {
-            if (!lbTxDataOut.empty() && !lbTxLengthOut.empty())
+            if (tx_beats.size() > MESSAGE_BUFF_SIZE / (NUM_BYTES_IN_PACKET))
             {
-                second_packet_buff = lbTxDataOut.read();
-                length_buff = lbTxLengthOut.read();
-                fast_protocol(lbRxDataIn,
-                              lbRxMetadataIn,
-                              lbRequestPortOpenOut,
-                              lbPortOpenReplyIn,
-                              lbTxDataOut,
-                              lbTxMetadataOut,
-                              lbTxLengthOut,
-                              tagsIn,
-                              tagsOut,
-                              metadata_to_book,
-                              metadata_from_book,
-                              time_to_book,
-                              time_from_book,
-                              order_to_book,
-                              order_from_book);
-                break;
-            } else {
-                fast_protocol(lbRxDataIn,
-                              lbRxMetadataIn,
-                              lbRequestPortOpenOut,
-                              lbPortOpenReplyIn,
-                              lbTxDataOut,
-                              lbTxMetadataOut,
-                              lbTxLengthOut,
-                              tagsIn,
-                              tagsOut,
-                              metadata_to_book,
-                              metadata_from_book,
-                              time_to_book,
-                              time_from_book,
-                              order_to_book,
-                              order_from_book);
+                cout << "ERROR frame: more than " << MESSAGE_BUFF_SIZE / (NUM_BYTES_IN_PACKET)
+                        << " beats for one order" << endl;
+                return 1;
             }
+            fast_protocol(lbRxDataIn,
+                          lbRxMetadataIn,
+                          lbRequestPortOpenOut,
+                          lbPortOpenReplyIn,
+                          lbTxDataOut,
+                          lbTxMetadataOut,
+                          lbTxLengthOut,
+                          tagsIn,
+                          tagsOut,
+                          metadata_to_book,
+                          metadata_from_book,
+                          time_to_book,
+                          time_from_book,
+                          order_to_book,
+                          order_from_book,
+                          lbRxDataInB,
+                          lbRxMetadataInB,
+                          tagsInB,
+                          seq_gap_out,
+                          drops_unknown_template,
+                          drops_unterminated,
+                          drops_bad_type,
+                          drops_bad_price);
         }
-
-        if (first_packet_buff.last != 0)
+        while (lbTxLengthOut.empty())
         {
-            cout << "ERROR first keep: " << first_packet_buff.keep << " != 0"
-                    << endl;
-            return 1;
+            fast_protocol(lbRxDataIn,
+                          lbRxMetadataIn,
+                          lbRequestPortOpenOut,
+                          lbPortOpenReplyIn,
+                          lbTxDataOut,
+                          lbTxMetadataOut,
+                          lbTxLengthOut,
+                          tagsIn,
+                          tagsOut,
+                          metadata_to_book,
+                          metadata_from_book,
+                          time_to_book,
+                          time_from_book,
+                          order_to_book,
+                          order_from_book,
+                          lbRxDataInB,
+                          lbRxMetadataInB,
+                          tagsInB,
+                          seq_gap_out,
+                          drops_unknown_template,
+                          drops_unterminated,
+                          drops_bad_type,
+                          drops_bad_price);
+        }
+        length_buff = lbTxLengthOut.read();
+        cout << "Success: all encoded packets received for the order! Encoding Latency: " << encoding_latency << " nanoseconds. Decoding test starts! Order message breakdown:" << endl;
 
+        vector<ap_uint<8> > tx_message;
+        unsigned frame_length = 0;
+        for (unsigned b = 0; b < tx_beats.size(); b++)
+        {
+            for (unsigned i = 0; i < NUM_BYTES_IN_PACKET; i++)
+            {
+                if (tx_beats[b].keep[i])
+                {
+                    tx_message.push_back(tx_beats[b].data >> (BYTE * i));
+                    frame_length++;
+                }
+            }
         }
-        if (second_packet_buff.last != 1)
+        // The frame carries exactly one message, nothing more
+        if (length_buff != frame_length || frame_length != message_length(tx_message)
+                || message_length(tx_message) != tx_message.size()
+                || tx_beats.size() != (frame_length + NUM_BYTES_IN_PACKET - 1) / (NUM_BYTES_IN_PACKET))
         {
-            cout << "ERROR second keep: " << second_packet_buff.keep << " != 1"
-                    << endl;
+            cout << "ERROR frame: length " << length_buff << ", " << frame_length << " bytes in "
+                    << tx_beats.size() << " beats for a " << message_length(tx_message)
+                    << "-byte message" << endl;
             return 1;
-
         }
-
-        for (unsigned i = 0; i < NUM_BYTES_IN_PACKET; i++)
+        for (unsigned i = 0; i < MESSAGE_BUFF_SIZE; i++)
         {
-            encoded_message[i] = first_packet_buff.data >> (BYTE * i);
-            encoded_message[i + NUM_BYTES_IN_PACKET] = second_packet_buff.data
-                    >> (BYTE * i);
+            encoded_message[i] = i < tx_message.size() ? tx_message[i] : ap_uint<8>(0);
         }
 
         cout << "Encoded Message: ";
@@ -362,64 +434,47 @@ int main(int argc, char *argv[])
 
         auto startAnother = std::chrono::high_resolution_clock::now();
 
-        while (true)
+        // The reply comes back to the port the order was sent from
+        rx_beats = feed_packet(feed_sequence++, tx_message);
+        std::swap(metadata_buff.sourceSocket, metadata_buff.destinationSocket);
+        lbRxMetadataIn.write(metadata_buff);
+        tagsIn.write(time_buff);
+        for (unsigned b = 0; b < rx_beats.size(); b++)
         {
-            if (!lbRxDataIn.full() && !lbRxMetadataIn.full() && !tagsIn.full())
-            {
-                lbRxDataIn.write(first_packet_buff);
-                lbRxMetadataIn.write(metadata_buff);
-                tagsIn.write(time_buff);
-                fast_protocol(lbRxDataIn,
-                              lbRxMetadataIn,
-                              lbRequestPortOpenOut,
-                              lbPortOpenReplyIn,
-                              lbTxDataOut,
-                              lbTxMetadataOut,
-                              lbTxLengthOut,
-                              tagsIn,
-                              tagsOut,
-                              metadata_to_book,
-                              metadata_from_book,
-                              time_to_book,
-                              time_from_book,
-                              order_to_book,
-                              order_from_book);
-                break;
-            }
+            lbRxDataIn.write(rx_beats[b]);
+            fast_protocol(lbRxDataIn,
+                          lbRxMetadataIn,
+                          lbRequestPortOpenOut,
+                          lbPortOpenReplyIn,
+                          lbTxDataOut,
+                          lbTxMetadataOut,
+                          lbTxLengthOut,
+                          tagsIn,
+                          tagsOut,
+                          metadata_to_book,
+                          metadata_from_book,
+                          time_to_book,
+                          time_from_book,
+                          order_to_book,
+                          order_from_book,
+                          lbRxDataInB,
+                          lbRxMetadataInB,
+                          tagsInB,
+                          seq_gap_out,
+                          drops_unknown_template,
+                          drops_unterminated,
+                          drops_bad_type,
+                          drops_bad_price);
         }
 
         while (true)
         {
-            if (!lbRxDataIn.full())
+            if (!metadata_to_book[0].empty() && !time_to_book[0].empty()
+                    && !order_to_book[0].empty())
             {
-                lbRxDataIn.write(second_packet_buff);
-                fast_protocol(lbRxDataIn,
-                              lbRxMetadataIn,
-                              lbRequestPortOpenOut,
-                              lbPortOpenReplyIn,
-                              lbTxDataOut,
-                              lbTxMetadataOut,
-                              lbTxLengthOut,
-                              tagsIn,
-                              tagsOut,
-                              metadata_to_book,
-                              metadata_from_book,
-                              time_to_book,
-                              time_from_book,
-                              order_to_book,
-                              order_from_book);
-                break;
-            }
-        }
-
-        while (true)
-        {
-            if (!metadata_to_book.empty() && !time_to_book.empty()
-                    && !order_to_book.empty())
-            {
-                metadata_buff = metadata_to_book.read();
-                time_buff = time_to_book.read();
-                decoded_message = order_to_book.read();
+                metadata_buff = metadata_to_book[0].read();
+                time_buff = time_to_book[0].read();
+                decoded_message = order_to_book[0].read();
                 break;
             }
             else
@@ -438,7 +493,15 @@ int main(int argc, char *argv[])
                               time_to_book,
                               time_from_book,
                               order_to_book,
-                              order_from_book);
+                              order_from_book,
+                              lbRxDataInB,
+                              lbRxMetadataInB,
+                              tagsInB,
+                              seq_gap_out,
+                              drops_unknown_template,
+                              drops_unterminated,
+                              drops_bad_type,
+                              drops_bad_price);
             }
         }
         auto endAnother = std::chrono::high_resolution_clock::now();
@@ -453,9 +516,9 @@ int main(int argc, char *argv[])
        
         
 
-        if (decoded_message.price != 1)
+        if (decoded_message.price != price)
         {
-            cout << "ERROR price: " << decoded_message.price << " != 1"
+            cout << "ERROR price: " << decoded_message.price << " != " << price
                     << endl;
             return 1;
 
@@ -480,6 +543,1056 @@ int main(int argc, char *argv[])
         }
     }
 
+    ///////////////////////////////
+    // back-to-back burst of rx  //
+    ///////////////////////////////
+
+    // All messages are queued before the kernel runs, so the number of
+    // fast_protocol invocations needed to drain them is the receive path
+    // initiation interval. The fused path takes one beat per invocation; the
+    // original READ_FIRST/READ_SECOND/FUNC/WRITE FSM took 4 invocations per
+    // two-beat message (36 for these 9 orders without the sequence header).
+    unsigned burst_beats = 0;
+    for (unsigned j = 0; j < burst_messages.size(); j++)
+    {
+        metadata burst_meta = {};
+    burst_meta.destinationSocket.port = PORT_TABLE[0];
+        vector<axiWord> beats = feed_packet(feed_sequence++, burst_messages[j]);
+        burst_beats += beats.size();
+        for (unsigned b = 0; b < beats.size(); b++)
+        {
+            lbRxDataIn.write(beats[b]);
+        }
+        lbRxMetadataIn.write(burst_meta);
+        tagsIn.write(j);
+    }
+
+    unsigned burst_calls = 0;
+    unsigned burst_received = 0;
+    while (burst_received < burst_messages.size() && burst_calls < 100 * burst_messages.size())
+    {
+        fast_protocol(lbRxDataIn,
+                      lbRxMetadataIn,
+                      lbRequestPortOpenOut,
+                      lbPortOpenReplyIn,
+                      lbTxDataOut,
+                      lbTxMetadataOut,
+                      lbTxLengthOut,
+                      tagsIn,
+                      tagsOut,
+                      metadata_to_book,
+                      metadata_from_book,
+                      time_to_book,
+                      time_from_book,
+                      order_to_book,
+                      order_from_book,
+                      lbRxDataInB,
+                      lbRxMetadataInB,
+                      tagsInB,
+                      seq_gap_out,
+                      drops_unknown_template,
+                      drops_unterminated,
+                      drops_bad_type,
+                      drops_bad_price);
+        burst_calls++;
+        while (!order_to_book[0].empty() && !metadata_to_book[0].empty() && !time_to_book[0].empty())
+        {
+            order_to_book[0].read();
+            metadata_to_book[0].read();
+            if (time_to_book[0].read() != burst_received)
+            {
+                cout << "ERROR burst: order " << burst_received << " out of sequence" << endl;
+                return 1;
+            }
+            burst_received++;
+        }
+    }
+
+    if (burst_received != burst_messages.size())
+    {
+        cout << "ERROR burst: received " << burst_received << " of "
+                << burst_messages.size() << " orders" << endl;
+        return 1;
+    }
+    // One invocation per beat, plus the one that finds the input empty
+    if (burst_calls > burst_beats + 1)
+    {
+        cout << "ERROR burst: " << burst_calls << " invocations for " << burst_beats
+                << " beats" << endl;
+        return 1;
+    }
+    cout << "Burst: " << burst_received << " back-to-back orders (" << burst_beats
+            << " beats) in " << burst_calls << " invocations ("
+            << (double)burst_calls / burst_received << " invocations per order, "
+            << (double)burst_calls / burst_beats << " per beat)" << endl;
+
+    ////////////////////////////////////
+    // many messages in one datagram  //
+    ////////////////////////////////////
+
+    vector<ap_uint<8> > datagram;
+    for (unsigned j = 0; j < burst_messages.size(); j++)
+    {
+        datagram.insert(datagram.end(), burst_messages[j].begin(),
+                burst_messages[j].begin() + message_length(burst_messages[j]));
+    }
+
+    const ap_uint<64> datagram_tag = 0xDA7A;
+    metadata datagram_meta = {};
+    datagram_meta.destinationSocket.port = PORT_TABLE[0];
+    lbRxMetadataIn.write(datagram_meta);
+    tagsIn.write(datagram_tag);
+    vector<axiWord> datagram_beats = feed_packet(feed_sequence++, datagram);
+    for (unsigned b = 0; b < datagram_beats.size(); b++)
+    {
+        lbRxDataIn.write(datagram_beats[b]);
+    }
+
+    unsigned datagram_calls = 0;
+    unsigned datagram_received = 0;
+    while (datagram_received < expected_orders.size() && datagram_calls < 100 * expected_orders.size())
+    {
+        fast_protocol(lbRxDataIn,
+                      lbRxMetadataIn,
+                      lbRequestPortOpenOut,
+                      lbPortOpenReplyIn,
+                      lbTxDataOut,
+                      lbTxMetadataOut,
+                      lbTxLengthOut,
+                      tagsIn,
+                      tagsOut,
+                      metadata_to_book,
+                      metadata_from_book,
+                      time_to_book,
+                      time_from_book,
+                      order_to_book,
+                      order_from_book,
+                      lbRxDataInB,
+                      lbRxMetadataInB,
+                      tagsInB,
+                      seq_gap_out,
+                      drops_unknown_template,
+                      drops_unterminated,
+                      drops_bad_type,
+                      drops_bad_price);
+        datagram_calls++;
+        while (!order_to_book[0].empty() && !metadata_to_book[0].empty() && !time_to_book[0].empty())
+        {
+            order received = order_to_book[0].read();
+            const order &expected = expected_orders[datagram_received];
+            metadata_to_book[0].read();
+            if (time_to_book[0].read() != datagram_tag)
+            {
+                cout << "ERROR datagram: order " << datagram_received << " lost the datagram timestamp" << endl;
+                return 1;
+            }
+            if (received.price != expected.price || received.size != expected.size
+                    || received.orderID != expected.orderID || received.type != expected.type)
+            {
+                cout << "ERROR datagram: order " << datagram_received << " decoded as "
+                        << received.price << " " << received.size << " "
+                        << received.orderID << " " << received.type << endl;
+                return 1;
+            }
+            datagram_received++;
+        }
+    }
+
+    if (datagram_received != expected_orders.size())
+    {
+        cout << "ERROR datagram: received " << datagram_received << " of "
+                << expected_orders.size() << " orders" << endl;
+        return 1;
+    }
+    cout << "Datagram: " << datagram_received << " orders in one " << datagram.size()
+            << "-byte datagram decoded in " << datagram_calls << " invocations" << endl;
+
+    ///////////////////////////////////////
+    // presence map and field operators  //
+    ///////////////////////////////////////
+
+    // Template 2: price delta, size copy, orderID increment, type default 3.
+    // A template 1 message in the middle must not disturb its dictionary, and
+    // the last message copies the template ID from the one before.
+    const unsigned char template_stream[] = {
+        0xF8, 0x82, 0xFE, 0x07, 0xA6, 0x8A, 0xE4, 0x82,     // 9.34  10 100 2, every field sent
+        0x80, 0x80, 0x81,                                   // 9.35  10 101 3
+        0x80, 0x80, 0xFB,                                   // 9.30  10 102 3
+        0xA0, 0x80, 0x8A, 0x81,                             // 9.40   1 103 3
+        0x90, 0x80, 0x80, 0x01, 0x80,                       // 9.40   1 128 3
+        0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x82, 0xFB, 0x80,     // 9.34   2 123 0, template 1
+        0xC0, 0x82, 0x80, 0x82,                             // 9.42   1 129 3
+        0x80, 0x80, 0x80                                    // 9.42   1 130 3, template ID copied
+    };
+    struct { int mantissa; unsigned size; unsigned orderID; unsigned type; } template_expected[] = {
+        { 934, 10, 100, 2 }, { 935, 10, 101, 3 }, { 930, 10, 102, 3 }, { 940, 1, 103, 3 },
+        { 940, 1, 128, 3 }, { 934, 2, 123, 0 }, { 942, 1, 129, 3 }, { 942, 1, 130, 3 }
+    };
+    const unsigned template_orders = sizeof(template_expected) / sizeof(template_expected[0]);
+
+    lbRxMetadataIn.write(datagram_meta);
+    tagsIn.write(datagram_tag);
+    vector<axiWord> template_beats = feed_packet(feed_sequence++, vector<ap_uint<8> >(template_stream, template_stream + sizeof(template_stream)));
+    for (unsigned b = 0; b < template_beats.size(); b++)
+    {
+        lbRxDataIn.write(template_beats[b]);
+    }
+
+    unsigned template_calls = 0;
+    unsigned template_received = 0;
+    while (template_received < template_orders && template_calls < 100 * template_orders)
+    {
+        fast_protocol(lbRxDataIn,
+                      lbRxMetadataIn,
+                      lbRequestPortOpenOut,
+                      lbPortOpenReplyIn,
+                      lbTxDataOut,
+                      lbTxMetadataOut,
+                      lbTxLengthOut,
+                      tagsIn,
+                      tagsOut,
+                      metadata_to_book,
+                      metadata_from_book,
+                      time_to_book,
+                      time_from_book,
+                      order_to_book,
+                      order_from_book,
+                      lbRxDataInB,
+                      lbRxMetadataInB,
+                      tagsInB,
+                      seq_gap_out,
+                      drops_unknown_template,
+                      drops_unterminated,
+                      drops_bad_type,
+                      drops_bad_price);
+        template_calls++;
+        while (!order_to_book[0].empty() && !metadata_to_book[0].empty() && !time_to_book[0].empty())
+        {
+            order received = order_to_book[0].read();
+            metadata_to_book[0].read();
+            time_to_book[0].read();
+            if (received.price != decimal_to_fix16(template_expected[template_received].mantissa, -2)
+                    || received.size != template_expected[template_received].size
+                    || received.orderID != template_expected[template_received].orderID
+                    || received.type != template_expected[template_received].type)
+            {
+                cout << "ERROR template: order " << template_received << " decoded as "
+                        << received.price << " " << received.size << " "
+                        << received.orderID << " " << received.type << endl;
+                return 1;
+            }
+            template_received++;
+        }
+    }
+
+    if (template_received != template_orders)
+    {
+        cout << "ERROR template: received " << template_received << " of "
+                << template_orders << " orders" << endl;
+        return 1;
+    }
+    cout << "Templates: " << template_orders << " orders in " << sizeof(template_stream)
+            << " bytes decoded in " << template_calls << " invocations" << endl;
+
+    ////////////////////////////
+    // long decimal mantissas //
+    ////////////////////////////
+
+    // The mantissa is a FAST int64: the same price with more digits, and
+    // mantissas up to the full 10 groups, decode like a short one on the
+    // receive path and in the software decoder.
+    struct { long long mantissa; int exponent; double expected; } long_decimals[] = {
+        { 150000000LL, -8, 1.5 },                       // 9 digits, 4 groups
+        { -12345678901LL, -8, -31605.0 / 256 },         // -123.45678901 rounds to the nearest LSB
+        { 9223372036854775807LL, -8, 127.99609375 },    // 10 groups, saturates high
+        { -9223372036854775807LL - 1, -8, -128 }        // 10 groups, saturates low
+    };
+    const unsigned long_orders = sizeof(long_decimals) / sizeof(long_decimals[0]);
+    vector<ap_uint<8> > long_stream;
+    for (unsigned k = 0; k < long_orders; k++)
+    {
+        vector<ap_uint<8> > message;
+        message.push_back(0xFC);
+        message.push_back(0x81);
+        vector<ap_uint<8> > exponent = fast_int64(long_decimals[k].exponent);
+        vector<ap_uint<8> > mantissa = fast_int64(long_decimals[k].mantissa);
+
+        // The encoder writes the same groups, the tenth one included
+        uint8_t encoded[BUFF_SIZE_2];
+        unsigned encoded_length = 0;
+        Fast_Encoder::encode_signed_int(encoded, encoded_length, long_decimals[k].mantissa);
+        bool encoded_right = encoded_length == mantissa.size();
+        for (unsigned i = 0; encoded_right && i < encoded_length; i++)
+        {
+            encoded_right = encoded[i] == mantissa[i];
+        }
+        if (!encoded_right)
+        {
+            cout << "ERROR long mantissa: " << long_decimals[k].mantissa << " encoded in " << encoded_length
+                    << " groups, expected " << mantissa.size() << endl;
+            return 1;
+        }
+        message.insert(message.end(), exponent.begin(), exponent.end());
+        message.insert(message.end(), mantissa.begin(), mantissa.end());
+        message.push_back(0x8A);            // size 10
+        message.push_back(0x80 | (20 + k)); // orderID
+        message.push_back(0x83);            // limited buy
+
+        // Software decoder: one message in two 64-bit packets
+        uint64_t packets[2] = { 0, 0 };
+        for (unsigned i = 0; i < message.size(); i++)
+        {
+            packets[i / (NUM_BYTES_IN_PACKET)] |= (uint64_t)message[i] << (BYTE * (i % (NUM_BYTES_IN_PACKET)));
+        }
+        order software = { 0, 0, 0, 0, 0 };
+        Fast_Decoder::decode_fast_message(packets[0], packets[1], software);
+        if (software.price != fix16(long_decimals[k].expected) || software.orderID != 20 + k)
+        {
+            cout << "ERROR long mantissa: " << long_decimals[k].mantissa << "e" << long_decimals[k].exponent
+                    << " decoded as " << software.price << " by the software decoder" << endl;
+            return 1;
+        }
+        long_stream.insert(long_stream.end(), message.begin(), message.end());
+    }
+
+    lbRxMetadataIn.write(datagram_meta);
+    tagsIn.write(datagram_tag);
+    vector<axiWord> long_beats = feed_packet(feed_sequence++, long_stream);
+    for (unsigned b = 0; b < long_beats.size(); b++)
+    {
+        lbRxDataIn.write(long_beats[b]);
+    }
+
+    unsigned long_received = 0;
+    for (unsigned call = 0; call < 100 * long_orders && long_received < long_orders; call++)
+    {
+        fast_protocol(lbRxDataIn,
+                      lbRxMetadataIn,
+                      lbRequestPortOpenOut,
+                      lbPortOpenReplyIn,
+                      lbTxDataOut,
+                      lbTxMetadataOut,
+                      lbTxLengthOut,
+                      tagsIn,
+                      tagsOut,
+                      metadata_to_book,
+                      metadata_from_book,
+                      time_to_book,
+                      time_from_book,
+                      order_to_book,
+                      order_from_book,
+                      lbRxDataInB,
+                      lbRxMetadataInB,
+                      tagsInB,
+                      seq_gap_out,
+                      drops_unknown_template,
+                      drops_unterminated,
+                      drops_bad_type,
+                      drops_bad_price);
+        while (!order_to_book[0].empty() && !metadata_to_book[0].empty() && !time_to_book[0].empty())
+        {
+            order received = order_to_book[0].read();
+            metadata_to_book[0].read();
+            time_to_book[0].read();
+            if (received.price != fix16(long_decimals[long_received].expected)
+                    || received.orderID != 20 + long_received)
+            {
+                cout << "ERROR long mantissa: " << long_decimals[long_received].mantissa << "e"
+                        << long_decimals[long_received].exponent << " decoded as " << received.price
+                        << " (orderID " << received.orderID << ")" << endl;
+                return 1;
+            }
+            long_received++;
+        }
+    }
+    if (long_received != long_orders)
+    {
+        cout << "ERROR long mantissa: received " << long_received << " of " << long_orders << " orders" << endl;
+        return 1;
+    }
+    cout << "Long mantissas: " << long_orders << " orders with 4 to 10 mantissa groups decoded exactly" << endl;
+
+    ///////////////////////////
+    // malformed messages    //
+    ///////////////////////////
+
+    // Bad messages are dropped and counted while the good ones around them
+    // still reach the book. An unknown template or a message without a stop
+    // bit within MESSAGE_BUFF_SIZE bytes ends its datagram; a bad type or
+    // price (exponent out of range, mantissa wider than an int64) only drops
+    // its own message.
+    const unsigned char malformed_datagrams[][32] = {
+        { 24,
+          0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x8A, 0xE4, 0x82,   // good, orderID 100
+          0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x8A, 0xE5, 0x89,   // type 9
+          0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x8A, 0xE6, 0x82 }, // good, orderID 102
+        { 24,
+          0xFC, 0x81, 0x83, 0x07, 0xA6, 0x8A, 0xE7, 0x82,   // exponent 3
+          0xFC, 0x81, 0xF6, 0x07, 0xA6, 0x8A, 0xE8, 0x82,   // exponent -10
+          0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x8A, 0xE9, 0x82 }, // good, orderID 105
+        { 24,
+          0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x8A, 0xEA, 0x82,   // good, orderID 106
+          0xFC, 0x85, 0xFE, 0x07, 0xA6, 0x8A, 0xEB, 0x82,   // template 5
+          0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x8A, 0xEC, 0x82 }, // lost with the datagram
+        { 26,
+          0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x8A, 0xED, 0x82,   // good, orderID 109
+          0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,   // no stop bit
+          0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10,
+          0x11, 0x12 },
+        { 12,
+          0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x8A, 0xEE, 0x82,   // good, orderID 110
+          0xFC, 0x81, 0xFE, 0x07 },                         // truncated
+        { 24,
+          0xFC, 0x81, 0xFE, 0x01, 0x00, 0x00, 0x00, 0x00,   // 10-group mantissa past int64
+          0x00, 0x00, 0x00, 0x00, 0x80, 0x8A, 0xEF, 0x82,
+          0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x8A, 0xF0, 0x82 }, // good, orderID 112
+        { 22,
+          0xC0, 0x82, 0xFE, 0x00, 0x00, 0x00, 0x00, 0x00,   // template 2, 11-group mantissa
+          0x00, 0x00, 0x00, 0x00, 0x00, 0x80,
+          0xFC, 0x81, 0xFE, 0x07, 0xA6, 0x8A, 0xF1, 0x82 }  // good, orderID 113
+    };
+    const unsigned malformed_expected[] = { 100, 102, 105, 106, 109, 110, 112, 113 };
+    const unsigned malformed_orders = sizeof(malformed_expected) / sizeof(malformed_expected[0]);
+    const unsigned malformed_packets = sizeof(malformed_datagrams) / sizeof(malformed_datagrams[0]);
+
+    ap_uint<32> unknown_before = drops_unknown_template;
+    ap_uint<32> unterminated_before = drops_unterminated;
+    ap_uint<32> bad_type_before = drops_bad_type;
+    ap_uint<32> bad_price_before = drops_bad_price;
+    for (unsigned k = 0; k < malformed_packets; k++)
+    {
+        lbRxMetadataIn.write(datagram_meta);
+        tagsIn.write(k);
+        vector<axiWord> beats = feed_packet(feed_sequence++,
+                vector<ap_uint<8> >(malformed_datagrams[k] + 1, malformed_datagrams[k] + 1 + malformed_datagrams[k][0]));
+        for (unsigned b = 0; b < beats.size(); b++)
+        {
+            lbRxDataIn.write(beats[b]);
+        }
+    }
+
+    unsigned malformed_received = 0;
+    for (unsigned call = 0; call < 100 * malformed_packets; call++)
+    {
+        fast_protocol(lbRxDataIn,
+                      lbRxMetadataIn,
+                      lbRequestPortOpenOut,
+                      lbPortOpenReplyIn,
+                      lbTxDataOut,
+                      lbTxMetadataOut,
+                      lbTxLengthOut,
+                      tagsIn,
+                      tagsOut,
+                      metadata_to_book,
+                      metadata_from_book,
+                      time_to_book,
+                      time_from_book,
+                      order_to_book,
+                      order_from_book,
+                      lbRxDataInB,
+                      lbRxMetadataInB,
+                      tagsInB,
+                      seq_gap_out,
+                      drops_unknown_template,
+                      drops_unterminated,
+                      drops_bad_type,
+                      drops_bad_price);
+        while (!order_to_book[0].empty() && !metadata_to_book[0].empty() && !time_to_book[0].empty())
+        {
+            order received = order_to_book[0].read();
+            metadata_to_book[0].read();
+            time_to_book[0].read();
+            if (malformed_received >= malformed_orders || received.orderID != malformed_expected[malformed_received]
+                    || received.price != decimal_to_fix16(934, -2) || received.type != 2)
+            {
+                cout << "ERROR malformed: unexpected order " << received.orderID << " "
+                        << received.price << " " << received.type << endl;
+                return 1;
+            }
+            malformed_received++;
+        }
+    }
+
+    if (malformed_received != malformed_orders)
+    {
+        cout << "ERROR malformed: received " << malformed_received << " of "
+                << malformed_orders << " good orders" << endl;
+        return 1;
+    }
+    if (drops_unknown_template - unknown_before != 1 || drops_unterminated - unterminated_before != 2
+            || drops_bad_type - bad_type_before != 1 || drops_bad_price - bad_price_before != 4)
+    {
+        cout << "ERROR malformed: drop counters " << drops_unknown_template - unknown_before << " "
+                << drops_unterminated - unterminated_before << " " << drops_bad_type - bad_type_before
+                << " " << drops_bad_price - bad_price_before << endl;
+        return 1;
+    }
+    cout << "Malformed: " << malformed_received << " good orders kept, dropped "
+            << drops_unknown_template - unknown_before << " unknown template, "
+            << drops_unterminated - unterminated_before << " unterminated, "
+            << drops_bad_type - bad_type_before << " bad type, "
+            << drops_bad_price - bad_price_before << " bad price" << endl;
+
+    ////////////////////////////
+    // A/B feed arbitration   //
+    ////////////////////////////
+
+    // Packet k carries message k and is tagged 100 * feed + k. Feed B is
+    // ahead for the first two packets, packet 4 is lost on feed A only and
+    // packet 6 on both feeds.
+    const unsigned ab_packets = burst_messages.size();
+    const unsigned ab_lost_a = 4;
+    const unsigned ab_lost_both = 6;
+    const unsigned ab_first = feed_sequence;
+    feed_sequence += ab_packets;
+    metadata ab_meta = {};
+    ab_meta.destinationSocket.port = PORT_TABLE[0];
+    for (unsigned feed = 1; feed < 3; feed++)
+    {
+        for (unsigned k = 0; k < ab_packets; k++)
+        {
+            bool on_a = k != ab_lost_a && k != ab_lost_both;
+            bool on_b = k != ab_lost_both;
+            // B's first two packets go in before everything else
+            if ((feed == 1 && k < 2 && on_b) || (feed == 2 && k >= 2 && on_b))
+            {
+                vector<ap_uint<8> > payload(burst_messages[k].begin(),
+                        burst_messages[k].begin() + message_length(burst_messages[k]));
+                vector<axiWord> beats = feed_packet(ab_first + k, payload);
+                for (unsigned b = 0; b < beats.size(); b++)
+                {
+                    lbRxDataInB.write(beats[b]);
+                }
+                lbRxMetadataInB.write(ab_meta);
+                tagsInB.write(100 + k);
+            }
+            if (feed == 2 && on_a)
+            {
+                vector<ap_uint<8> > payload(burst_messages[k].begin(),
+                        burst_messages[k].begin() + message_length(burst_messages[k]));
+                vector<axiWord> beats = feed_packet(ab_first + k, payload);
+                for (unsigned b = 0; b < beats.size(); b++)
+                {
+                    lbRxDataIn.write(beats[b]);
+                }
+                lbRxMetadataIn.write(ab_meta);
+                tagsIn.write(k);
+            }
+        }
+        for (unsigned calls = 0; feed == 1 && calls < 8; calls++)
+        {
+            fast_protocol(lbRxDataIn,
+                          lbRxMetadataIn,
+                          lbRequestPortOpenOut,
+                          lbPortOpenReplyIn,
+                          lbTxDataOut,
+                          lbTxMetadataOut,
+                          lbTxLengthOut,
+                          tagsIn,
+                          tagsOut,
+                          metadata_to_book,
+                          metadata_from_book,
+                          time_to_book,
+                          time_from_book,
+                          order_to_book,
+                          order_from_book,
+                          lbRxDataInB,
+                          lbRxMetadataInB,
+                          tagsInB,
+                          seq_gap_out,
+                          drops_unknown_template,
+                          drops_unterminated,
+                          drops_bad_type,
+                          drops_bad_price);
+        }
+    }
+
+    // Packets 0, 1 and 4 can only come from B; the others from whichever
+    // feed delivers them first
+    const unsigned ab_expected_packets[] = { 0, 1, 2, 3, 4, 5, 7, 8 };
+    const unsigned ab_orders = sizeof(ab_expected_packets) / sizeof(ab_expected_packets[0]);
+    unsigned ab_received = 0;
+    unsigned ab_calls = 0;
+    while (ab_calls < 100 * ab_packets && (ab_received < ab_orders || !lbRxDataIn.empty() || !lbRxDataInB.empty()))
+    {
+        fast_protocol(lbRxDataIn,
+                      lbRxMetadataIn,
+                      lbRequestPortOpenOut,
+                      lbPortOpenReplyIn,
+                      lbTxDataOut,
+                      lbTxMetadataOut,
+                      lbTxLengthOut,
+                      tagsIn,
+                      tagsOut,
+                      metadata_to_book,
+                      metadata_from_book,
+                      time_to_book,
+                      time_from_book,
+                      order_to_book,
+                      order_from_book,
+                      lbRxDataInB,
+                      lbRxMetadataInB,
+                      tagsInB,
+                      seq_gap_out,
+                      drops_unknown_template,
+                      drops_unterminated,
+                      drops_bad_type,
+                      drops_bad_price);
+        ab_calls++;
+        while (!order_to_book[0].empty() && !metadata_to_book[0].empty() && !time_to_book[0].empty())
+        {
+            order received = order_to_book[0].read();
+            metadata_to_book[0].read();
+            ap_uint<64> tag = time_to_book[0].read();
+            unsigned packet = tag % 100;
+            bool from_b = tag >= 100;
+            if (ab_received >= ab_orders || packet != ab_expected_packets[ab_received]
+                    || ((packet < 2 || packet == ab_lost_a) && !from_b)
+                    || received.orderID != expected_orders[packet].orderID)
+            {
+                cout << "ERROR arbitration: order " << ab_received << " came from packet tagged "
+                        << tag << endl;
+                return 1;
+            }
+            ab_received++;
+        }
+    }
+    if (ab_received != ab_orders)
+    {
+        cout << "ERROR arbitration: received " << ab_received << " of " << ab_orders << " orders" << endl;
+        return 1;
+    }
+    if (seq_gap_out.empty())
+    {
+        cout << "ERROR arbitration: lost packet not reported" << endl;
+        return 1;
+    }
+    sequence_gap gap = seq_gap_out.read();
+    if (gap.expected != ab_first + ab_lost_both || gap.received != ab_first + ab_lost_both + 1
+            || !seq_gap_out.empty())
+    {
+        cout << "ERROR arbitration: gap reported as " << gap.expected << " to " << gap.received << endl;
+        return 1;
+    }
+    cout << "Arbitration: " << ab_orders << " of " << ab_packets << " packets taken once from A or B, gap at "
+            << gap.expected << " reported" << endl;
+
+    ///////////////////////////////
+    // channel demultiplexing    //
+    ///////////////////////////////
+
+    // Datagrams for both subscribed ports are interleaved, each port with its
+    // own sequence numbers, and one datagram for a port that is not in the
+    // table has to disappear without a gap report.
+    const unsigned channel_sequence = 1000;
+    const unsigned channel_packets = burst_messages.size();
+    for (unsigned k = 0; k < channel_packets; k++)
+    {
+        metadata channel_meta = {};
+        channel_meta.destinationSocket.port = PORT_TABLE[k % NUM_CHANNELS];
+        if (k == channel_packets / 2)
+        {
+            metadata stray_meta = {};
+            stray_meta.destinationSocket.port = 9999;
+            vector<axiWord> beats = feed_packet(0, burst_messages[k]);
+            for (unsigned b = 0; b < beats.size(); b++)
+            {
+                lbRxDataIn.write(beats[b]);
+            }
+            lbRxMetadataIn.write(stray_meta);
+            tagsIn.write(0);
+        }
+        unsigned sequence = k % NUM_CHANNELS == 0 ? feed_sequence++ : channel_sequence + k / NUM_CHANNELS;
+        vector<axiWord> beats = feed_packet(sequence, burst_messages[k]);
+        for (unsigned b = 0; b < beats.size(); b++)
+        {
+            lbRxDataIn.write(beats[b]);
+        }
+        lbRxMetadataIn.write(channel_meta);
+        tagsIn.write(k);
+    }
+
+    unsigned channel_received[NUM_CHANNELS] = {};
+    for (unsigned calls = 0; calls < 100 * channel_packets && channel_received[0] + channel_received[1] < channel_packets; calls++)
+    {
+        fast_protocol(lbRxDataIn,
+                      lbRxMetadataIn,
+                      lbRequestPortOpenOut,
+                      lbPortOpenReplyIn,
+                      lbTxDataOut,
+                      lbTxMetadataOut,
+                      lbTxLengthOut,
+                      tagsIn,
+                      tagsOut,
+                      metadata_to_book,
+                      metadata_from_book,
+                      time_to_book,
+                      time_from_book,
+                      order_to_book,
+                      order_from_book,
+                      lbRxDataInB,
+                      lbRxMetadataInB,
+                      tagsInB,
+                      seq_gap_out,
+                      drops_unknown_template,
+                      drops_unterminated,
+                      drops_bad_type,
+                      drops_bad_price);
+        for (unsigned c = 0; c < NUM_CHANNELS; c++)
+        {
+            while (!order_to_book[c].empty() && !metadata_to_book[c].empty() && !time_to_book[c].empty())
+            {
+                order received = order_to_book[c].read();
+                metadata received_meta = metadata_to_book[c].read();
+                ap_uint<64> tag = time_to_book[c].read();
+                unsigned expected_tag = channel_received[c] * NUM_CHANNELS + c;
+                if (tag != expected_tag || received_meta.sourceSocket.port != PORT_TABLE[c]
+                        || received.orderID != expected_orders[expected_tag].orderID
+                        || received.instrument != c)
+                {
+                    cout << "ERROR channel: order tagged " << tag << " on channel " << c << endl;
+                    return 1;
+                }
+                channel_received[c]++;
+            }
+        }
+    }
+    if (channel_received[0] + channel_received[1] != channel_packets || !seq_gap_out.empty())
+    {
+        cout << "ERROR channel: received " << channel_received[0] << " + " << channel_received[1]
+                << " of " << channel_packets << " orders" << endl;
+        return 1;
+    }
+    cout << "Channels: " << channel_received[0] << " orders on port " << PORT_TABLE[0] << ", "
+            << channel_received[1] << " on port " << PORT_TABLE[1] << ", unknown port dropped" << endl;
+
+    ///////////////////////////////
+    // per-channel dictionaries  //
+    ///////////////////////////////
+
+    // Template 2 messages of both channels are interleaved. Each channel
+    // keeps its own previous values and template ID, so the delta-only
+    // message of one channel continues from that channel's last order.
+    // Channel 0 still holds 9.42 from the template test; channel 1 starts
+    // from the initial values.
+    const unsigned char dictionary_messages[][8] = {
+        { 6, 0xF8, 0x82, 0x80, 0x80, 0x8A, 0xE4 },          // channel 0: 9.42 10 100, type follows
+        { 7, 0xF8, 0x82, 0xFE, 0x03, 0xF4, 0x85, 0xB2 },    // channel 1: 5.00  5  50, type follows
+        { 3, 0x80, 0x80, 0x81 },                            // channel 0: 9.43 10 101 3
+        { 3, 0x80, 0x80, 0x81 }                             // channel 1: 5.01  5  51 3
+    };
+    const unsigned char dictionary_types[] = { 0x82, 0x83 };
+    struct { int mantissa; unsigned size; unsigned orderID; unsigned type; } dictionary_expected[NUM_CHANNELS][2] = {
+        { { 942, 10, 100, 2 }, { 943, 10, 101, 3 } },
+        { { 500, 5, 50, 3 }, { 501, 5, 51, 3 } }
+    };
+    const unsigned dictionary_packets = sizeof(dictionary_messages) / sizeof(dictionary_messages[0]);
+    unsigned dictionary_sequence[NUM_CHANNELS] = { feed_sequence, channel_sequence + channel_packets / NUM_CHANNELS };
+    for (unsigned k = 0; k < dictionary_packets; k++)
+    {
+        unsigned c = k % NUM_CHANNELS;
+        vector<ap_uint<8> > message(dictionary_messages[k] + 1, dictionary_messages[k] + 1 + dictionary_messages[k][0]);
+        if (k < NUM_CHANNELS)
+        {
+            message.push_back(dictionary_types[c]);
+        }
+        metadata dictionary_meta = {};
+        dictionary_meta.destinationSocket.port = PORT_TABLE[c];
+        vector<axiWord> beats = feed_packet(dictionary_sequence[c]++, message);
+        for (unsigned b = 0; b < beats.size(); b++)
+        {
+            lbRxDataIn.write(beats[b]);
+        }
+        lbRxMetadataIn.write(dictionary_meta);
+        tagsIn.write(k);
+    }
+    feed_sequence = dictionary_sequence[0];
+
+    unsigned dictionary_received[NUM_CHANNELS] = {};
+    for (unsigned calls = 0; calls < 100 * dictionary_packets
+            && dictionary_received[0] + dictionary_received[1] < dictionary_packets; calls++)
+    {
+        fast_protocol(lbRxDataIn,
+                      lbRxMetadataIn,
+                      lbRequestPortOpenOut,
+                      lbPortOpenReplyIn,
+                      lbTxDataOut,
+                      lbTxMetadataOut,
+                      lbTxLengthOut,
+                      tagsIn,
+                      tagsOut,
+                      metadata_to_book,
+                      metadata_from_book,
+                      time_to_book,
+                      time_from_book,
+                      order_to_book,
+                      order_from_book,
+                      lbRxDataInB,
+                      lbRxMetadataInB,
+                      tagsInB,
+                      seq_gap_out,
+                      drops_unknown_template,
+                      drops_unterminated,
+                      drops_bad_type,
+                      drops_bad_price);
+        for (unsigned c = 0; c < NUM_CHANNELS; c++)
+        {
+            while (!order_to_book[c].empty() && !metadata_to_book[c].empty() && !time_to_book[c].empty())
+            {
+                order received = order_to_book[c].read();
+                metadata_to_book[c].read();
+                time_to_book[c].read();
+                unsigned n = dictionary_received[c];
+                if (n >= 2 || received.price != decimal_to_fix16(dictionary_expected[c][n].mantissa, -2)
+                        || received.size != dictionary_expected[c][n].size
+                        || received.orderID != dictionary_expected[c][n].orderID
+                        || received.type != dictionary_expected[c][n].type)
+                {
+                    cout << "ERROR dictionary: channel " << c << " order " << n << " decoded as "
+                            << received.price << " " << received.size << " "
+                            << received.orderID << " " << received.type << endl;
+                    return 1;
+                }
+                dictionary_received[c]++;
+            }
+        }
+    }
+    if (dictionary_received[0] + dictionary_received[1] != dictionary_packets || !seq_gap_out.empty())
+    {
+        cout << "ERROR dictionary: received " << dictionary_received[0] << " + " << dictionary_received[1]
+                << " of " << dictionary_packets << " orders" << endl;
+        return 1;
+    }
+    cout << "Dictionaries: interleaved template 2 streams of " << NUM_CHANNELS
+            << " channels decoded from their own previous values" << endl;
+
+    /////////////////////////////
+    // outbound order batching //
+    /////////////////////////////
+
+    // The first batch_switch orders go to one destination and the rest to
+    // another, so frames are flushed on size, on the change of destination
+    // and, for the last one, on the timeout.
+    const unsigned batch_orders = 400;
+    const unsigned batch_switch = 300;
+    metadata batch_meta[2] = {};
+    batch_meta[0].destinationSocket.port = 0x1000;
+    batch_meta[1].destinationSocket.port = 0x2000;
+    for (unsigned i = 0; i < batch_orders; i++)
+    {
+        metadata_from_book.write(batch_meta[i >= batch_switch]);
+        time_from_book.write(i);
+        order_from_book.write(expected_orders[i % expected_orders.size()]);
+    }
+
+    vector<vector<ap_uint<8> > > frames;
+    vector<metadata> frame_meta;
+    vector<ap_uint<16> > frame_lengths;
+    vector<ap_uint<8> > current_frame;
+    unsigned batch_tags = 0;
+    unsigned batch_calls = 0;
+    unsigned batch_done = 0;
+    // Every order is out once its tag is, and the last frame after the flush timeout
+    for (; batch_calls < 10 * batch_orders && (batch_tags < batch_orders || batch_done++ < 4 * TX_FLUSH_TIMEOUT); batch_calls++)
+    {
+        fast_protocol(lbRxDataIn,
+                      lbRxMetadataIn,
+                      lbRequestPortOpenOut,
+                      lbPortOpenReplyIn,
+                      lbTxDataOut,
+                      lbTxMetadataOut,
+                      lbTxLengthOut,
+                      tagsIn,
+                      tagsOut,
+                      metadata_to_book,
+                      metadata_from_book,
+                      time_to_book,
+                      time_from_book,
+                      order_to_book,
+                      order_from_book,
+                      lbRxDataInB,
+                      lbRxMetadataInB,
+                      tagsInB,
+                      seq_gap_out,
+                      drops_unknown_template,
+                      drops_unterminated,
+                      drops_bad_type,
+                      drops_bad_price);
+        while (!tagsOut.empty())
+        {
+            if (tagsOut.read() != batch_tags)
+            {
+                cout << "ERROR batching: timestamp of order " << batch_tags << " out of sequence" << endl;
+                return 1;
+            }
+            batch_tags++;
+        }
+        while (!lbTxMetadataOut.empty())
+        {
+            frame_meta.push_back(lbTxMetadataOut.read());
+        }
+        while (!lbTxLengthOut.empty())
+        {
+            frame_lengths.push_back(lbTxLengthOut.read());
+        }
+        while (!lbTxDataOut.empty())
+        {
+            axiWord beat = lbTxDataOut.read();
+            if (!beat.last && beat.keep != 0xFF)
+            {
+                cout << "ERROR batching: partial beat in the middle of a frame" << endl;
+                return 1;
+            }
+            for (unsigned i = 0; i < NUM_BYTES_IN_PACKET; i++)
+            {
+                if (beat.keep[i])
+                {
+                    current_frame.push_back(beat.data >> (BYTE * i));
+                }
+            }
+            if (beat.last)
+            {
+                frames.push_back(current_frame);
+                current_frame.clear();
+            }
+        }
+    }
+
+    if (batch_tags != batch_orders || !current_frame.empty() || frames.size() < 3
+            || frame_meta.size() != frames.size() || frame_lengths.size() != frames.size())
+    {
+        cout << "ERROR batching: " << batch_tags << " timestamps, " << frames.size() << " frames, "
+                << frame_meta.size() << " metadata, " << frame_lengths.size() << " lengths" << endl;
+        return 1;
+    }
+    unsigned batch_bytes = 0;
+    for (unsigned f = 0; f < frames.size(); f++)
+    {
+        // Only a lone message may exceed the MTU
+        if (frame_lengths[f] != frames[f].size()
+                || (frames[f].size() > TX_BATCH_MTU && message_length(frames[f]) != frames[f].size()))
+        {
+            cout << "ERROR batching: frame " << f << " of " << frames[f].size()
+                    << " bytes reported as " << frame_lengths[f] << endl;
+            return 1;
+        }
+        if (f > 0 && frame_meta[f].destinationSocket.port < frame_meta[f - 1].destinationSocket.port)
+        {
+            cout << "ERROR batching: frame " << f << " out of order" << endl;
+            return 1;
+        }
+        batch_bytes += frames[f].size();
+    }
+
+    // Every order of every frame has to decode back, in order
+    unsigned batch_received = 0;
+    for (unsigned f = 0; f < frames.size(); f++)
+    {
+        metadata loopback_meta = frame_meta[f];
+        loopback_meta.destinationSocket.port = PORT_TABLE[0];
+        lbRxMetadataIn.write(loopback_meta);
+        tagsIn.write(f);
+        vector<axiWord> frame_beats = feed_packet(feed_sequence++, frames[f]);
+        for (unsigned b = 0; b < frame_beats.size(); b++)
+        {
+            lbRxDataIn.write(frame_beats[b]);
+        }
+    }
+    for (unsigned calls = 0; batch_received < batch_orders && calls < 10 * batch_orders; calls++)
+    {
+        fast_protocol(lbRxDataIn,
+                      lbRxMetadataIn,
+                      lbRequestPortOpenOut,
+                      lbPortOpenReplyIn,
+                      lbTxDataOut,
+                      lbTxMetadataOut,
+                      lbTxLengthOut,
+                      tagsIn,
+                      tagsOut,
+                      metadata_to_book,
+                      metadata_from_book,
+                      time_to_book,
+                      time_from_book,
+                      order_to_book,
+                      order_from_book,
+                      lbRxDataInB,
+                      lbRxMetadataInB,
+                      tagsInB,
+                      seq_gap_out,
+                      drops_unknown_template,
+                      drops_unterminated,
+                      drops_bad_type,
+                      drops_bad_price);
+        while (!order_to_book[0].empty() && !metadata_to_book[0].empty() && !time_to_book[0].empty())
+        {
+            order received = order_to_book[0].read();
+            const order &expected = expected_orders[batch_received % expected_orders.size()];
+            metadata_to_book[0].read();
+            time_to_book[0].read();
+            if (received.price != expected.price || received.size != expected.size
+                    || received.orderID != expected.orderID || received.type != expected.type)
+            {
+                cout << "ERROR batching: order " << batch_received << " decoded as "
+                        << received.price << " " << received.size << " "
+                        << received.orderID << " " << received.type << endl;
+                return 1;
+            }
+            batch_received++;
+        }
+    }
+    if (batch_received != batch_orders)
+    {
+        cout << "ERROR batching: " << batch_received << " of " << batch_orders << " orders decoded back" << endl;
+        return 1;
+    }
+    cout << "Batching: " << batch_orders << " orders sent in " << frames.size() << " frames ("
+            << (double)batch_bytes / frames.size() << " bytes per frame)" << endl;
+
+    // Every fix16 has to survive encode -> decode through the decimal scaler
+    for (int raw = -32768; raw <= 32767; raw++)
+    {
+        fix16 value;
+        value.range(15, 0) = raw;
+        decimal_mantissa mantissa;
+        decimal_exponent exponent;
+        fix16_to_decimal(value, mantissa, exponent);
+        if (decimal_to_fix16(mantissa, exponent) != value)
+        {
+            cout << "ERROR decimal: " << value << " encoded as " << mantissa
+                    << "e" << exponent << " does not decode back" << endl;
+            return 1;
+        }
+    }
+
+    // Rounding and saturation of decimals that do not fit fix16 exactly
+    struct { long long mantissa; int exponent; double expected; } decimal_cases[] = {
+        { 1234, -2, 3159.0 / 256 },     // 12.34 rounds down to the nearest LSB
+        { -1234, -2, -3159.0 / 256 },
+        { 5, -3, 1.0 / 256 },           // 0.005 rounds up
+        { 1, -9, 0 },                   // below half an LSB
+        { 1000, 0, 127.99609375 },      // saturates high
+        { -129, 0, -128 },              // saturates low
+        { 12, 1, 120 },
+        { 150000000LL, -8, 1.5 },       // 1.5 with 8 decimals
+        { 12799999999LL, -8, 127.99609375 }, // rounds up to 128 and saturates
+        { 1234567LL, -5, 3160.0 / 256 }, // 12.34567 rounds down to the nearest LSB
+        { 65536, 0, 127.99609375 },     // past 16 bits at a non-negative exponent
+        { -9223372036854775807LL - 1, -1, -128 },
+        { 1, 63, 127.99609375 },
+        { 0, 63, 0 }
+    };
+    for (unsigned i = 0; i < sizeof(decimal_cases) / sizeof(decimal_cases[0]); i++)
+    {
+        fix16 decoded = decimal_to_fix16(decimal_cases[i].mantissa, decimal_cases[i].exponent);
+        if (decoded != fix16(decimal_cases[i].expected))
+        {
+            cout << "ERROR decimal: " << decimal_cases[i].mantissa << "e" << decimal_cases[i].exponent
+                    << " decoded as " << decoded << " instead of " << decimal_cases[i].expected << endl;
+            return 1;
+        }
+    }
+    cout << "Decimal: all 65536 fix16 values round-trip exactly" << endl;
+
     ifs.close();
     ofs.close();
 
@@ -0,0 +1,95 @@
+#ifndef FAST_TEMPLATES_H
+#define FAST_TEMPLATES_H
+
+#include "fast.h"
+
+/* Template dictionary of the feed.
+ *
+ * A template is a C++ type listing the field operator of each value field of
+ * an order (price, size, orderID, type, in wire order), so the decoder of every
+ * template is generated and fully specialized at compile time. The presence
+ * map holds one bit for the template ID (copy operator) followed by one bit
+ * for each field whose operator uses it, most significant data bit first.
+ * Every template keeps its own previous values, separately for every channel
+ * (template-scoped dictionary per channel).
+ *
+ * Operators (FAST 1.1):
+ * - op_none:      always transmitted, no pmap bit
+ * - op_copy:      pmap bit; absent means the previous value
+ * - op_increment: pmap bit; absent means the previous value + 1
+ * - op_delta:     always transmitted, no pmap bit; a signed difference to the
+ *                 previous value (exponent and mantissa apart for a decimal)
+ * - op_default:   pmap bit; absent means the initial value
+ * The optional VALUE/EXPONENT is the initial value of the dictionary entry;
+ * for the price it is the mantissa and exponent of the decimal.
+ */
+
+#define PMAP_TEMPLATE_ID_BIT    6   // first presence map bit of the first pmap byte
+#define ORDER_VALUE_FIELDS      4   // price, size, orderID, type
+
+// Order of value fields
+#define PRICE_VALUE_NUM         0   // exponent and mantissa: two stop bits
+#define SIZE_VALUE_NUM          1
+#define ORDER_ID_VALUE_NUM      2
+#define TYPE_VALUE_NUM          3
+
+template <int VALUE = 0, int EXPONENT = 0>
+struct fast_operator {
+    enum { initial_value = VALUE, initial_exponent = EXPONENT };
+};
+
+template <int VALUE = 0, int EXPONENT = 0>
+struct op_none : fast_operator<VALUE, EXPONENT> {
+    enum { uses_pmap = 0, signed_wire = 0 };
+    template <class V>
+    static V apply(bool, V wire, V, V) { return wire; }
+};
+
+template <int VALUE = 0, int EXPONENT = 0>
+struct op_copy : fast_operator<VALUE, EXPONENT> {
+    enum { uses_pmap = 1, signed_wire = 0 };
+    template <class V>
+    static V apply(bool transmitted, V wire, V previous, V) { return transmitted ? wire : previous; }
+};
+
+template <int VALUE = 0, int EXPONENT = 0>
+struct op_increment : fast_operator<VALUE, EXPONENT> {
+    enum { uses_pmap = 1, signed_wire = 0 };
+    template <class V>
+    static V apply(bool transmitted, V wire, V previous, V) { return transmitted ? wire : V(previous + 1); }
+};
+
+template <int VALUE = 0, int EXPONENT = 0>
+struct op_delta : fast_operator<VALUE, EXPONENT> {
+    enum { uses_pmap = 0, signed_wire = 1 };
+    template <class V>
+    static V apply(bool, V wire, V previous, V) { return previous + wire; }
+};
+
+template <int VALUE = 0, int EXPONENT = 0>
+struct op_default : fast_operator<VALUE, EXPONENT> {
+    enum { uses_pmap = 1, signed_wire = 0 };
+    template <class V>
+    static V apply(bool transmitted, V wire, V, V initial) { return transmitted ? wire : initial; }
+};
+
+template <int ID, class PriceOp, class SizeOp, class OrderIdOp, class TypeOp>
+struct fast_template {
+    enum { id = ID };
+    typedef PriceOp price_op;
+    typedef SizeOp size_op;
+    typedef OrderIdOp order_id_op;
+    typedef TypeOp type_op;
+};
+
+// Full order: every field is sent (pmap 0xFC with the template ID)
+typedef fast_template<1, op_copy<>, op_copy<>, op_copy<>, op_copy<> > order_template;
+
+// Order stream of one participant: the price moves by small deltas, the size
+// repeats, IDs are sequential and orders are limited buys unless stated, so a
+// typical message is the presence map and two one-byte price deltas.
+typedef fast_template<2, op_delta<>, op_copy<>, op_increment<>, op_default<3> > order_update_template;
+
+#define NUM_TEMPLATES           2
+
+#endif  // FAST_TEMPLATES_H
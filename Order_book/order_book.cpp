@@ -1,30 +1,93 @@
 /*How does this work:
   
-  1.log_base_2 and pow2 are utility functions that calculate the binary logarithm and powers of 2, respectively, using bitwise 
-  operations for efficiency.find_path is a function that determines the path in the heap structure where a new order should be 
-  inserted or where an order should be removed from.
+  1.log_base_2 and pow2 are utility functions that calculate the binary logarithm and powers of 2, respectively, using
+  bitwise operations for efficiency.find_path is a function that determines the path in the heap structure where a new
+  order should be inserted or where an order should be removed from. Each side of the book is a lane_side of LANES
+  heap_side<L> lanes (heap and orderID index), picked by a hash of the orderID (lane_of), and the heap functions are
+  templates over the number of levels L, so the book size is set by LEVELS and LANE_BITS alone and the index fields
+  are only as wide as L needs. An order only ever touches the heap of its lane; the best order of a side is picked
+  from the lane roots by a compare tree (best_lane).
   
-  2. calculate_index uses bitwise operations to find the index of a child node in the heap based on the current path and level 
-  in the heap. left_child and right_child functions return references to the left and right children of a given node in the heap.
+  2. calculate_index uses bitwise operations to find the index of a child node in the heap based on the current path
+  and level in the heap. left_child and right_child functions return references to the left and right children of a
+  given node in the heap.
   
-  3.swapOrders swaps the values of two orders. This is used during the reheapification process when the heap order is restored 
-  after an insertion or removal.add_bid and add_ask insert new bid and ask orders into the heap. They use find_path to determine 
-  where to insert the new order and then perform swaps as necessary to maintain the heap's order.remove_bid and remove_ask remove 
-  orders from the heap. If the order to be removed is at the top, it is removed directly; otherwise, it's marked for removal later.
-  The heap is then restructured to fill in the gap left by the removed order.
+  3.swapOrders swaps the values of two orders. This is used during the reheapification process when the heap order is
+  restored after an insertion or removal. The heaps hold packed order_words (order_book.hpp) rather than order
+  structs: price key above time key, so a single unsigned compare decides every swap on either side. The time key is
+  an arrival number the book gives each order when it rests (and again when an amend sends it to the back of its
+  price), not its orderID. The word is 64 bits: below the key it holds only a handle to the order's index entry, which
+  keeps the orderID and size. Orders are packed when they rest and unpacked only where they leave the book (top of
+  book, executions, the level store).add_bid and add_ask insert new bid and ask orders into the heap. They use
+  find_path to determine where to insert the new order and then perform swaps as necessary to maintain the heap's
+  order.remove_bid and remove_ask remove orders from the heap. Every order that moves is recorded in an orderID index,
+  so a REMOVE finds its order wherever it sits, takes its size off, and once it is used up moves the last order of the
+  heap into its slot and sifts it up or down, so the heap stays compact and every push and pop takes log2 of the
+  lane's occupancy steps. A MODIFY finds its order the same way, amends price and size in place (a smaller size at the
+  same price only changes its index entry) and restores the heap order with a single sift, up when the new price ranks
+  the order higher and down otherwise.
   
-  4. The functions interact with streams (stream<order>, stream<Time>, stream<metadata>) to handle incoming and outgoing data. 
-  These streams are abstractions over channels that can be used for communication in hardware designs. order_book is the main function
-  that processes incoming orders (order_stream), timestamps (incoming_time), and other metadata (incoming_meta). It handles new limit 
-  orders (LIMIT_BID and LIMIT_ASK), and requests to remove orders (REMOVE_BID and REMOVE_ASK).*/
+  4.Market orders and limit orders that cross the spread are matched first: the opposite heap is swept from its top,
+  every fill (resting orderID, price and size) goes out on the executions stream, and the top of book is published
+  once at the end. What is left of a limit order then rests in its own heap; what is left of a market order is
+  dropped. An amend to a price that crosses the spread cancels its order (take_order) and comes in as a limit order
+  with the same orderID, so no amend leaves the book crossed.
+  
+  5.Next to each heap the engine keeps the size aggregated per price tick (the level store of price_level_book.cpp),
+  updated by every rest, fill, cancel, amend and eviction, so the best DEPTH_LEVELS levels of each side go out on the
+  depth stream after every order without scanning the heap. The store covers a window of TICKS ticks (order_book.hpp):
+  a limit order priced outside it is refused and an amend out of it cancels its order, both reported on the evictions
+  stream.
+  
+  6.A limit order that finds its lane full evicts the worst order of the lane: the worst resting order, kept at the
+  root of a tournament tree over the heap's bottom level (heap_side.worst, refreshed by update_worst whenever a bottom
+  slot changes), which the new order then replaces, or the new order itself when it ranks below all of them. The
+  evicted order goes out on the evictions stream and leaves the level store, so the book stays consistent at capacity.
+  A limit order whose orderID already rests in its lane, or whose two index buckets are full, is refused the same way
+  instead of orphaning a resting order, and counted in index_collisions.
+  
+  7.Every top of book output goes through publish_bbo. By default it writes the sides an order may have changed, as
+  above; a side that has just been emptied goes out as an empty order (size 0), so it is reported in both modes. In
+  change-only mode (change_only on the CTRL_BUS) the bid and ask go out together only when the best price or size of
+  either changed, and a backpressured output holds only the newest top of book (conflation) instead of stalling the
+  book; suppressed_updates counts the updates dropped or conflated.
+  
+  8. The functions interact with streams (stream<order>, stream<Time>, stream<metadata>) to handle incoming and
+  outgoing data. These streams are abstractions over channels that can be used for communication in hardware designs.
+  order_book is the main function that processes incoming orders (order_stream), timestamps (incoming_time), and other
+  metadata (incoming_meta). It handles new limit orders (LIMIT_BID and LIMIT_ASK), and requests to remove orders
+  (REMOVE_BID and REMOVE_ASK).
+  
+  9.order_book keeps one book per instrument (order.instrument). It is a dataflow region: route_orders sends up to
+  BOOK_BANKS orders a call to the banks of their instruments, each bank (book_bank<BANK>) holds the heaps, level
+  stores and bbo of its INSTRUMENTS_PER_BANK instruments, and merge_banks forwards the banks' outputs, which carry
+  their instrument, to the kernel's streams. Banks share no memory, so orders for instruments in different banks are
+  processed at the same time. A bank sends each top of book as one top_of_book (sides, timestamp and metadata
+  together), so merge_banks keeps the four top of book streams aligned per order. merge_banks never blocks: it always
+  reads the banks' tops and conflates the one a bank has waiting while the top of book streams are backpressured,
+  and every other output only stalls the banks on that output. order_book, route_orders and merge_banks serve every
+  engine; an engine only supplies its book_bank.
+  
+  10.Every bank keeps performance counters (book_counters: occupancy, high-water marks, overflow drops, index
+  collisions, and orders and heap loop cycles per order type) and sends them to merge_banks after every call, which
+  adds them up and copies them to the counters port on CTRL_BUS when the host raises snapshot.*/
   
 #include "order_book.hpp"
 
 
 int log_base_2(unsigned index){
-// Directly access a read-only memory (ROM) with precomputed log base 2 values
+// Position of the highest set bit (a priority encoder, i.e. 31 - clz) rather
+// than a ROM of CAPACITY entries, so it costs the same for every book size
 #pragma HLS INLINE
-    return log_rom[index];
+    int log = 0;
+    LOG_LOOP:
+    for (int bit = 1; bit < 32; bit++) {
+        #pragma HLS UNROLL
+        if ((index >> bit) & 1) {
+            log = bit;
+        }
+    }
+    return log;
 }
 
 int pow2(int level){
@@ -34,13 +97,10 @@ int pow2(int level){
 }
 
 // Optimize find_path by ensuring efficient conditional checks and minimizing operations
-int find_path(unsigned& counter, int& hole_counter, int hole_idx[CAPACITY], int level) {
+template <int L>
+int find_path(heap_side<L>& side, int level) {
     #pragma HLS INLINE
-    if (hole_counter > 0) {
-        return hole_idx[--hole_counter];
-    } else {
-        return counter - (1 << level); // Using shift instead of pow2 for consistency and clarity
-    }
+    return side.counter - (1 << level); // Using shift instead of pow2 for consistency and clarity
 }
 
 // Simplify calculate_index by using conditional operator for compactness
@@ -49,272 +109,1095 @@ unsigned calculate_index(int insert_path, int level, int idx) {
     return ((insert_path >> level) & 1) ? (2 * idx + 1) : (2 * idx);
 }
 
-order& left_child(unsigned level, unsigned index, order queue[LEVELS][CAPACITY/2]){
+template <int L>
+order_word& left_child(unsigned level, unsigned index, heap_side<L>& side){
+    #pragma HLS INLINE
+    return side.heap[level+1][index*2];
+}
+
+template <int L>
+order_word& right_child(unsigned level, unsigned index, heap_side<L>& side){
+    #pragma HLS INLINE
+    return side.heap[level+1][(index*2) + 1];
+}
+// Lane of an order (see LANES): the low LANE_BITS of its orderID XORed with
+// the top LANE_BITS of a multiplicative (Fibonacci) hash of the bits above them
+unsigned lane_of(ap_uint<32> orderID) {
+    #pragma HLS INLINE
+    unsigned spread = ((orderID.to_uint() >> LANE_BITS) * 0x9E3779B1u) >> (31 - LANE_BITS) >> 1;
+    return (orderID.to_uint() ^ spread) & (LANES - 1);
+}
+
+// Bucket of an orderID in index table t (see INDEX_WAYS): the top
+// INDEX_SET_BITS of a multiplicative hash, with a different odd constant per
+// table so that orderIDs sharing one bucket rarely share the other
+unsigned index_set(ap_uint<32> orderID, int table) {
+    #pragma HLS INLINE
+    unsigned mix = orderID.to_uint() * (table == 0 ? 0x85EBCA77u : 0xC2B2AE3Du);
+    return mix >> (31 - INDEX_SET_BITS) >> 1;
+}
+
+// Lane holding the best order of a side: a LANE_BITS-deep compare tree over
+// the lane roots. Empty lanes have the all-zero root and never win over a
+// resting order.
+template <int L, int K>
+unsigned best_lane(lane_side<L, K>& side) {
+    #pragma HLS INLINE
+    order_word root[K];
+    unsigned lane[K];
+    #pragma HLS ARRAY_PARTITION variable=root complete
+    #pragma HLS ARRAY_PARTITION variable=lane complete
+    ROOT_LOOP:
+    for (int k = 0; k < K; k++) {
+        #pragma HLS UNROLL
+        root[k] = side.lane[k].heap[0][0];
+        lane[k] = k;
+    }
+    MERGE_TREE_LOOP:
+    for (int width = K / 2; width > 0; width /= 2) {
+        #pragma HLS UNROLL
+        for (int k = 0; k < width; k++) {
+            #pragma HLS UNROLL
+            if (ranks_before(root[k + width], root[k])) {
+                root[k] = root[k + width];
+                lane[k] = lane[k + width];
+            }
+        }
+    }
+    return lane[0];
+}
+
+// Best order of a side, the empty word when the side is empty
+template <int L, int K>
+order_word best_word(lane_side<L, K>& side) {
+    #pragma HLS INLINE
+    return side.lane[best_lane(side)].heap[0][0];
+}
+
+// Entry tagged with orderID: both of its buckets are searched, all ways at
+// once. orderID 0 is never found, as it tags the free entries.
+template <int L>
+bool find_entry(const order_location<L> index[2][INDEX_SETS][INDEX_WAYS], ap_uint<32> orderID,
+                unsigned& table, unsigned& set, unsigned& way) {
     #pragma HLS INLINE
-    return queue[level+1][index*2];
+    bool found = false;
+    table = 0;
+    set = 0;
+    way = 0;
+    TAG_TABLE_LOOP:
+    for (int t = 0; t < 2; t++) {
+        #pragma HLS UNROLL
+        unsigned s = index_set(orderID, t);
+        TAG_WAY_LOOP:
+        for (int w = 0; w < INDEX_WAYS; w++) {
+            #pragma HLS UNROLL
+            if (!found && orderID != 0 && index[t][s][w].orderID == orderID) {
+                found = true;
+                table = t;
+                set = s;
+                way = w;
+            }
+        }
+    }
+    return found;
+}
+
+// Free entry for a new orderID: the first free way of the less full of its
+// two buckets. Returns false when both buckets are full.
+template <int L>
+bool free_entry(const order_location<L> index[2][INDEX_SETS][INDEX_WAYS], ap_uint<32> orderID,
+                unsigned& table, unsigned& set, unsigned& way) {
+    #pragma HLS INLINE
+    unsigned used[2], first[2];
+    FREE_TABLE_LOOP:
+    for (int t = 0; t < 2; t++) {
+        #pragma HLS UNROLL
+        unsigned s = index_set(orderID, t);
+        used[t] = 0;
+        first[t] = INDEX_WAYS;
+        FREE_WAY_LOOP:
+        for (int w = INDEX_WAYS - 1; w >= 0; w--) {
+            #pragma HLS UNROLL
+            if (index[t][s][w].orderID != 0) {
+                used[t]++;
+            } else {
+                first[t] = w;
+            }
+        }
+    }
+    table = used[1] < used[0] ? 1 : 0;
+    set = index_set(orderID, table);
+    way = first[table];
+    return way != INDEX_WAYS;
+}
+
+// Handle of an index entry, the low bits of the order's heap word
+ap_uint<HANDLE_BITS> entry_handle(unsigned table, unsigned set, unsigned way) {
+    #pragma HLS INLINE
+    return (ap_uint<HANDLE_BITS>(table) << (INDEX_SET_BITS + INDEX_WAY_BITS)) |
+           (ap_uint<HANDLE_BITS>(set) << INDEX_WAY_BITS) | ap_uint<HANDLE_BITS>(way);
 }
 
-order& right_child(unsigned level, unsigned index, order queue[LEVELS][CAPACITY/2]){
+// Index entry a handle names: no tag compare, as the word carries it
+template <int L>
+order_location<L>& handle_entry(order_location<L> index[2][INDEX_SETS][INDEX_WAYS], ap_uint<HANDLE_BITS> handle) {
     #pragma HLS INLINE
-    return queue[level+1][(index*2) + 1];
+    unsigned h = handle.to_uint();
+    return index[h >> (INDEX_SET_BITS + INDEX_WAY_BITS)][(h >> INDEX_WAY_BITS) & (INDEX_SETS - 1)][h & (INDEX_WAYS - 1)];
 }
-// Manual swap function 
-void swapOrders(order &a, order &b) {
+
+// Records where an order sits in its heap, in the entry its handle names;
+// empty slots are not indexed
+template <int L>
+void index_order(order_location<L> index[2][INDEX_SETS][INDEX_WAYS], order_word w, unsigned level, unsigned idx) {
+    #pragma HLS INLINE
+    if (w != 0) {
+        order_location<L>& entry = handle_entry(index, word_handle(w));
+        entry.level = level;
+        entry.idx = idx;
+    }
+}
+
+// Frees the index entry of an order that leaves its heap
+template <int L>
+void unindex_order(order_location<L> index[2][INDEX_SETS][INDEX_WAYS], order_word w) {
+    #pragma HLS INLINE
+    handle_entry(index, word_handle(w)).orderID = 0;
+}
+
+// Looks up the heap position of a resting order by its orderID
+template <int L>
+bool find_order(const order_location<L> index[2][INDEX_SETS][INDEX_WAYS], ap_uint<32> orderID,
+                order_location<L>& location) {
+    #pragma HLS INLINE
+    unsigned table, set, way;
+    bool found = find_entry(index, orderID, table, set, way);
+    location = index[table][set][way];
+    return found;
+}
+
+// Packs the priority key of an order and the handle of its orderID and size
+// into its storage word (order_book.hpp); orderID 0 packs to the empty word
+order_word pack_order(const order& o, bool is_bid, ap_uint<SEQ_BITS> arrival, ap_uint<HANDLE_BITS> handle) {
+    #pragma HLS INLINE
+    if (o.orderID == 0) {
+        return 0;
+    }
+    ap_uint<16> price = o.price.range(15, 0);
+    ap_uint<16> price_key = is_bid ? price : ap_uint<16>(~price);
+    ap_uint<SEQ_BITS> time_key = ~arrival;
+    return (order_word(price_key) << PRICE_KEY_LSB) | (order_word(time_key) << TIME_KEY_LSB) | order_word(handle);
+}
+
+// Index entry handle of a heap word
+ap_uint<HANDLE_BITS> word_handle(order_word w) {
+    #pragma HLS INLINE
+    return w.range(TIME_KEY_LSB - 1, 0);
+}
+
+// Arrival number a heap word was packed with
+ap_uint<SEQ_BITS> word_arrival(order_word w) {
     #pragma HLS INLINE
-    // Using a template function to swap reduces redundancy and improves maintainability
-    std::swap(a.price, b.price);
-    std::swap(a.size, b.size);
-    std::swap(a.orderID, b.orderID);
-    std::swap(a.direction, b.direction);
+    ap_uint<SEQ_BITS> time_key = w.range(PRICE_KEY_LSB - 1, TIME_KEY_LSB);
+    return ~time_key;
+}
+
+// Price-time priority: a ranks before b. Only the key bits are compared; the
+// handle below them never decides, as arrival numbers are unique
+bool ranks_before(order_word a, order_word b) {
+    #pragma HLS INLINE
+    ap_uint<ORDER_WORD_BITS - TIME_KEY_LSB> key_a = a.range(ORDER_WORD_BITS - 1, TIME_KEY_LSB);
+    ap_uint<ORDER_WORD_BITS - TIME_KEY_LSB> key_b = b.range(ORDER_WORD_BITS - 1, TIME_KEY_LSB);
+    return key_a > key_b;
+}
+
+// Price and side of a storage word, with orderID and size 0: the engines
+// fill them in from where they keep them (heap_order, cell_order)
+order unpack_price(order_word w, bool is_bid) {
+    #pragma HLS INLINE
+    ap_uint<16> price_key = w.range(ORDER_WORD_BITS - 1, PRICE_KEY_LSB);
+    order o;
+    o.price.range(15, 0) = is_bid ? price_key : ap_uint<16>(~price_key);
+    o.size = 0;
+    o.orderID = 0;
+    o.direction = is_bid ? 3 : 2;
+    return o;
+}
+
+// Order of a heap word, for the top of book, executions and level store; the
+// empty word has size 0
+template <int L>
+order heap_order(heap_side<L>& side, order_word w, bool is_bid) {
+    #pragma HLS INLINE
+    order o = unpack_price(w, is_bid);
+    if (w != 0) {
+        order_location<L>& entry = handle_entry(side.index, word_handle(w));
+        o.orderID = entry.orderID;
+        o.size = entry.size;
+    }
+    return o;
+}
+
+// Best order of a side as an order, size 0 when the side is empty
+template <int L, int K>
+order best_order(lane_side<L, K>& side, bool is_bid) {
+    #pragma HLS INLINE
+    heap_side<L>& lane = side.lane[best_lane(side)];
+    return heap_order(lane, lane.heap[0][0], is_bid);
+}
+
+// A swap moves one word instead of four separate fields
+void swapOrders(order_word &a, order_word &b) {
+    #pragma HLS INLINE
+    order_word t = a;
+    a = b;
+    b = t;
+}
+
+// Sends the newest top of book once there is room for all of it downstream
+void flush_bbo(bbo_state& bbo,
+               stream<top_of_book>& tops) {
+    #pragma HLS INLINE
+    if (bbo.pending && !tops.full()) {
+        top_of_book top = { true, bbo.bid, true, bbo.ask, bbo.time, bbo.meta };
+        tops.write(top);
+        bbo.sent_bid = bbo.bid;
+        bbo.sent_ask = bbo.ask;
+        bbo.pending = false;
+    }
+}
+
+// Top of book output of one order: update_bid/update_ask tell which sides it
+// may have changed (see bbo_state)
+void publish_bbo(bbo_state& bbo,
+                 bool update_bid, order bid,
+                 bool update_ask, order ask,
+                 Time time_buffer, metadata meta_buffer,
+                 stream<top_of_book>& tops) {
+    #pragma HLS INLINE
+    bid.instrument = bbo.instrument;
+    ask.instrument = bbo.instrument;
+    if (update_bid) {
+        bbo.bid = bid;
+    }
+    if (update_ask) {
+        bbo.ask = ask;
+    }
+    if (!bbo.change_only) {
+        top_of_book top = { update_bid, bid, update_ask, ask, time_buffer, meta_buffer };
+        tops.write(top);
+        if (update_bid) {
+            bbo.sent_bid = bid;
+        }
+        if (update_ask) {
+            bbo.sent_ask = ask;
+        }
+        return;
+    }
+
+    bool changed = bbo.bid.price != bbo.sent_bid.price || bbo.bid.size != bbo.sent_bid.size ||
+                   bbo.ask.price != bbo.sent_ask.price || bbo.ask.size != bbo.sent_ask.size;
+    if (bbo.pending || !changed) {
+        bbo.suppressed++;  // the update still waiting is replaced, or there is nothing new
+    }
+    bbo.pending = changed;
+    bbo.time = time_buffer;
+    bbo.meta = meta_buffer;
+    flush_bbo(bbo, tops);
+}
+
+// Refreshes the worst tree (heap_side) after bottom slot idx changed: one
+// compare per tree level along the slot's path, unrolled, so it takes no loop
+// cycles. The siblings it reads are off the path, so all of them are read at
+// once.
+template <int L>
+void update_worst(heap_side<L>& side, unsigned idx) {
+    #pragma HLS INLINE
+    order_word worst = side.heap[L - 1][idx];
+    WORST_TREE_LOOP:
+    for (int t = L - 2; t >= 0; t--) {
+        #pragma HLS UNROLL
+        order_word other = t == L - 2 ? side.heap[L - 1][idx ^ 1] : side.worst[t + 1][idx ^ 1];
+        if (ranks_before(worst, other)) {
+            worst = other;
+        }
+        idx >>= 1;
+        side.worst[t][idx] = worst;
+    }
 }
 
 // Refactoring add_bid for clarity and potential optimization
-void add_bid(order heap[LEVELS][CAPACITY/2],
+template <int L>
+void add_bid(heap_side<L>& side,
+             ap_uint<SEQ_BITS>& arrival,
              order &new_order,
-             unsigned& heap_counter,
-             int& hole_counter,
-             int hole_idx[CAPACITY],
-             int hole_lvl[CAPACITY],
-             stream<order> &top_bid,
-             stream<order> &top_ask,
-             stream<Time> &outgoing_time,
-             stream<metadata> &outgoing_meta,
-             ap_uint<32> &top_bid_id,
-             ap_uint<32> &top_ask_id,
-             Time t, metadata m, order ask, bool w) {
-    #pragma HLS INLINE
-    heap_counter++;
-    int insert_level = hole_counter > 0 ? hole_lvl[hole_counter] : log_base_2(heap_counter);
-    int insert_path = find_path(heap_counter, hole_counter, hole_idx, insert_level);
-    unsigned idx = 1, level = 0, new_idx = 0;
+             ap_uint<HANDLE_BITS> handle,
+             stream<top_of_book> &tops,
+             bbo_state& bbo,
+             Time t, metadata m, order ask, order_word top, order best, bool w) {
+    #pragma HLS INLINE
+    side.counter++;
+    int insert_level = log_base_2(side.counter);
+    int insert_path = find_path(side, insert_level);
+    order_word new_word = pack_order(new_order, true, arrival, handle);
+    arrival++;
+    unsigned level = 0, new_idx = 0;
 
     if(w) {
-        top_ask.write(ask);
-        top_ask_id = ask.orderID;
-        outgoing_time.write(t);
-        outgoing_meta.write(m);
-        top_bid.write(new_order.price > heap[0][0].price ? new_order : heap[0][0]);
-        top_bid_id = new_order.price > heap[0][0].price ? new_order.orderID : heap[0][0].orderID;
+        publish_bbo(bbo, true, ranks_before(new_word, top) ? new_order : best, true, ask, t, m, tops);
     }
 
     BID_PUSH_LOOP:
     for(int i = insert_level; i > 0; i--) {
         #pragma HLS LOOP_FLATTEN off
         #pragma HLS PIPELINE II=1
-        order &current_order = heap[level][new_idx];
-        bool should_swap = new_order.price > current_order.price ||
-                           (new_order.price == current_order.price && new_order.orderID < current_order.orderID);
+        #pragma HLS DEPENDENCE variable=side.index inter false
+        side.steps++;
+        order_word &current_order = side.heap[level][new_idx];
+        bool should_swap = ranks_before(new_word, current_order);  // better price, then earlier arrival
         if(should_swap) {
-            swapOrders(new_order, current_order);
+            swapOrders(new_word, current_order);
+            index_order(side.index, current_order, level, new_idx);
         }
         new_idx = calculate_index(insert_path, i-1, new_idx);
         level++;
     }
-    heap[level][new_idx] = new_order;
+    side.heap[level][new_idx] = new_word;
+    index_order(side.index, new_word, level, new_idx);
+    if (level == L - 1) {
+        update_worst(side, new_idx);
+    }
 }
 
-void remove_bid(order heap[LEVELS][CAPACITY/2],
+// Moves (level, idx) towards the root while word ranks before the parent,
+// pulling every parent it passes one level down. The caller stores word at
+// the position it ends at.
+template <int L>
+void sift_up(heap_side<L>& side, order_word word, unsigned& level, unsigned& idx) {
+    #pragma HLS INLINE
+    SIFT_UP_LOOP:
+    while (level > 0) {
+        #pragma HLS DEPENDENCE variable=side.index inter false
+        #pragma HLS LOOP_TRIPCOUNT max=11
+        #pragma HLS PIPELINE II=1
+        side.steps++;
+        order_word parent = side.heap[level - 1][idx >> 1];
+        if (!ranks_before(word, parent)) {
+            break;
+        }
+        side.heap[level][idx] = parent;
+        index_order(side.index, parent, level, idx);
+        level--;
+        idx >>= 1;
+    }
+}
+
+// Takes req_size off the order at (start_level, start_idx). An order that is
+// used up is removed and the last order of the heap takes its slot, so the
+// heap stays compact: it is sifted up when it ranks before the new parent and
+// down otherwise. The sift down stops at the deepest level in use, so a pop
+// takes at most log2 of the lane's occupancy steps, not L - 1.
+template <int L>
+void remove_bid(heap_side<L>& side,
                 ap_uint<8>& req_size,
-                unsigned& heap_counter,
-                int& hole_counter,
-                int hole_idx[CAPACITY],
-                int hole_lvl[CAPACITY],
-                order dummy_order) {
-    #pragma HLS INLINE
-    if(req_size < heap[0][0].size) {
-        heap[0][0].size -= req_size;
+                unsigned start_level,
+                unsigned start_idx) {
+    #pragma HLS INLINE
+    order_word &target = side.heap[start_level][start_idx];
+    order_location<L>& entry = handle_entry(side.index, word_handle(target));
+    ap_uint<8> size = entry.size;
+    if(req_size < size) {
+        entry.size = size - req_size;  // the word keeps its place
         req_size = 0;
     } else {
-        req_size -= heap[0][0].size;
-        heap_counter--;
-        hole_counter++;
-        unsigned level = 0, new_idx = 0, offset = 0;
-        order left = left_child(level, new_idx, heap);
-        order right = right_child(level, new_idx, heap);
-
-        BID_POP_LOOP:
-        while(level < LEVELS - 1) {
-            #pragma HLS DEPENDENCE variable=heap inter false
-            #pragma HLS LOOP_TRIPCOUNT max=11
-            #pragma HLS PIPELINE II=1
-            if((left.price > right.price) || (left.price == right.price && left.orderID < right.orderID)) {
-                offset = 0;
-                heap[level][new_idx] = left;
-            } else {
-                offset = 1;
-                heap[level][new_idx] = right;
+        req_size -= size;
+        unindex_order(side.index, target);
+        unsigned last_level = log_base_2(side.counter);
+        unsigned last_idx = side.counter - (1 << last_level);
+        order_word last = side.heap[last_level][last_idx];
+        side.heap[last_level][last_idx] = 0;
+        side.counter--;
+        if (last_level == L - 1) {
+            update_worst(side, last_idx);
+        }
+        if(last_level == start_level && last_idx == start_idx) {
+            return;
+        }
+        unsigned bottom = log_base_2(side.counter);
+        unsigned level = start_level, new_idx = start_idx;
+
+        if(level > 0 && ranks_before(last, side.heap[level - 1][new_idx >> 1])) {
+            sift_up(side, last, level, new_idx);
+        } else {
+            BID_POP_LOOP:
+            while(level < bottom) {
+                #pragma HLS DEPENDENCE variable=side.heap inter false
+                #pragma HLS DEPENDENCE variable=side.index inter false
+                #pragma HLS LOOP_TRIPCOUNT max=11
+                #pragma HLS PIPELINE II=1
+                side.steps++;
+                order_word left = left_child(level, new_idx, side);
+                order_word right = right_child(level, new_idx, side);
+                unsigned offset = ranks_before(left, right) ? 0 : 1;  // an empty child is the zero word
+                order_word child = offset == 0 ? left : right;
+                if(!ranks_before(child, last)) {
+                    break;
+                }
+                side.heap[level][new_idx] = child;
+                index_order(side.index, child, level, new_idx);
+                level++;
+                new_idx = (new_idx * 2) + offset;
             }
-            left = left_child(level + 1, (new_idx * 2) + offset, heap);
-            right = right_child(level + 1, (new_idx * 2) + offset, heap);
-            level++;
-            new_idx = (new_idx * 2) + offset;
         }
-        hole_lvl[hole_counter] = level;
-        hole_idx[hole_counter] = new_idx;
-        heap[level][new_idx] = dummy_order;
+        side.heap[level][new_idx] = last;
+        index_order(side.index, last, level, new_idx);
+        // The bottom slots that changed: the hole, where a sift up moved a
+        // parent down, and where last came to rest
+        if (start_level == L - 1) {
+            update_worst(side, start_idx);
+        }
+        if (level == L - 1) {
+            update_worst(side, new_idx);
+        }
     }
 }
 
-void add_ask(order heap[LEVELS][CAPACITY/2],
+template <int L>
+void add_ask(heap_side<L>& side,
+             ap_uint<SEQ_BITS>& arrival,
              order &new_order,
-             unsigned& heap_counter,
-             int& hole_counter,
-             int hole_idx[CAPACITY],
-             int hole_lvl[CAPACITY],
-             stream<order> &top_bid,
-             stream<order> &top_ask,
-             stream<Time> &outgoing_time,
-             stream<metadata> &outgoing_meta,
-             ap_uint<32> &top_bid_id,
-             ap_uint<32> &top_ask_id,
-             Time t, metadata m, order bid, bool w) {
-    #pragma HLS INLINE
-    heap_counter++;
-    int insert_level = hole_counter > 0 ? hole_lvl[hole_counter] : log_base_2(heap_counter);
-    int insert_path = find_path(heap_counter, hole_counter, hole_idx, insert_level);
+             ap_uint<HANDLE_BITS> handle,
+             stream<top_of_book> &tops,
+             bbo_state& bbo,
+             Time t, metadata m, order bid, order_word top, order best, bool w) {
+    #pragma HLS INLINE
+    side.counter++;
+    int insert_level = log_base_2(side.counter);
+    int insert_path = find_path(side, insert_level);
+    order_word new_word = pack_order(new_order, false, arrival, handle);
+    arrival++;
 
     if (w) {
-        top_bid.write(bid);
-        top_bid_id = bid.orderID;
-        outgoing_time.write(t);
-        outgoing_meta.write(m);
-
-        if (new_order.price < heap[0][0].price || heap[0][0].orderID == 0) {
-            top_ask.write(new_order);
-            top_ask_id = new_order.orderID;
-        } else {
-            top_ask.write(heap[0][0]);
-            top_ask_id = heap[0][0].orderID;
-        }
+        bool new_top = ranks_before(new_word, top);
+        publish_bbo(bbo, true, bid, true, new_top ? new_order : best, t, m, tops);
     }
 
-    unsigned idx = 1, level = 0, new_idx = 0;
+    unsigned level = 0, new_idx = 0;
     ASK_PUSH_LOOP:
     for (int i = insert_level; i > 0; i--) {
         #pragma HLS LOOP_FLATTEN off
         #pragma HLS PIPELINE II=1
-        order &current_order = heap[level][new_idx];
-        bool should_swap = new_order.price < current_order.price ||
-                           current_order.orderID == 0 ||
-                           (new_order.price == current_order.price && new_order.orderID < current_order.orderID);
+        #pragma HLS DEPENDENCE variable=side.index inter false
+        side.steps++;
+        order_word &current_order = side.heap[level][new_idx];
+        bool should_swap = ranks_before(new_word, current_order);  // better price, then earlier arrival
         if (should_swap) {
-            swapOrders(new_order, current_order);
+            swapOrders(new_word, current_order);
+            index_order(side.index, current_order, level, new_idx);
         }
         new_idx = calculate_index(insert_path, i - 1, new_idx);
         level++;
     }
-    heap[level][new_idx] = new_order;
+    side.heap[level][new_idx] = new_word;
+    index_order(side.index, new_word, level, new_idx);
+    if (level == L - 1) {
+        update_worst(side, new_idx);
+    }
 }
 
-void remove_ask(order heap[LEVELS][CAPACITY/2],
+// Same as remove_bid for the ask heap
+template <int L>
+void remove_ask(heap_side<L>& side,
                 ap_uint<8>& req_size,
-                unsigned& heap_counter,
-                int& hole_counter,
-                int hole_idx[CAPACITY],
-                int hole_lvl[CAPACITY],
-                order dummy_order) {
-    #pragma HLS INLINE
-    if (req_size < heap[0][0].size) {
-        heap[0][0].size -= req_size;
+                unsigned start_level,
+                unsigned start_idx) {
+    #pragma HLS INLINE
+    order_word &target = side.heap[start_level][start_idx];
+    order_location<L>& entry = handle_entry(side.index, word_handle(target));
+    ap_uint<8> size = entry.size;
+    if (req_size < size) {
+        entry.size = size - req_size;  // the word keeps its place
         req_size = 0;
     } else {
-        req_size -= heap[0][0].size;
-        heap_counter--;
-        hole_counter++;
+        req_size -= size;
+        unindex_order(side.index, target);
+        unsigned last_level = log_base_2(side.counter);
+        unsigned last_idx = side.counter - (1 << last_level);
+        order_word last = side.heap[last_level][last_idx];
+        side.heap[last_level][last_idx] = 0;
+        side.counter--;
+        if (last_level == L - 1) {
+            update_worst(side, last_idx);
+        }
+        if (last_level == start_level && last_idx == start_idx) {
+            return;
+        }
+        unsigned bottom = log_base_2(side.counter);
+        unsigned level = start_level, new_idx = start_idx;
 
-        unsigned level = 0, new_idx = 0, offset = 0;
-        ASK_POP_LOOP:
-        while (level < LEVELS - 1) {
-            #pragma HLS PIPELINE II=1
-            order &left = left_child(level, new_idx, heap);
-            order &right = right_child(level, new_idx, heap);
+        if (level > 0 && ranks_before(last, side.heap[level - 1][new_idx >> 1])) {
+            sift_up(side, last, level, new_idx);
+        } else {
+            ASK_POP_LOOP:
+            while (level < bottom) {
+                #pragma HLS DEPENDENCE variable=side.index inter false
+                #pragma HLS LOOP_TRIPCOUNT max=11
+                #pragma HLS PIPELINE II=1
+                side.steps++;
+                order_word &left = left_child(level, new_idx, side);
+                order_word &right = right_child(level, new_idx, side);
+                bool is_left_preferred = ranks_before(left, right);  // an empty child is the zero word
+                order_word child = is_left_preferred ? left : right;
+                if (!ranks_before(child, last)) {
+                    break;
+                }
+                side.heap[level][new_idx] = child;
+                index_order(side.index, child, level, new_idx);
+
+                level++;
+                new_idx = (new_idx << 1) + (is_left_preferred ? 0 : 1);
+            }
+        }
+        side.heap[level][new_idx] = last;
+        index_order(side.index, last, level, new_idx);
+        // The bottom slots that changed: the hole, where a sift up moved a
+        // parent down, and where last came to rest
+        if (start_level == L - 1) {
+            update_worst(side, start_idx);
+        }
+        if (level == L - 1) {
+            update_worst(side, new_idx);
+        }
+    }
+}
 
-            bool is_left_preferred = left.price < right.price ||
-                                     right.orderID == 0 ||
-                                     (left.price == right.price && left.orderID < right.orderID);
-            offset = is_left_preferred ? 0 : 1;
-            heap[level][new_idx] = is_left_preferred ? left : right;
+// Amends the price and size of the order at location. A smaller size at the
+// same price only changes its index entry. Otherwise the order goes to the
+// back of the queue at its price, and the heap order is restored with one
+// sift: towards the root when the amended order ranks higher than before,
+// towards the leaves otherwise. Either way the order only moves along one
+// path, so it takes at most log2 of the lane's occupancy steps.
+template <int L>
+void modify_order(heap_side<L>& side,
+                  ap_uint<SEQ_BITS>& arrival,
+                  order_location<L> location,
+                  order& input,
+                  bool is_bid) {
+    #pragma HLS INLINE
+    order_word original = side.heap[location.level][location.idx];
+    order resting = heap_order(side, original, is_bid);
+    bool requeue = input.price != resting.price || input.size > resting.size;
+    handle_entry(side.index, word_handle(original)).size = input.size;
+    if (!requeue) {
+        return;
+    }
+    resting.price = input.price;
+    order_word amended = pack_order(resting, is_bid, arrival, word_handle(original));
+    arrival++;
+    bool move_up = ranks_before(amended, original);
+    unsigned level = location.level, idx = location.idx;
+    unsigned bottom = log_base_2(side.counter);
 
+    if (move_up) {
+        sift_up(side, amended, level, idx);
+    } else {
+        MODIFY_SIFT_DOWN:
+        while (level < bottom) {
+            #pragma HLS DEPENDENCE variable=side.index inter false
+            #pragma HLS LOOP_TRIPCOUNT max=11
+            #pragma HLS PIPELINE II=1
+            side.steps++;
+            order_word left = left_child(level, idx, side);
+            order_word right = right_child(level, idx, side);
+            bool take_left = !ranks_before(right, left);
+            order_word child = take_left ? left : right;
+            if (!ranks_before(child, amended)) {
+                break;
+            }
+            side.heap[level][idx] = child;
+            index_order(side.index, child, level, idx);
             level++;
-            new_idx = (new_idx << 1) + offset;
-        }
-        heap[level][new_idx] = dummy_order;
-        hole_lvl[hole_counter] = level;
-        hole_idx[hole_counter] = new_idx;
-    }
-}
-
-void process_incoming_bid(order& input, order bid[][CAPACITY / 2], unsigned& counter_bid, 
-                          int& hole_counter_bid, int hole_idx_bid[CAPACITY], 
-                          int hole_lvl_bid[CAPACITY], order ask[][CAPACITY / 2], 
-                          stream<order>& top_bid, stream<order>& top_ask, 
-                          stream<Time>& outgoing_time, stream<metadata>& outgoing_meta, 
-                          ap_uint<32>& top_bid_id, ap_uint<32>& top_ask_id, 
-                          Time& time_buffer, metadata& meta_buffer) {
-    // Add the incoming input to the bid order book
-    add_bid(bid, input, counter_bid, hole_counter_bid, hole_idx_bid, hole_lvl_bid, top_bid,
-            top_ask, outgoing_time, outgoing_meta, top_bid_id, top_ask_id,
-            time_buffer, meta_buffer, ask[0][0], true);
-    // If the book becomes full, discard the last entry
-    if (counter_bid == CAPACITY - 1) {
-        counter_bid--;
-    }
-}
-
-void process_incoming_ask(order& input, order ask[][CAPACITY / 2], unsigned& counter_ask, 
-                          int& hole_counter_ask, int hole_idx_ask[CAPACITY], 
-                          int hole_lvl_ask[CAPACITY], order bid[][CAPACITY / 2], 
-                          stream<order>& top_bid, stream<order>& top_ask, 
-                          stream<Time>& outgoing_time, stream<metadata>& outgoing_meta, 
-                          ap_uint<32>& top_bid_id, ap_uint<32>& top_ask_id, 
-                          Time& time_buffer, metadata& meta_buffer) {
-    // Add the incoming input to the ask order book
-    add_ask(ask, input, counter_ask, hole_counter_ask, hole_idx_ask, hole_lvl_ask, top_bid,
-            top_ask, outgoing_time, outgoing_meta, top_bid_id, top_ask_id,
-            time_buffer, meta_buffer, bid[0][0], true);
-    // If the book becomes full, discard the last entry
-    if (counter_ask == CAPACITY - 1) {
-        counter_ask--;
-    }
-}
-
-void process_remove_bid(order& input, order bid[][CAPACITY / 2], unsigned& counter_bid, 
-                        int& hole_counter_bid, int hole_idx_bid[CAPACITY], 
-                        int hole_lvl_bid[CAPACITY], stream<order>& top_bid, 
-                        stream<Time>& outgoing_time, stream<metadata>& outgoing_meta, 
-                        ap_uint<32>& top_bid_id, Time& time_buffer, metadata& meta_buffer, 
-                        order dummy_bid) {
+            idx = (idx * 2) + (take_left ? 0 : 1);
+        }
+    }
+    side.heap[level][idx] = amended;
+    index_order(side.index, amended, level, idx);
+    // The bottom slots that changed: where the order was, and where it rests
+    if (location.level == L - 1) {
+        update_worst(side, location.idx);
+    }
+    if (level == L - 1) {
+        update_worst(side, idx);
+    }
+}
+
+// One top of book update after a sweep that leaves nothing to rest, or for
+// an order that does not rest. An emptied side goes out as an empty order
+template <int L, int K>
+void publish_top(lane_side<L, K>& bids, lane_side<L, K>& asks,
+                 stream<top_of_book>& tops, bbo_state& bbo,
+                 Time& time_buffer, metadata& meta_buffer) {
+    order best_bid = best_order(bids, true);
+    order best_ask = best_order(asks, false);
+    // A side goes out when it holds an order or has just been emptied
+    publish_bbo(bbo, best_bid.size != 0 || bbo.bid.size != 0, best_bid,
+                best_ask.size != 0 || bbo.ask.size != 0, best_ask,
+                time_buffer, meta_buffer, tops);
+}
+
+// Adds the incoming input to the bid heap of its lane. A full lane first
+// evicts its worst order: the worst resting bid, whose slot the input takes,
+// or the input itself when it ranks below every resting bid. An input whose
+// orderID already rests in the lane, or finds no free index entry, is refused
+// (collided) and does not rest. evicted is the evicted or refused order, size 0 when there is
+// none; returns whether the lane was full.
+template <int L, int K>
+bool process_incoming_bid(order& input, lane_side<L, K>& bids, lane_side<L, K>& asks, 
+                          stream<top_of_book>& tops, bbo_state& bbo,
+                          Time& time_buffer, metadata& meta_buffer, order& evicted, bool& collided) {
+    heap_side<L>& lane = bids.lane[lane_of(input.orderID)];
+    bool full = lane.counter == (1 << L) - 1;
+    evicted = input;
+    evicted.size = 0;
+    // The input's orderID already rests, or its index buckets are full: the
+    // input is refused. Otherwise it claims its entry once any eviction is done.
+    unsigned table, set, way;
+    collided = find_entry(lane.index, input.orderID, table, set, way) ||
+               !free_entry(lane.index, input.orderID, table, set, way);
+    bool rests = !collided;
+    if (collided) {
+        evicted = input;
+        full = false;
+    } else if (full) {
+        // The worst order is the root of the worst tree; the index entry its
+        // handle names gives its slot and current size
+        order_word worst = lane.worst[0][0];
+        order_location<L> spot = handle_entry(lane.index, word_handle(worst));
+        rests = ranks_before(pack_order(input, true, bids.arrival, 0), worst);
+        if (rests) {
+            evicted = heap_order(lane, worst, true);
+            ap_uint<8> req_size = evicted.size;
+            remove_bid(lane, req_size, spot.level, spot.idx);
+        } else {
+            evicted = input;
+        }
+    }
+    if (rests) {
+        lane.index[table][set][way].orderID = input.orderID;
+        lane.index[table][set][way].size = input.size;
+        add_bid(lane, bids.arrival, input, entry_handle(table, set, way), tops, bbo,
+                time_buffer, meta_buffer, best_order(asks, false), best_word(bids), best_order(bids, true), true);
+    } else {
+        publish_top(bids, asks, tops, bbo, time_buffer, meta_buffer);
+    }
+    return full;
+}
+
+// Same as process_incoming_bid for the ask heap of the input's lane
+template <int L, int K>
+bool process_incoming_ask(order& input, lane_side<L, K>& asks, lane_side<L, K>& bids, 
+                          stream<top_of_book>& tops, bbo_state& bbo,
+                          Time& time_buffer, metadata& meta_buffer, order& evicted, bool& collided) {
+    heap_side<L>& lane = asks.lane[lane_of(input.orderID)];
+    bool full = lane.counter == (1 << L) - 1;
+    evicted = input;
+    evicted.size = 0;
+    // The input's orderID already rests, or its index buckets are full: the
+    // input is refused. Otherwise it claims its entry once any eviction is done.
+    unsigned table, set, way;
+    collided = find_entry(lane.index, input.orderID, table, set, way) ||
+               !free_entry(lane.index, input.orderID, table, set, way);
+    bool rests = !collided;
+    if (collided) {
+        evicted = input;
+        full = false;
+    } else if (full) {
+        // The worst order is the root of the worst tree; the index entry its
+        // handle names gives its slot and current size
+        order_word worst = lane.worst[0][0];
+        order_location<L> spot = handle_entry(lane.index, word_handle(worst));
+        rests = ranks_before(pack_order(input, false, asks.arrival, 0), worst);
+        if (rests) {
+            evicted = heap_order(lane, worst, false);
+            ap_uint<8> req_size = evicted.size;
+            remove_ask(lane, req_size, spot.level, spot.idx);
+        } else {
+            evicted = input;
+        }
+    }
+    if (rests) {
+        lane.index[table][set][way].orderID = input.orderID;
+        lane.index[table][set][way].size = input.size;
+        add_ask(lane, asks.arrival, input, entry_handle(table, set, way), tops, bbo,
+                time_buffer, meta_buffer, best_order(bids, true), best_word(asks), best_order(asks, false), true);
+    } else {
+        publish_top(bids, asks, tops, bbo, time_buffer, meta_buffer);
+    }
+    return full;
+}
+
+template <int L, int K>
+void process_remove_bid(order& input, lane_side<L, K>& bids, stream<top_of_book>& tops, bbo_state& bbo,
+                        Time& time_buffer, metadata& meta_buffer, 
+                        order dummy_bid, order& removed) {
+    // Cancel or reduce the resting order with the input's orderID, wherever it is in its lane.
+    // removed is that order with the size taken off it, size 0 when there is none
+    heap_side<L>& lane = bids.lane[lane_of(input.orderID)];
     ap_uint<8> req_size = input.size;
-    remove_bid(bid, req_size, counter_bid, hole_counter_bid, hole_idx_bid, hole_lvl_bid, dummy_bid);
+    order_location<L> location;
+    removed = dummy_bid;
+    if (find_order(lane.index, input.orderID, location)) {
+        removed = heap_order(lane, lane.heap[location.level][location.idx], true);
+        removed.size = req_size < removed.size ? req_size : removed.size;
+        remove_bid(lane, req_size, location.level, location.idx);
+    }
 
     // Update top bid and metadata if necessary
-    if (counter_bid > 0) {
-        top_bid.write(bid[0][0]);
-        top_bid_id = bid[0][0].orderID;
-    }
-    outgoing_time.write(time_buffer);
-    outgoing_meta.write(meta_buffer);
+    order top = best_order(bids, true);
+    publish_bbo(bbo, top.size != 0 || bbo.bid.size != 0, top, false, bbo.ask,
+                time_buffer, meta_buffer, tops);
 }
 
-void process_remove_ask(order& input, order ask[][CAPACITY / 2], unsigned& counter_ask, 
-                        int& hole_counter_ask, int hole_idx_ask[CAPACITY], 
-                        int hole_lvl_ask[CAPACITY], stream<order>& top_ask, 
-                        stream<Time>& outgoing_time, stream<metadata>& outgoing_meta, 
-                        ap_uint<32>& top_ask_id, Time& time_buffer, metadata& meta_buffer, 
-                        order dummy_ask) {
+template <int L, int K>
+void process_remove_ask(order& input, lane_side<L, K>& asks, stream<top_of_book>& tops, bbo_state& bbo,
+                        Time& time_buffer, metadata& meta_buffer, 
+                        order dummy_ask, order& removed) {
+    // Cancel or reduce the resting order with the input's orderID, wherever it is in its lane.
+    // removed is that order with the size taken off it, size 0 when there is none
+    heap_side<L>& lane = asks.lane[lane_of(input.orderID)];
     ap_uint<8> req_size = input.size;
-    remove_ask(ask, req_size, counter_ask, hole_counter_ask, hole_idx_ask, hole_lvl_ask, dummy_ask);
+    order_location<L> location;
+    removed = dummy_ask;
+    if (find_order(lane.index, input.orderID, location)) {
+        removed = heap_order(lane, lane.heap[location.level][location.idx], false);
+        removed.size = req_size < removed.size ? req_size : removed.size;
+        remove_ask(lane, req_size, location.level, location.idx);
+    }
 
     // Update top ask and metadata if necessary
-    if (counter_ask > 0) {
-        top_ask.write(ask[0][0]);
-        top_ask_id = ask[0][0].orderID;
+    order top = best_order(asks, false);
+    publish_bbo(bbo, false, bbo.bid, top.size != 0 || bbo.ask.size != 0, top,
+                time_buffer, meta_buffer, tops);
+}
+template <int L, int K>
+void process_modify_bid(order& input, lane_side<L, K>& bids, stream<top_of_book>& tops, bbo_state& bbo,
+                        Time& time_buffer, metadata& meta_buffer, 
+                        order dummy_bid, order& replaced) {
+    // Amend the resting order in place; a new size of 0 cancels it.
+    // replaced is the order as it rested before, size 0 when there is none
+    heap_side<L>& lane = bids.lane[lane_of(input.orderID)];
+    order_location<L> location;
+    replaced = dummy_bid;
+    if (find_order(lane.index, input.orderID, location)) {
+        replaced = heap_order(lane, lane.heap[location.level][location.idx], true);
+        if (input.size == 0) {
+            ap_uint<8> req_size = replaced.size;
+            remove_bid(lane, req_size, location.level, location.idx);
+        } else {
+            modify_order(lane, bids.arrival, location, input, true);
+        }
     }
-    outgoing_time.write(time_buffer);
-    outgoing_meta.write(meta_buffer);
+
+    // One top of book update for the amend
+    order top = best_order(bids, true);
+    publish_bbo(bbo, top.size != 0 || bbo.bid.size != 0, top, false, bbo.ask,
+                time_buffer, meta_buffer, tops);
 }
 
+template <int L, int K>
+void process_modify_ask(order& input, lane_side<L, K>& asks, stream<top_of_book>& tops, bbo_state& bbo,
+                        Time& time_buffer, metadata& meta_buffer, 
+                        order dummy_ask, order& replaced) {
+    // Amend the resting order in place; a new size of 0 cancels it.
+    // replaced is the order as it rested before, size 0 when there is none
+    heap_side<L>& lane = asks.lane[lane_of(input.orderID)];
+    order_location<L> location;
+    replaced = dummy_ask;
+    if (find_order(lane.index, input.orderID, location)) {
+        replaced = heap_order(lane, lane.heap[location.level][location.idx], false);
+        if (input.size == 0) {
+            ap_uint<8> req_size = replaced.size;
+            remove_ask(lane, req_size, location.level, location.idx);
+        } else {
+            modify_order(lane, asks.arrival, location, input, false);
+        }
+    }
 
+    // One top of book update for the amend
+    order top = best_order(asks, false);
+    publish_bbo(bbo, false, bbo.bid, top.size != 0 || bbo.ask.size != 0, top,
+                time_buffer, meta_buffer, tops);
+}
+
+// Takes the whole order with the input's orderID out of a side without a top
+// of book update: a crossing amend cancels its order this way and goes on as
+// a limit order, which sends the one update. taken is the order as it rested,
+// size 0 when there is none.
+template <int L, int K>
+void take_order(order& input, lane_side<L, K>& side, bool is_bid, order& taken) {
+    #pragma HLS INLINE
+    heap_side<L>& lane = side.lane[lane_of(input.orderID)];
+    order_location<L> location;
+    taken.size = 0;
+    if (find_order(lane.index, input.orderID, location)) {
+        taken = heap_order(lane, lane.heap[location.level][location.idx], is_bid);
+        ap_uint<8> req_size = taken.size;
+        if (is_bid) {
+            remove_bid(lane, req_size, location.level, location.idx);
+        } else {
+            remove_ask(lane, req_size, location.level, location.idx);
+        }
+    }
+}
+
+// Resting orders, fullest lane and heap loop iterations of a side
+template <int L, int K>
+void side_stats(lane_side<L, K>& side, ap_uint<32>& orders,
+                ap_uint<32>& fullest, ap_uint<32>& steps) {
+    #pragma HLS INLINE
+    orders = 0;
+    fullest = 0;
+    steps = 0;
+    STATS_LOOP:
+    for (int k = 0; k < K; k++) {
+        #pragma HLS UNROLL
+        orders += side.lane[k].counter;
+        if (side.lane[k].counter > fullest) {
+            fullest = side.lane[k].counter;
+        }
+        steps += side.lane[k].steps;
+    }
+}
+
+// Matches an incoming sell against the bids, best bid first: the root of the
+// lane best_lane picks. Every fill takes min(remaining, resting size) off the
+// top bid and is reported on executions; the sweep goes on while the incoming
+// order has size left and the top bid is within its limit (a market order has
+// none). Each fill removes the top bid unless it is the last, partial one, so
+// the sweep ends after at most input.size fills.
+template <int L, int K>
+void sweep_bids(order& input, bool limited, lane_side<L, K>& bids,
+                price_level bid_levels[TICKS], ap_uint<WORD_BITS> bid_leaf[LEAF_WORDS],
+                ap_uint<WORD_BITS> bid_summary[SUMMARY_WORDS], ap_uint<SUMMARY_WORDS>& bid_root,
+                ap_uint<PRICE_BITS> base, stream<execution>& executions) {
+    SWEEP_BIDS_LOOP:
+    while (input.size > 0 && best_word(bids) != 0) {
+        #pragma HLS LOOP_TRIPCOUNT max=255
+        heap_side<L>& lane = bids.lane[best_lane(bids)];
+        order resting = heap_order(lane, lane.heap[0][0], true);
+        if (limited && !(resting.price >= input.price)) {
+            break;
+        }
+        ap_uint<8> fill = input.size < resting.size ? input.size : resting.size;
+        execution report;
+        report.orderID = resting.orderID;
+        report.price = resting.price;
+        report.size = fill;
+        report.instrument = input.instrument;
+        executions.write(report);
+        input.size -= fill;
+        resting.size = fill;
+        level_cancel(bid_levels, bid_leaf, bid_summary, bid_root, level_tick(resting.price, base), resting);
+        remove_bid(lane, fill, 0, 0);
+    }
+}
+
+// Same as sweep_bids for an incoming buy against the asks
+template <int L, int K>
+void sweep_asks(order& input, bool limited, lane_side<L, K>& asks,
+                price_level ask_levels[TICKS], ap_uint<WORD_BITS> ask_leaf[LEAF_WORDS],
+                ap_uint<WORD_BITS> ask_summary[SUMMARY_WORDS], ap_uint<SUMMARY_WORDS>& ask_root,
+                ap_uint<PRICE_BITS> base, stream<execution>& executions) {
+    SWEEP_ASKS_LOOP:
+    while (input.size > 0 && best_word(asks) != 0) {
+        #pragma HLS LOOP_TRIPCOUNT max=255
+        heap_side<L>& lane = asks.lane[best_lane(asks)];
+        order resting = heap_order(lane, lane.heap[0][0], false);
+        if (limited && !(resting.price <= input.price)) {
+            break;
+        }
+        ap_uint<8> fill = input.size < resting.size ? input.size : resting.size;
+        execution report;
+        report.orderID = resting.orderID;
+        report.price = resting.price;
+        report.size = fill;
+        report.instrument = input.instrument;
+        executions.write(report);
+        input.size -= fill;
+        resting.size = fill;
+        level_cancel(ask_levels, ask_leaf, ask_summary, ask_root, level_tick(resting.price, base), resting);
+        remove_ask(lane, fill, 0, 0);
+    }
+}
+
+// Sends the orders, with their timestamps and metadata, to the banks of their
+// instruments: up to BOOK_BANKS orders a call, so several banks get one in the
+// same call. An order whose bank has no room waits in pending, and the orders
+// behind it with it, so every instrument keeps its order. Orders for an
+// instrument past NUM_INSTRUMENTS are dropped.
+void route_orders(stream<order>& order_stream, stream<Time>& incoming_time, stream<metadata>& incoming_meta,
+                  stream<order> bank_orders[BOOK_BANKS], stream<Time> bank_time[BOOK_BANKS],
+                  stream<metadata> bank_meta[BOOK_BANKS]) {
+    static order pending;
+    static Time pending_time;
+    static metadata pending_meta;
+    static bool held = false;
+    ROUTE_LOOP:
+    for (int n = 0; n < BOOK_BANKS; n++) {
+        if (!held) {
+            if (order_stream.empty() || incoming_time.empty() || incoming_meta.empty()) {
+                break;
+            }
+            pending = order_stream.read();
+            pending_time = incoming_time.read();
+            pending_meta = incoming_meta.read();
+            held = true;
+        }
+        if (pending.instrument >= NUM_INSTRUMENTS) {
+            held = false;
+        }
+        DISPATCH_LOOP:
+        for (int b = 0; b < BOOK_BANKS; b++) {
+            #pragma HLS UNROLL
+            if (held && pending.instrument % BOOK_BANKS == unsigned(b) &&
+                !bank_orders[b].full() && !bank_time[b].full() && !bank_meta[b].full()) {
+                bank_orders[b].write(pending);
+                bank_time[b].write(pending_time);
+                bank_meta[b].write(pending_meta);
+                held = false;
+            }
+        }
+        if (held) {
+            break;
+        }
+    }
+}
+
+// Writes a held top of book once all four top of book streams have room, so
+// they stay aligned per order; true when it went out
+bool send_top(top_of_book& top, stream<order>& top_bid, stream<order>& top_ask,
+              stream<Time>& outgoing_time, stream<metadata>& outgoing_meta,
+              ap_uint<32>& top_bid_id, ap_uint<32>& top_ask_id) {
+    #pragma HLS INLINE
+    if (top_bid.full() || top_ask.full() || outgoing_time.full() || outgoing_meta.full()) {
+        return false;
+    }
+    if (top.has_bid) {
+        top_bid.write(top.bid);
+        top_bid_id = top.bid.orderID;
+    }
+    if (top.has_ask) {
+        top_ask.write(top.ask);
+        top_ask_id = top.ask.orderID;
+    }
+    outgoing_time.write(top.time);
+    outgoing_meta.write(top.meta);
+    return true;
+}
+
+// Forwards the outputs of the banks to the kernel's streams, one bank after
+// the other: the outputs of an instrument keep their order and carry its tag.
+// No write blocks: each output only takes from a bank while it has room, so a
+// backpressured output holds up only that output of the banks. Tops are always
+// read: each bank has one held top of book, which goes out whole (its sides
+// with its timestamp and metadata, so the four top of book streams stay
+// aligned) and is conflated with the bank's next one while it cannot. The
+// executions, depth and evictions wait in their bank streams instead, as they
+// cannot be dropped. top_bid_id/top_ask_id follow the last top of book
+// forwarded, and suppressed_updates adds up the banks' counts and the
+// conflated tops. The banks' counters are added up (high-water marks take the
+// highest) and copied to counters on a rising edge of snapshot only.
+void merge_banks(stream<top_of_book> bank_tops[BOOK_BANKS],
+                 stream<execution> bank_executions[BOOK_BANKS], stream<book_depth> bank_depth[BOOK_BANKS],
+                 stream<order> bank_evictions[BOOK_BANKS], stream<book_counters> bank_counters[BOOK_BANKS],
+                 stream<order>& top_bid, stream<order>& top_ask,
+                 stream<Time>& outgoing_time, stream<metadata>& outgoing_meta,
+                 ap_uint<32>& top_bid_id, ap_uint<32>& top_ask_id,
+                 stream<execution>& executions, stream<book_depth>& depth, stream<order>& evictions,
+                 ap_uint<32>& suppressed_updates, ap_uint<1> snapshot, book_counters& counters) {
+    static book_counters bank_live[BOOK_BANKS];
+    static top_of_book held[BOOK_BANKS];
+    static bool holding[BOOK_BANKS];
+    static ap_uint<32> conflated = 0;
+    static ap_uint<1> last_snapshot = 0;
+    book_counters total = {};
+    MERGE_LOOP:
+    for (int b = 0; b < BOOK_BANKS; b++) {
+        TOP_LOOP:
+        while (!bank_tops[b].empty()) {
+            if (holding[b] && send_top(held[b], top_bid, top_ask, outgoing_time, outgoing_meta,
+                                       top_bid_id, top_ask_id)) {
+                holding[b] = false;
+            }
+            top_of_book top = bank_tops[b].read();
+            if (holding[b]) {
+                // Conflate: the newer sides replace the held ones
+                if (top.has_bid) {
+                    held[b].has_bid = true;
+                    held[b].bid = top.bid;
+                }
+                if (top.has_ask) {
+                    held[b].has_ask = true;
+                    held[b].ask = top.ask;
+                }
+                held[b].time = top.time;
+                held[b].meta = top.meta;
+                conflated++;
+            } else {
+                held[b] = top;
+                holding[b] = true;
+            }
+        }
+        if (holding[b] && send_top(held[b], top_bid, top_ask, outgoing_time, outgoing_meta,
+                                   top_bid_id, top_ask_id)) {
+            holding[b] = false;
+        }
+        EXECUTION_LOOP:
+        while (!bank_executions[b].empty() && !executions.full()) {
+            #pragma HLS LOOP_TRIPCOUNT max=255
+            executions.write(bank_executions[b].read());
+        }
+        DEPTH_LOOP:
+        while (!bank_depth[b].empty() && !depth.full()) {
+            depth.write(bank_depth[b].read());
+        }
+        EVICTION_LOOP:
+        while (!bank_evictions[b].empty() && !evictions.full()) {
+            evictions.write(bank_evictions[b].read());
+        }
+        if (!bank_counters[b].empty()) {
+            bank_live[b] = bank_counters[b].read();
+        }
+        total.bid_orders += bank_live[b].bid_orders;
+        total.ask_orders += bank_live[b].ask_orders;
+        if (bank_live[b].bid_high_water > total.bid_high_water) {
+            total.bid_high_water = bank_live[b].bid_high_water;
+        }
+        if (bank_live[b].ask_high_water > total.ask_high_water) {
+            total.ask_high_water = bank_live[b].ask_high_water;
+        }
+        total.overflow_drops += bank_live[b].overflow_drops;
+        total.index_collisions += bank_live[b].index_collisions;
+        total.window_drops += bank_live[b].window_drops;
+        total.suppressed += bank_live[b].suppressed;
+        COUNTER_LOOP:
+        for (int t = 0; t < 8; t++) {
+            #pragma HLS UNROLL
+            total.messages[t] += bank_live[b].messages[t];
+            total.loop_cycles[t] += bank_live[b].loop_cycles[t];
+        }
+    }
+    total.suppressed += conflated;
+    suppressed_updates = total.suppressed;
+    if (snapshot && !last_snapshot) {
+        counters = total;
+    }
+    last_snapshot = snapshot;
+}
+
+// The kernel, whichever engine is selected: route_orders sends every order to
+// the bank of its instrument, the banks (book_bank of the engine) run side by
+// side, and merge_banks forwards their outputs
 void order_book(stream<order> &order_stream,
                 stream<Time> &incoming_time,
                 stream<metadata> &incoming_meta,
@@ -323,10 +1206,21 @@ void order_book(stream<order> &order_stream,
                 stream<Time> &outgoing_time,
                 stream<metadata> &outgoing_meta,
                 ap_uint<32> &top_bid_id,
-                ap_uint<32> &top_ask_id) {
+                ap_uint<32> &top_ask_id,
+                stream<execution> &executions,
+                stream<book_depth> &depth,
+                stream<order> &evictions,
+                ap_uint<1> change_only,
+                ap_uint<32> &suppressed_updates,
+                ap_uint<1> snapshot,
+                book_counters &counters) {
     #pragma HLS INTERFACE s_axilite port=return bundle=CTRL_BUS
     #pragma HLS INTERFACE s_axilite port=top_ask_id bundle=CTRL_BUS
     #pragma HLS INTERFACE s_axilite port=top_bid_id bundle=CTRL_BUS
+    #pragma HLS INTERFACE s_axilite port=change_only bundle=CTRL_BUS
+    #pragma HLS INTERFACE s_axilite port=suppressed_updates bundle=CTRL_BUS
+    #pragma HLS INTERFACE s_axilite port=snapshot bundle=CTRL_BUS
+    #pragma HLS INTERFACE s_axilite port=counters bundle=CTRL_BUS
     #pragma HLS INTERFACE axis register port=order_stream
     #pragma HLS INTERFACE axis register port=incoming_time
     #pragma HLS INTERFACE axis register port=incoming_meta
@@ -334,23 +1228,81 @@ void order_book(stream<order> &order_stream,
     #pragma HLS INTERFACE axis register port=top_ask
     #pragma HLS INTERFACE axis register port=outgoing_time
     #pragma HLS INTERFACE axis register port=outgoing_meta
+    #pragma HLS INTERFACE axis register port=executions
+    #pragma HLS INTERFACE axis register port=depth
+    #pragma HLS INTERFACE axis register port=evictions
+    #pragma HLS DATAFLOW
 
-    static order bid[LEVELS][CAPACITY / 2];
-    #pragma HLS ARRAY_PARTITION variable=bid complete dim=1
-    static order ask[LEVELS][CAPACITY / 2];
-    #pragma HLS ARRAY_PARTITION variable=ask complete dim=1
+    // Streams between the router, the banks and the merge
+    static stream<order> bank_orders[BOOK_BANKS];
+    static stream<Time> bank_time[BOOK_BANKS];
+    static stream<metadata> bank_meta[BOOK_BANKS];
+    static stream<top_of_book> bank_tops[BOOK_BANKS];
+    static stream<execution> bank_executions[BOOK_BANKS];
+    #pragma HLS STREAM variable=bank_executions depth=256
+    static stream<book_depth> bank_depth[BOOK_BANKS];
+    static stream<order> bank_evictions[BOOK_BANKS];
+    static stream<book_counters> bank_counters[BOOK_BANKS];
+
+    route_orders(order_stream, incoming_time, incoming_meta, bank_orders, bank_time, bank_meta);
+    run_banks<BOOK_BANKS>(bank_orders, bank_time, bank_meta, bank_tops, bank_executions, bank_depth,
+                          bank_evictions, change_only, bank_counters);
+    merge_banks(bank_tops, bank_executions, bank_depth, bank_evictions, bank_counters, top_bid, top_ask,
+                outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions,
+                suppressed_updates, snapshot, counters);
+}
 
-    static unsigned counter_bid = 0;
-    static unsigned counter_ask = 0;
+#if BOOK_ENGINE == BOOK_ENGINE_HEAP
+// One bank of the heap engine: the books of the instruments routed to BANK.
+// Every bank is its own instance of this function, with its own books.
+template <int BANK>
+void book_bank(stream<order> &order_stream,
+               stream<Time> &incoming_time,
+               stream<metadata> &incoming_meta,
+               stream<top_of_book> &tops,
+               stream<execution> &executions,
+               stream<book_depth> &depth,
+               stream<order> &evictions,
+               ap_uint<1> change_only,
+               stream<book_counters> &counters) {
+    // Lane heaps, orderID indexes and free slots of each side and instrument
+    // (zero-initialized: every slot starts empty). Every lane and heap level
+    // is its own memory.
+    static lane_side<LANE_LEVELS, LANES> bid_books[INSTRUMENTS_PER_BANK];
+    #pragma HLS ARRAY_PARTITION variable=bid_books.lane complete dim=2
+    #pragma HLS ARRAY_PARTITION variable=bid_books.lane.heap complete dim=3
+    #pragma HLS ARRAY_PARTITION variable=bid_books.lane.worst complete dim=3
+    #pragma HLS ARRAY_PARTITION variable=bid_books.lane.index complete dim=3
+    #pragma HLS ARRAY_PARTITION variable=bid_books.lane.index complete dim=5
+    static lane_side<LANE_LEVELS, LANES> ask_books[INSTRUMENTS_PER_BANK];
+    #pragma HLS ARRAY_PARTITION variable=ask_books.lane complete dim=2
+    #pragma HLS ARRAY_PARTITION variable=ask_books.lane.heap complete dim=3
+    #pragma HLS ARRAY_PARTITION variable=ask_books.lane.worst complete dim=3
+    #pragma HLS ARRAY_PARTITION variable=ask_books.lane.index complete dim=3
+    #pragma HLS ARRAY_PARTITION variable=ask_books.lane.index complete dim=5
 
-    static int hole_counter_bid = 0;
-    static int hole_counter_ask = 0;
+    // Size aggregated per price tick of each side and instrument, for the
+    // depth stream
+    static price_level bid_levels[INSTRUMENTS_PER_BANK][TICKS];
+    static price_level ask_levels[INSTRUMENTS_PER_BANK][TICKS];
+    #pragma HLS BIND_STORAGE variable=bid_levels type=ram_2p impl=uram
+    #pragma HLS BIND_STORAGE variable=ask_levels type=ram_2p impl=uram
+    static ap_uint<WORD_BITS> bid_leaf[INSTRUMENTS_PER_BANK][LEAF_WORDS];
+    static ap_uint<WORD_BITS> ask_leaf[INSTRUMENTS_PER_BANK][LEAF_WORDS];
+    static ap_uint<WORD_BITS> bid_summary[INSTRUMENTS_PER_BANK][SUMMARY_WORDS];
+    #pragma HLS ARRAY_PARTITION variable=bid_summary complete dim=2
+    static ap_uint<WORD_BITS> ask_summary[INSTRUMENTS_PER_BANK][SUMMARY_WORDS];
+    #pragma HLS ARRAY_PARTITION variable=ask_summary complete dim=2
+    static ap_uint<SUMMARY_WORDS> bid_root[INSTRUMENTS_PER_BANK];
+    static ap_uint<SUMMARY_WORDS> ask_root[INSTRUMENTS_PER_BANK];
+    // First tick of each instrument's level store window (order_book.hpp)
+    static ap_uint<PRICE_BITS> tick_base[INSTRUMENTS_PER_BANK];
 
-    static int hole_idx_bid[CAPACITY];
-    static int hole_idx_ask[CAPACITY];
+    // Top of book output of each instrument (change-only mode and conflation)
+    static bbo_state bbos[INSTRUMENTS_PER_BANK];
 
-    static int hole_lvl_bid[CAPACITY];
-    static int hole_lvl_ask[CAPACITY];
+    // Performance counters of the bank, summed over its books
+    static book_counters live;
 
     const unsigned int MAX_PRICE = 1000000; // Example maximum price
 
@@ -367,29 +1319,189 @@ void order_book(stream<order> &order_stream,
     dummy_ask.direction = 0;     // Direction based on your system's design
     dummy_ask.size = 0;          // Size o
 
+    // In change-only mode a full top of book output does not hold the book
+    // back: the newest top of book waits in bbo until there is room. The
+    // instruments of the bank take turns to send theirs.
+    static unsigned flush_book = 0;
+    bbos[flush_book].change_only = change_only;
+    flush_bbo(bbos[flush_book], tops);
+    flush_book = flush_book == INSTRUMENTS_PER_BANK - 1 ? 0 : flush_book + 1;
+
     if (!order_stream.empty() && !incoming_time.empty() && !incoming_meta.empty() &&
-        !top_bid.full() && !top_ask.full() && !outgoing_time.full() && !outgoing_meta.full()) {
+        (change_only || !tops.full()) &&
+        !executions.full() && !depth.full()) {
 
         order input = order_stream.read();
         Time time_buffer = incoming_time.read();
         metadata meta_buffer = incoming_meta.read();
+        order previous;
+
+        // Book of the instrument within the bank
+        unsigned book = input.instrument / BOOK_BANKS;
+        lane_side<LANE_LEVELS, LANES>& bids = bid_books[book];
+        lane_side<LANE_LEVELS, LANES>& asks = ask_books[book];
+        bbo_state& bbo = bbos[book];
+        bbo.change_only = change_only;
+        bbo.instrument = input.instrument;
+        if (input.direction == 3 || input.direction == 2) {
+            latch_window(tick_base[book], bid_root[book] == 0 && ask_root[book] == 0, input.price);
+        }
+        ap_uint<PRICE_BITS> base = tick_base[book];
+        bool inside = in_window(input.price, base);
+
+        ap_uint<32> bid_orders, bid_fullest, bid_steps;
+        ap_uint<32> ask_orders, ask_fullest, ask_steps;
+        side_stats(bids, bid_orders, bid_fullest, bid_steps);
+        side_stats(asks, ask_orders, ask_fullest, ask_steps);
+        ap_uint<3> type = input.direction;
+        bool overflow = false;
+        bool collided = false;
+        bool outside = false;
+        order evicted;
+        evicted.size = 0;
+
+        // An amend to a price that crosses the spread is matched as a limit
+        // order: its resting order is cancelled and the amended order comes
+        // in with the same orderID, so the book is never left crossed. An
+        // amend of an order that does not rest stays an amend, and does
+        // nothing.
+        order best_bid = best_order(bids, true), best_ask = best_order(asks, false);
+        if (input.direction == 7 && input.size != 0 && best_ask.size != 0 && input.price >= best_ask.price) {
+            take_order(input, bids, true, previous);
+            if (previous.size != 0) {
+                level_cancel(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], level_tick(previous.price, base), previous);
+                input.direction = 3;
+            }
+        } else if (input.direction == 6 && input.size != 0 && best_bid.size != 0 && input.price <= best_bid.price) {
+            take_order(input, asks, false, previous);
+            if (previous.size != 0) {
+                level_cancel(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], level_tick(previous.price, base), previous);
+                input.direction = 2;
+            }
+        }
 
         if (input.direction == 3) {  // INCOMING LIMITED BID
-            process_incoming_bid(input, bid, counter_bid, hole_counter_bid, hole_idx_bid, 
-                                 hole_lvl_bid, ask, top_bid, top_ask, outgoing_time, 
-                                 outgoing_meta, top_bid_id, top_ask_id, time_buffer, meta_buffer);
+            // Uncross first; a bid with no size left, filled or sent without
+            // any, does not rest
+            sweep_asks(input, true, asks, ask_levels[book], ask_leaf[book], ask_summary[book],
+                       ask_root[book], base, executions);
+            if (input.size == 0) {
+                publish_top(bids, asks, tops, bbo, time_buffer, meta_buffer);
+            } else if (!inside) {  // no level to rest at: refused
+                outside = true;
+                evicted = input;
+                publish_top(bids, asks, tops, bbo, time_buffer, meta_buffer);
+            } else {
+                level_add(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], level_tick(input.price, base), input);
+                overflow = process_incoming_bid(input, bids, asks, tops, bbo, time_buffer, meta_buffer, evicted, collided);
+                if (evicted.size != 0) {  // the evicted order, possibly the input, leaves its level
+                    level_cancel(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], level_tick(evicted.price, base), evicted);
+                }
+            }
         } else if (input.direction == 2) {  // INCOMING LIMITED ASK
-            process_incoming_ask(input, ask, counter_ask, hole_counter_ask, hole_idx_ask, 
-                                 hole_lvl_ask, bid, top_bid, top_ask, outgoing_time, 
-                                 outgoing_meta, top_bid_id, top_ask_id, time_buffer, meta_buffer);
+            sweep_bids(input, true, bids, bid_levels[book], bid_leaf[book], bid_summary[book],
+                       bid_root[book], base, executions);
+            if (input.size == 0) {
+                publish_top(bids, asks, tops, bbo, time_buffer, meta_buffer);
+            } else if (!inside) {  // no level to rest at: refused
+                outside = true;
+                evicted = input;
+                publish_top(bids, asks, tops, bbo, time_buffer, meta_buffer);
+            } else {
+                level_add(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], level_tick(input.price, base), input);
+                overflow = process_incoming_ask(input, asks, bids, tops, bbo, time_buffer, meta_buffer, evicted, collided);
+                if (evicted.size != 0) {
+                    level_cancel(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], level_tick(evicted.price, base), evicted);
+                }
+            }
+        } else if (input.direction == 1) {  // MARKET BID
+            sweep_asks(input, false, asks, ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book],
+                       base, executions);
+            publish_top(bids, asks, tops, bbo, time_buffer, meta_buffer);
+        } else if (input.direction == 0) {  // MARKET ASK
+            sweep_bids(input, false, bids, bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book],
+                       base, executions);
+            publish_top(bids, asks, tops, bbo, time_buffer, meta_buffer);
         }
 
              if (input.direction == 5) {  // REMOVE BID
-                 process_remove_bid(input, bid, counter_bid, hole_counter_bid, hole_idx_bid, hole_lvl_bid, top_bid, 
-                       outgoing_time, outgoing_meta, top_bid_id, time_buffer, meta_buffer, dummy_bid);
+                 process_remove_bid(input, bids, tops, bbo, time_buffer, meta_buffer, dummy_bid, previous);
+                 if (previous.size != 0) {
+                     level_cancel(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], level_tick(previous.price, base), previous);
+                 }
          } else if (input.direction == 4) {  // REMOVE ASK
-                process_remove_ask(input, ask, counter_ask, hole_counter_ask, hole_idx_ask, hole_lvl_ask, top_ask, 
-                       outgoing_time, outgoing_meta, top_ask_id, time_buffer, meta_buffer, dummy_ask);
+                process_remove_ask(input, asks, tops, bbo, time_buffer, meta_buffer, dummy_ask, previous);
+                if (previous.size != 0) {
+                    level_cancel(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], level_tick(previous.price, base), previous);
+                }
+         } else if (input.direction == 7) {  // MODIFY BID
+                outside = input.size != 0 && !inside;
+                if (outside) {  // no level to move to: the amend cancels the order
+                    input.size = 0;
+                }
+                process_modify_bid(input, bids, tops, bbo, time_buffer, meta_buffer, dummy_bid, previous);
+                if (previous.size != 0) {  // the amended order moves to its new level
+                    level_cancel(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], level_tick(previous.price, base), previous);
+                    level_add(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], level_tick(input.price, base), input);
+                    if (outside) {
+                        evicted = previous;
+                    }
+                }
+         } else if (input.direction == 6) {  // MODIFY ASK
+                outside = input.size != 0 && !inside;
+                if (outside) {
+                    input.size = 0;
+                }
+                process_modify_ask(input, asks, tops, bbo, time_buffer, meta_buffer, dummy_ask, previous);
+                if (previous.size != 0) {
+                    level_cancel(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], level_tick(previous.price, base), previous);
+                    level_add(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], level_tick(input.price, base), input);
+                    if (outside) {
+                        evicted = previous;
+                    }
+                }
          }
+        publish_depth(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book],
+                      ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book],
+                      base, input.instrument, depth);
+        if (evicted.size != 0) {
+            evicted.instrument = input.instrument;
+            evictions.write(evicted);
+        }
+
+        // The counters follow the change to the one book the order touched
+        ap_uint<32> bid_orders_after, bid_fullest_after, bid_steps_after;
+        ap_uint<32> ask_orders_after, ask_fullest_after, ask_steps_after;
+        side_stats(bids, bid_orders_after, bid_fullest_after, bid_steps_after);
+        side_stats(asks, ask_orders_after, ask_fullest_after, ask_steps_after);
+        live.bid_orders += bid_orders_after - bid_orders;
+        live.ask_orders += ask_orders_after - ask_orders;
+        if (bid_fullest_after > live.bid_high_water) {
+            live.bid_high_water = bid_fullest_after;
+        }
+        if (ask_fullest_after > live.ask_high_water) {
+            live.ask_high_water = ask_fullest_after;
+        }
+        if (overflow) {
+            live.overflow_drops++;
+        }
+        if (collided) {
+            live.index_collisions++;
+        }
+        if (outside && evicted.size != 0) {
+            live.window_drops++;
+        }
+        live.messages[type]++;
+        live.loop_cycles[type] += (bid_steps_after - bid_steps) + (ask_steps_after - ask_steps);
     }
-}
\ No newline at end of file
+
+    ap_uint<32> suppressed = 0;
+    SUPPRESSED_LOOP:
+    for (int b = 0; b < INSTRUMENTS_PER_BANK; b++) {
+        #pragma HLS UNROLL
+        suppressed += bbos[b].suppressed;
+    }
+    live.suppressed = suppressed;
+    counters.write(live);
+}
+#endif  // BOOK_ENGINE == BOOK_ENGINE_HEAP
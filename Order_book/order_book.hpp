@@ -4,11 +4,52 @@
 #include <hls_stream.h>
 #include "ap_int.h"
 
-#define CAPACITY 4096
+/* Heap engine size: about CAPACITY orders per side, in LANES heaps of
+ * LANE_LEVELS = LEVELS - LANE_BITS levels (see LANES).
+ * Override LEVELS at build time (-DLEVELS=10 / 12 / 14 for 1K / 4K / 16K
+ * books); everything sized from it, index widths included, follows.
+ */
+#ifndef LEVELS
 #define LEVELS 12
+#endif
+#define CAPACITY (1 << LEVELS)
+
+// Bits needed to hold the values 0..n, for minimal-width ap_uint fields
+constexpr int bits_for(unsigned n) {
+    return n < 2 ? 1 : 1 + bits_for(n >> 1);
+}
+
+/* Book engine behind order_book():
+ * - BOOK_ENGINE_HEAP:        one entry per order in a binary heap (order_book.cpp)
+ * - BOOK_ENGINE_PRICE_LEVEL: size aggregated per price tick with an occupancy
+ *                            bitmap (price_level_book.cpp)
+ * - BOOK_ENGINE_SYSTOLIC:    the best SYSTOLIC_CELLS orders of each side in a
+ *                            sorted shift register (systolic_book.cpp)
+ */
+#define BOOK_ENGINE_HEAP        0
+#define BOOK_ENGINE_PRICE_LEVEL 1
+#define BOOK_ENGINE_SYSTOLIC    2
+#ifndef BOOK_ENGINE
+#define BOOK_ENGINE BOOK_ENGINE_HEAP
+#endif
+
+/* Instruments: one kernel keeps the books of NUM_INSTRUMENTS instruments in
+ * BOOK_BANKS banks. Instrument i is book i / BOOK_BANKS of bank
+ * i % BOOK_BANKS; every bank has its own copy of the engine and its memories
+ * and runs as its own dataflow process, so orders for instruments in
+ * different banks are processed at the same time. Orders for an instrument
+ * past NUM_INSTRUMENTS are dropped.
+ */
+#define INSTRUMENT_BITS 10
+#ifndef BOOK_BANKS
+#define BOOK_BANKS 4
+#endif
+#ifndef INSTRUMENTS_PER_BANK
+#define INSTRUMENTS_PER_BANK 2
+#endif
+#define NUM_INSTRUMENTS (BOOK_BANKS * INSTRUMENTS_PER_BANK)
 
 
-static ap_uint<4> log_rom[CAPACITY] = {0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11};
 
 using namespace hls;
 
@@ -29,8 +70,260 @@ struct order{
 	ap_uint<8> size; 		/*Order size in hundreds*/
 	ap_uint<32> orderID; 	/*Unique ID for each order*/
 	ap_uint<3> direction; 	/*Order type: 0 - MARKET ASK 	1 - MARKET BID   */
-};							/*			  2 - INCOMING ASK 	3 - INCOMING BID */
+							/*			  2 - INCOMING ASK 	3 - INCOMING BID */
 							/*		   	  4 - REMOVE ASK	5 - REMOVE BID	 */
+							/*		   	  6 - MODIFY ASK	7 - MODIFY BID	 */
+	ap_uint<INSTRUMENT_BITS> instrument;	/*Book the order belongs to*/
+};
+
+struct execution{
+	ap_uint<32> orderID;		/*Resting order that was filled*/
+	ap_ufixed<16, 8> price;	/*Fill price: the resting order's price*/
+	ap_uint<8> size;			/*Filled size*/
+	ap_uint<INSTRUMENT_BITS> instrument;	/*Book of the fill*/
+};
+
+/* Top of book output. By default every order writes the sides it may have
+ * changed. In change-only mode (CTRL_BUS) the bid and ask go out together,
+ * and only when the best price or size of either differs from what was last
+ * sent; an emptied side goes out as an empty order. A full output no longer
+ * stalls the book, the newest top of book waits here instead and replaces
+ * any older one still waiting (conflation). Orders whose update is dropped
+ * as unchanged or replaced count in `suppressed`.
+ */
+struct bbo_state{
+	order bid;					/*Newest top bid*/
+	order ask;					/*Newest top ask*/
+	order sent_bid;				/*Top bid last sent downstream*/
+	order sent_ask;				/*Top ask last sent downstream*/
+	Time time;					/*Timestamp of the newest order*/
+	metadata meta;				/*Metadata of the newest order*/
+	bool pending;				/*Newest top of book not sent yet*/
+	bool change_only;			/*Output mode*/
+	ap_uint<32> suppressed;		/*Updates dropped or conflated*/
+	ap_uint<INSTRUMENT_BITS> instrument;	/*Book the top of book is tagged with*/
+};
+
+/* One top of book output of a bank: the sides it writes, with the timestamp
+ * and metadata of its order. merge_banks forwards it whole, so the top_bid,
+ * top_ask, outgoing_time and outgoing_meta streams stay aligned per order.
+ */
+struct top_of_book{
+	bool has_bid;				/*bid goes out on top_bid*/
+	order bid;
+	bool has_ask;				/*ask goes out on top_ask*/
+	order ask;
+	Time time;
+	metadata meta;
+};
+
+/* Performance counters of the book, read on CTRL_BUS. The book keeps them
+ * live; order_book() copies them to its counters port only on a rising edge
+ * of snapshot, so a read sees one consistent set and never holds up an
+ * order. Occupancy and the high-water marks count resting orders in the
+ * heaps (zero in the price-level engine); the high-water
+ * mark is the fullest any one heap lane has been, as a lane is what fills up.
+ * overflow_drops counts orders that arrived with their lane full, each of
+ * which evicted one order (see evictions; a full systolic side refuses the
+ * new order instead), and index_collisions the limit orders refused because
+ * their orderID was already resting or found no free index entry. window_drops
+ * counts the orders refused, or cancelled by an amend, for a price outside the
+ * level store window (see TICK_BITS). messages
+ * and loop_cycles are indexed by order type (order.direction): loop_cycles
+ * adds up the push, pop and sift iterations (sweep iterations in the
+ * price-level engine), one cycle each.
+ */
+struct book_counters{
+	ap_uint<32> bid_orders;			/*Resting bids*/
+	ap_uint<32> ask_orders;			/*Resting asks*/
+	ap_uint<32> bid_high_water;		/*Most bids ever resting in one lane*/
+	ap_uint<32> ask_high_water;		/*Most asks ever resting in one lane*/
+	ap_uint<32> overflow_drops;		/*Orders that found their lane or side full (evictions)*/
+	ap_uint<32> index_collisions;	/*Limit orders refused on a resting orderID or a full index bucket*/
+	ap_uint<32> window_drops;		/*Orders refused or cancelled outside the level store window*/
+	ap_uint<32> suppressed;			/*Top of book updates dropped or conflated*/
+	ap_uint<32> messages[8];		/*Orders of each type*/
+	ap_uint<32> loop_cycles[8];		/*Heap loop cycles spent on each type*/
+};
+
+/* Price levels: the raw bits of an ap_ufixed<16, 8> price are its tick, and a
+ * side keeps the size aggregated per tick under a three-level occupancy bitmap
+ * (price_level_book.cpp). The price-level engine is built on it; the heap
+ * engine keeps one per side next to its heaps for the depth stream.
+ *
+ * The level store of an instrument covers a window of TICKS ticks from its
+ * tick_base, shared by both sides. TICK_BITS 16 (the default) is every price
+ * and the window never moves. With a smaller TICK_BITS (12 to 15) the window
+ * is centred on the first limit order that finds the instrument's book empty,
+ * and moves again each time the book empties. A limit order priced outside
+ * the window is refused after it has matched: it does not rest, goes out on
+ * the evictions stream and counts in window_drops; an amend to a price
+ * outside it cancels its order the same way.
+ *
+ * URAM budget: per instrument and side, TICKS price_level entries of 56 bits,
+ * one URAM (4K x 72) per 4K ticks, and a TICKS-bit leaf bitmap in block RAM;
+ * summaries and roots are registers. The level stores of the kernel take
+ * 2 * NUM_INSTRUMENTS * TICKS / 4096 URAMs: 256 with the defaults (16 per
+ * instrument and side, over a quarter of a VU9P's 960), 16 with TICK_BITS 12.
+ */
+#ifndef TICK_BITS
+#define TICK_BITS       16                          // every ap_ufixed<16, 8> price is a tick
+#endif
+#define PRICE_BITS      16                          // raw bits of an ap_ufixed<16, 8> price
+#define TICKS           (1 << TICK_BITS)
+#define WORD_BITS       64
+#define WORD_INDEX_BITS 6
+#define LEAF_WORDS      (TICKS / WORD_BITS)         // one bit per tick
+#define SUMMARY_WORDS   (LEAF_WORDS / WORD_BITS)    // one bit per leaf word
+#define SUMMARY_INDEX_BITS bits_for(SUMMARY_WORDS - 1)
+static_assert(TICK_BITS >= 2 * WORD_INDEX_BITS && TICK_BITS <= PRICE_BITS,
+              "TICK_BITS must be 12 to 16: the bitmap needs at least one summary word");
+
+struct price_level{
+	ap_uint<24> size;		/*Aggregated size resting at the tick*/
+	ap_uint<32> head_id;	/*orderID of the order that opened the level*/
+};
+
+/* Depth: the best DEPTH_LEVELS price levels of each side, best first, with the
+ * size aggregated at each. Levels past the last one of a side are 0.
+ */
+#define DEPTH_LEVELS 5
+
+struct depth_level{
+	ap_ufixed<16, 8> price;	/*Level price*/
+	ap_uint<24> size;		/*Size aggregated at the price*/
+};
+
+struct book_depth{
+	depth_level bid[DEPTH_LEVELS];	/*Highest bids first*/
+	depth_level ask[DEPTH_LEVELS];	/*Lowest asks first*/
+	ap_uint<INSTRUMENT_BITS> instrument;	/*Book of the snapshot*/
+};
+
+/* Lanes: each side of a heap book is split into LANES heaps of LANE_LEVELS
+ * levels. The lane of an order is the low LANE_BITS of its orderID XORed with
+ * a multiplicative hash of the bits above them (lane_of), so sequential
+ * orderIDs spread evenly, and so do orderIDs that step by a multiple of
+ * LANES. Every heap is LANE_BITS levels shallower than a single heap of the
+ * same capacity, and the best order of a side is a compare tree over the lane
+ * roots.
+ */
+#ifndef LANE_BITS
+#define LANE_BITS 2
+#endif
+#define LANES			(1 << LANE_BITS)
+#define LANE_LEVELS		(LEVELS - LANE_BITS)
+
+/* Heap engine: every resting order is found from its orderID through its
+ * lane's index, tagged with the orderID. The index is two tables of
+ * INDEX_SETS buckets of INDEX_WAYS entries, each table hashing the orderID
+ * its own way (index_set), and a new order takes a free entry of the less
+ * full of its two buckets. It holds LANE_INDEX_SIZE entries, twice what the
+ * lane can hold, so any 32-bit orderIDs fit: both buckets of an order are
+ * full only far out in the tail, and the testbench fills lanes with random
+ * orderIDs without one. A limit order whose orderID already rests in the
+ * lane, or whose buckets are both full, is refused rather than let it orphan
+ * a resting order: it does not rest, goes out on the evictions stream and
+ * counts in index_collisions.
+ */
+#define INDEX_WAY_BITS	3
+#define INDEX_WAYS		(1 << INDEX_WAY_BITS)
+#define INDEX_SET_BITS	(LANE_LEVELS - INDEX_WAY_BITS)
+#define INDEX_SETS		(1 << INDEX_SET_BITS)
+#define LANE_INDEX_SIZE	(2 * INDEX_SETS * INDEX_WAYS)
+static_assert(LANE_LEVELS >= INDEX_WAY_BITS, "a lane needs at least one index bucket per table");
+
+/* Storage word of a resting order, 64 bits. The fields are laid out so that
+ * one unsigned compare of the priority key (price key and time key) is the
+ * price-time priority of either side:
+ *   [63:48] price key: the price bits for bids, their complement for asks
+ *   [47:HANDLE_BITS] time key: the complement of the order's arrival
+ *                      number, so the earlier arrival is the larger key
+ *   [HANDLE_BITS-1:0] handle: the heap engine's index entry of the order,
+ *                      which holds its orderID and size (order_location)
+ * The orderID and size are not needed to rank orders, so they stay out of
+ * the word that every heap step moves and compares: the heap engine keeps
+ * them in the index entry, which never moves while the order rests, and the
+ * systolic engine beside the word in its cell (systolic_cell). The empty
+ * slot is the all-zero word, below every resting order. Orders are packed
+ * when they rest and unpacked only where they leave the book.
+ *
+ * Arrival numbers are given out per side by the book, so time priority does
+ * not depend on the order in which the exchange assigns orderIDs. SEQ_BITS
+ * is what the handle leaves of the low 48 bits (37 with the defaults): the
+ * key compare is 53 bits, one carry chain at II=1, and does not wrap within
+ * a session (2^37 orders a side).
+ */
+#define HANDLE_BITS		(INDEX_WAY_BITS + INDEX_SET_BITS + 1)
+#define ORDER_WORD_BITS	64
+#define PRICE_KEY_LSB	48
+#define TIME_KEY_LSB	HANDLE_BITS
+#define SEQ_BITS		(PRICE_KEY_LSB - TIME_KEY_LSB)
+static_assert(SEQ_BITS >= 32, "arrival numbers must not wrap within a session");
+typedef ap_uint<ORDER_WORD_BITS> order_word;
+
+template <int L>
+struct order_location{
+	ap_uint<32> orderID;				/*Tag: orderID of the indexed order, 0 for none*/
+	ap_uint<8> size;					/*Size of the order*/
+	ap_uint<bits_for(L - 1)> level;		/*Heap level of the order*/
+	ap_uint<L - 1> idx;					/*Position within the level*/
+};
+
+/* One side of the heap engine with L levels: level l of the heap holds 2^l
+ * orders. The heap is kept compact: its counter orders fill positions 1 to
+ * counter in level order, so the deepest level in use is log_base_2(counter).
+ * A full heap's worst order is one of its leaves, all on the bottom level;
+ * worst is a tournament tree over that level (level t holds 2^t nodes, each
+ * the lowest ranked word below it, an empty slot lowest of all), refreshed
+ * whenever a bottom slot changes, so a full lane finds its worst order at
+ * the root instead of scanning.
+ */
+template <int L>
+struct heap_side{
+	order_word heap[L][(1 << L) / 2];					/*Resting orders*/
+	order_word worst[L - 1][(1 << L) / 4];				/*Lowest ranked order of the bottom level*/
+	order_location<L> index[2][INDEX_SETS][INDEX_WAYS];	/*orderID -> size and heap position*/
+	unsigned counter;									/*Resting orders*/
+	ap_uint<32> steps;									/*Push, pop and sift loop iterations, one cycle each*/
+};
+
+/* One side of a heap book: K lanes of L levels (see LANES). Arrival numbers
+ * are given out per side, not per lane, so the roots of different lanes
+ * compare by price-time priority like orders within one heap.
+ */
+template <int L, int K>
+struct lane_side{
+	heap_side<L> lane[K];								/*Orders of each lane*/
+	ap_uint<SEQ_BITS> arrival;							/*Arrival number of the next order to join the queue*/
+};
+
+/* Systolic engine: each side keeps its orders sorted by price-time priority
+ * in SYSTOLIC_CELLS registers, best first, with the empty cells (the zero
+ * word) at the end. Every cell compares itself with the incoming order and
+ * keeps its word or takes its neighbour's at the same time, so an insert or
+ * a cancel is one shift of the whole register whatever the depth of the
+ * book, and the top of book is cell 0. A full side refuses a limit order
+ * that would rest, on the evictions stream, and keeps every order it holds.
+ * Override with -DSYSTOLIC_CELLS.
+ */
+#ifndef SYSTOLIC_CELLS
+#define SYSTOLIC_CELLS 64
+#endif
+
+struct systolic_cell{
+	order_word word;									/*Priority key, handle 0*/
+	ap_uint<32> orderID;
+	ap_uint<8> size;
+};
+
+template <int N>
+struct systolic_side{
+	systolic_cell cell[N];								/*Resting orders, best first*/
+	ap_uint<bits_for(N)> count;							/*Resting orders*/
+	ap_uint<SEQ_BITS> arrival;							/*Arrival number of the next order to join the queue*/
+};
+
 order bid_book(order input,
               order ask,
               Time time_buffer,
@@ -57,11 +350,146 @@ int log_base_2(unsigned index);
 
 int pow2(int level);
 
-int find_path(unsigned& counter, int& hole_counter, int hole_idx[CAPACITY], int level);
+order_word pack_order(const order& o, bool is_bid, ap_uint<SEQ_BITS> arrival, ap_uint<HANDLE_BITS> handle);
+
+order unpack_price(order_word w, bool is_bid);
+
+ap_uint<HANDLE_BITS> word_handle(order_word w);
+
+ap_uint<SEQ_BITS> word_arrival(order_word w);
+
+bool ranks_before(order_word a, order_word b);
+
+template <int L>
+int find_path(heap_side<L>& side, int level);
+
+unsigned index_set(ap_uint<32> orderID, int table);
+
+template <int L>
+bool find_entry(const order_location<L> index[2][INDEX_SETS][INDEX_WAYS], ap_uint<32> orderID,
+                unsigned& table, unsigned& set, unsigned& way);
+
+template <int L>
+bool free_entry(const order_location<L> index[2][INDEX_SETS][INDEX_WAYS], ap_uint<32> orderID,
+                unsigned& table, unsigned& set, unsigned& way);
+
+template <int L>
+void index_order(order_location<L> index[2][INDEX_SETS][INDEX_WAYS], order_word w, unsigned level, unsigned idx);
+
+template <int L>
+order_location<L>& handle_entry(order_location<L> index[2][INDEX_SETS][INDEX_WAYS], ap_uint<HANDLE_BITS> handle);
+
+template <int L>
+void unindex_order(order_location<L> index[2][INDEX_SETS][INDEX_WAYS], order_word w);
+
+template <int L>
+bool find_order(const order_location<L> index[2][INDEX_SETS][INDEX_WAYS], ap_uint<32> orderID,
+                order_location<L>& location);
 
 unsigned calculate_index(int insert_path, int level, int idx);
 
-order& left_child(unsigned level, unsigned index, order queue[LEVELS][CAPACITY/2]);
+unsigned lane_of(ap_uint<32> orderID);
+
+template <int L, int K>
+unsigned best_lane(lane_side<L, K>& side);
+
+template <int L>
+order_word& left_child(unsigned level, unsigned index, heap_side<L>& side);
+
+template <int L>
+order_word& right_child(unsigned level, unsigned index, heap_side<L>& side);
+
+ap_uint<TICK_BITS> level_tick(ap_ufixed<16, 8> price, ap_uint<PRICE_BITS> base);
+
+bool in_window(ap_ufixed<16, 8> price, ap_uint<PRICE_BITS> base);
+
+void latch_window(ap_uint<PRICE_BITS>& base, bool empty, ap_ufixed<16, 8> price);
+
+void level_add(price_level levels[TICKS],
+               ap_uint<WORD_BITS> leaf[LEAF_WORDS],
+               ap_uint<WORD_BITS> summary[SUMMARY_WORDS],
+               ap_uint<SUMMARY_WORDS>& root,
+               ap_uint<TICK_BITS> tick,
+               order& input);
+
+void level_cancel(price_level levels[TICKS],
+                  ap_uint<WORD_BITS> leaf[LEAF_WORDS],
+                  ap_uint<WORD_BITS> summary[SUMMARY_WORDS],
+                  ap_uint<SUMMARY_WORDS>& root,
+                  ap_uint<TICK_BITS> tick,
+                  order& input);
+
+void publish_depth(price_level bid_levels[TICKS],
+                   ap_uint<WORD_BITS> bid_leaf[LEAF_WORDS],
+                   ap_uint<WORD_BITS> bid_summary[SUMMARY_WORDS],
+                   ap_uint<SUMMARY_WORDS> bid_root,
+                   price_level ask_levels[TICKS],
+                   ap_uint<WORD_BITS> ask_leaf[LEAF_WORDS],
+                   ap_uint<WORD_BITS> ask_summary[SUMMARY_WORDS],
+                   ap_uint<SUMMARY_WORDS> ask_root,
+                   ap_uint<PRICE_BITS> base,
+                   ap_uint<INSTRUMENT_BITS> instrument,
+                   stream<book_depth>& depth);
+
+void publish_bbo(bbo_state& bbo,
+                 bool update_bid, order bid,
+                 bool update_ask, order ask,
+                 Time time_buffer, metadata meta_buffer,
+                 stream<top_of_book>& tops);
+
+void flush_bbo(bbo_state& bbo, stream<top_of_book>& tops);
+
+bool send_top(top_of_book& top, stream<order>& top_bid, stream<order>& top_ask,
+              stream<Time>& outgoing_time, stream<metadata>& outgoing_meta,
+              ap_uint<32>& top_bid_id, ap_uint<32>& top_ask_id);
+
+void route_orders(stream<order>& order_stream, stream<Time>& incoming_time, stream<metadata>& incoming_meta,
+                  stream<order> bank_orders[BOOK_BANKS], stream<Time> bank_time[BOOK_BANKS],
+                  stream<metadata> bank_meta[BOOK_BANKS]);
+
+void merge_banks(stream<top_of_book> bank_tops[BOOK_BANKS],
+                 stream<execution> bank_executions[BOOK_BANKS], stream<book_depth> bank_depth[BOOK_BANKS],
+                 stream<order> bank_evictions[BOOK_BANKS], stream<book_counters> bank_counters[BOOK_BANKS],
+                 stream<order>& top_bid, stream<order>& top_ask,
+                 stream<Time>& outgoing_time, stream<metadata>& outgoing_meta,
+                 ap_uint<32>& top_bid_id, ap_uint<32>& top_ask_id,
+                 stream<execution>& executions, stream<book_depth>& depth, stream<order>& evictions,
+                 ap_uint<32>& suppressed_updates, ap_uint<1> snapshot, book_counters& counters);
+
+// One bank of the selected engine (order_book.cpp, price_level_book.cpp or
+// systolic_book.cpp)
+template <int BANK>
+void book_bank(stream<order> &order_stream,
+               stream<Time> &incoming_time,
+               stream<metadata> &incoming_meta,
+               stream<top_of_book> &tops,
+               stream<execution> &executions,
+               stream<book_depth> &depth,
+               stream<order> &evictions,
+               ap_uint<1> change_only,
+               stream<book_counters> &counters);
 
-order& right_child(unsigned level, unsigned index, order queue[LEVELS][CAPACITY/2]);
+// Banks B - 1 down to 0, each its own process of the order_book() dataflow
+// region: book_bank<BANK> is instantiated once per bank. order_book() is
+// shared by the engines; the selected engine's source instantiates
+// run_banks<BOOK_BANKS>, and with it its book_bank of every bank.
+template <int B>
+void run_banks(stream<order> bank_orders[BOOK_BANKS], stream<Time> bank_time[BOOK_BANKS],
+               stream<metadata> bank_meta[BOOK_BANKS], stream<top_of_book> bank_tops[BOOK_BANKS],
+               stream<execution> bank_executions[BOOK_BANKS], stream<book_depth> bank_depth[BOOK_BANKS],
+               stream<order> bank_evictions[BOOK_BANKS], ap_uint<1> change_only,
+               stream<book_counters> bank_counters[BOOK_BANKS]) {
+    #pragma HLS INLINE
+    book_bank<B - 1>(bank_orders[B - 1], bank_time[B - 1], bank_meta[B - 1], bank_tops[B - 1],
+                     bank_executions[B - 1], bank_depth[B - 1], bank_evictions[B - 1], change_only,
+                     bank_counters[B - 1]);
+    run_banks<B - 1>(bank_orders, bank_time, bank_meta, bank_tops, bank_executions, bank_depth,
+                     bank_evictions, change_only, bank_counters);
+}
 
+template <>
+inline void run_banks<0>(stream<order>[BOOK_BANKS], stream<Time>[BOOK_BANKS], stream<metadata>[BOOK_BANKS],
+                         stream<top_of_book>[BOOK_BANKS], stream<execution>[BOOK_BANKS],
+                         stream<book_depth>[BOOK_BANKS], stream<order>[BOOK_BANKS], ap_uint<1>,
+                         stream<book_counters>[BOOK_BANKS]) {
+}
@@ -0,0 +1,426 @@
+/*How does this work:
+
+  1.The price-level engine replaces the order heap of order_book.cpp with one slot per price tick. The raw bits of an
+  ap_ufixed<16, 8> price are its tick index, so every limit price has a fixed slot holding the size aggregated at
+  that price and the orderID of the order that opened the level. An insert or a cancel touches one slot: O(1).
+
+  2.A three-level occupancy bitmap marks the ticks that hold size: one bit per tick (LEAF_WORDS 64-bit words in block
+  RAM), one bit per non-empty leaf word (SUMMARY_WORDS 64-bit words in registers) and one bit per non-empty summary
+  word (the root). The best bid is found with three priority encoders from the root down (highest set bit), the best
+  ask with the lowest set bit, so the lookup is the same three steps however deep the book is.
+
+  3.REMOVE orders cancel size at their price level; a level that runs out of size is cleared from every bitmap level
+  it empties. Every processed order writes the best bid and ask (price, aggregated size capped to the order size
+  field, orderID that opened the level) with its timestamp and metadata, through the same order_book() interface as
+  the heap engine. MODIFY orders do not carry the price and size they replace, and this engine keeps no per-order
+  state to find them by, so it refuses them: the amend goes out unchanged on the evictions stream and the book keeps
+  the order as it was. A feed that amends has to send a cancel and a new order to this engine.
+
+  4.Market orders and limit orders that cross the spread sweep the opposite side level by level from the best one,
+  reporting each fill on the executions stream with the orderID that opened the level (the engine keeps no per-order
+  state). What is left of a limit order rests at its price; what is left of a market order is dropped.
+
+  5.Every processed order also writes the best DEPTH_LEVELS levels of each side on the depth stream. The first level
+  comes from the same three priority encoders, and each next one masks off the levels already taken and walks up the
+  bitmap only as far as the first word with a level left, so a snapshot costs DEPTH_LEVELS lookups however many levels
+  the book holds. The level store and the depth lookup are shared with the heap engine.
+
+  6.The top of book goes out through the same publish_bbo as in the heap engine (order_book.cpp), so the change-only
+  mode and its conflation behave the same in both engines.
+
+  7.Instruments are banked as in the heap engine: each book_bank<BANK> holds the level memories, bitmaps and bbo of
+  its instruments, run by the same order_book(), route_orders and merge_banks (order_book.cpp).
+
+  8.The level store of an instrument covers TICKS ticks from its tick_base (order_book.hpp): every price with the
+  default TICK_BITS of 16, otherwise a window that latch_window centres on the first limit order to reach an empty
+  book. level_tick maps a price in the window to its slot, and the depth and top of book add the base back. A limit
+  order outside the window is refused once it has matched and goes out on the evictions stream; a cancel outside it
+  has nothing to cancel.
+
+  Built instead of the heap engine with -DBOOK_ENGINE=BOOK_ENGINE_PRICE_LEVEL (order_book.hpp).*/
+
+#include "order_book.hpp"
+
+#define MARKET_ASK      0
+#define MARKET_BID      1
+#define LIMIT_ASK       2
+#define LIMIT_BID       3
+#define REMOVE_ASK      4
+#define REMOVE_BID      5
+#define MODIFY_ASK      6
+#define MODIFY_BID      7
+
+// Priority encoder: index of the highest (HIGHEST) or lowest set bit of word
+template <bool HIGHEST, int W>
+ap_uint<8> priority_encode(ap_uint<W> word) {
+    #pragma HLS INLINE
+    ap_uint<8> index = 0;
+    for (int i = 0; i < W; i++) {
+        #pragma HLS UNROLL
+        int bit = HIGHEST ? i : W - 1 - i;
+        if (word[bit]) {
+            index = bit;
+        }
+    }
+    return index;
+}
+
+// Slot of a price in the level store: its tick less the window's base. Only
+// meaningful for a price in_window.
+ap_uint<TICK_BITS> level_tick(ap_ufixed<16, 8> price, ap_uint<PRICE_BITS> base) {
+    #pragma HLS INLINE
+    ap_uint<PRICE_BITS> raw = price.range(PRICE_BITS - 1, 0);
+    return ap_uint<PRICE_BITS>(raw.to_uint() - base.to_uint());
+}
+
+// Whether a price falls in the TICKS ticks of the window starting at base
+bool in_window(ap_ufixed<16, 8> price, ap_uint<PRICE_BITS> base) {
+    #pragma HLS INLINE
+    ap_uint<PRICE_BITS> raw = price.range(PRICE_BITS - 1, 0);
+    return raw >= base && raw.to_uint() - base.to_uint() < TICKS;
+}
+
+// Centres the window of an empty book on price, kept within the price range.
+// Books that are not empty keep their window, so no resting level ever moves.
+void latch_window(ap_uint<PRICE_BITS>& base, bool empty, ap_ufixed<16, 8> price) {
+    #pragma HLS INLINE
+    const unsigned HIGHEST_BASE = (1 << PRICE_BITS) - TICKS;
+    unsigned raw = price.range(PRICE_BITS - 1, 0).to_uint();
+    unsigned centred = raw < TICKS / 2 ? 0 : raw - TICKS / 2;
+    if (empty) {
+        base = centred > HIGHEST_BASE ? HIGHEST_BASE : centred;
+    }
+}
+
+void level_add(price_level levels[TICKS],
+               ap_uint<WORD_BITS> leaf[LEAF_WORDS],
+               ap_uint<WORD_BITS> summary[SUMMARY_WORDS],
+               ap_uint<SUMMARY_WORDS>& root,
+               ap_uint<TICK_BITS> tick,
+               order& input) {
+    #pragma HLS INLINE
+    if (input.size == 0) {
+        return;
+    }
+    price_level level = levels[tick];
+    if (level.size == 0) {
+        level.head_id = input.orderID;
+    }
+    level.size += input.size;
+    levels[tick] = level;
+
+    ap_uint<TICK_BITS - WORD_INDEX_BITS> word = tick >> WORD_INDEX_BITS;
+    ap_uint<WORD_BITS> leaf_word = leaf[word];
+    leaf_word[tick & (WORD_BITS - 1)] = 1;
+    leaf[word] = leaf_word;
+    summary[word >> WORD_INDEX_BITS][word & (WORD_BITS - 1)] = 1;
+    root[word >> WORD_INDEX_BITS] = 1;
+}
+
+void level_cancel(price_level levels[TICKS],
+                  ap_uint<WORD_BITS> leaf[LEAF_WORDS],
+                  ap_uint<WORD_BITS> summary[SUMMARY_WORDS],
+                  ap_uint<SUMMARY_WORDS>& root,
+                  ap_uint<TICK_BITS> tick,
+                  order& input) {
+    #pragma HLS INLINE
+    price_level level = levels[tick];
+    bool cleared = level.size <= input.size;
+    level.size = cleared ? ap_uint<24>(0) : ap_uint<24>(level.size - input.size);
+    levels[tick] = level;
+
+    if (cleared) {
+        ap_uint<TICK_BITS - WORD_INDEX_BITS> word = tick >> WORD_INDEX_BITS;
+        ap_uint<WORD_BITS> leaf_word = leaf[word];
+        leaf_word[tick & (WORD_BITS - 1)] = 0;
+        leaf[word] = leaf_word;
+        if (leaf_word == 0) {
+            ap_uint<WORD_BITS> summary_word = summary[word >> WORD_INDEX_BITS];
+            summary_word[word & (WORD_BITS - 1)] = 0;
+            summary[word >> WORD_INDEX_BITS] = summary_word;
+            if (summary_word == 0) {
+                root[word >> WORD_INDEX_BITS] = 0;
+            }
+        }
+    }
+}
+
+// Best tick of a non-empty side: three priority encoders from the root down
+template <bool HIGHEST>
+ap_uint<TICK_BITS> best_tick(ap_uint<WORD_BITS> leaf[LEAF_WORDS],
+                             ap_uint<WORD_BITS> summary[SUMMARY_WORDS],
+                             ap_uint<SUMMARY_WORDS> root) {
+    #pragma HLS INLINE
+    ap_uint<SUMMARY_INDEX_BITS> summary_index = priority_encode<HIGHEST>(root);
+    ap_uint<TICK_BITS - WORD_INDEX_BITS> word =
+        (ap_uint<TICK_BITS - WORD_INDEX_BITS>(summary_index) << WORD_INDEX_BITS) |
+        priority_encode<HIGHEST>(summary[summary_index]);
+    return (ap_uint<TICK_BITS>(word) << WORD_INDEX_BITS) | priority_encode<HIGHEST>(leaf[word]);
+}
+
+// Bits of a W-bit word that rank after `bit`: the lower ones for bids
+// (HIGHEST), the higher ones for asks
+template <bool HIGHEST, int W>
+ap_uint<W> after_mask(unsigned bit) {
+    #pragma HLS INLINE
+    ap_uint<W> below = (ap_uint<W>(1) << bit) - 1;
+    return HIGHEST ? below : ap_uint<W>(~(below | (ap_uint<W>(1) << bit)));
+}
+
+// Next level of one side after `tick`: the next lower tick for bids, the next
+// higher for asks. The walk only goes up the bitmap as far as the first word
+// with a level left in it, so it takes at most three steps down again.
+// found is false when `tick` was the last level of the side.
+template <bool HIGHEST>
+ap_uint<TICK_BITS> next_tick(ap_uint<WORD_BITS> leaf[LEAF_WORDS],
+                             ap_uint<WORD_BITS> summary[SUMMARY_WORDS],
+                             ap_uint<SUMMARY_WORDS> root,
+                             ap_uint<TICK_BITS> tick,
+                             bool& found) {
+    #pragma HLS INLINE
+    ap_uint<TICK_BITS - WORD_INDEX_BITS> word = tick >> WORD_INDEX_BITS;
+    ap_uint<WORD_BITS> leaf_word = leaf[word] & after_mask<HIGHEST, WORD_BITS>(tick & (WORD_BITS - 1));
+    found = true;
+    if (leaf_word == 0) {
+        ap_uint<SUMMARY_INDEX_BITS> summary_index = word >> WORD_INDEX_BITS;
+        ap_uint<WORD_BITS> summary_word =
+            summary[summary_index] & after_mask<HIGHEST, WORD_BITS>(word & (WORD_BITS - 1));
+        if (summary_word == 0) {
+            ap_uint<SUMMARY_WORDS> root_word = root & after_mask<HIGHEST, SUMMARY_WORDS>(summary_index);
+            found = root_word != 0;
+            summary_index = priority_encode<HIGHEST>(root_word);
+            summary_word = summary[summary_index];
+        }
+        word = (ap_uint<TICK_BITS - WORD_INDEX_BITS>(summary_index) << WORD_INDEX_BITS) |
+               priority_encode<HIGHEST>(summary_word);
+        leaf_word = leaf[word];
+    }
+    return (ap_uint<TICK_BITS>(word) << WORD_INDEX_BITS) | priority_encode<HIGHEST>(leaf_word);
+}
+
+// Best DEPTH_LEVELS levels of one side, best first: one next_tick step per
+// level, whatever the number of levels in the book
+template <bool HIGHEST>
+void depth_side(price_level levels[TICKS],
+                ap_uint<WORD_BITS> leaf[LEAF_WORDS],
+                ap_uint<WORD_BITS> summary[SUMMARY_WORDS],
+                ap_uint<SUMMARY_WORDS> root,
+                ap_uint<PRICE_BITS> base,
+                depth_level side[DEPTH_LEVELS]) {
+    #pragma HLS INLINE
+    bool found = root != 0;
+    ap_uint<TICK_BITS> tick = best_tick<HIGHEST>(leaf, summary, root);
+    DEPTH_LOOP:
+    for (int d = 0; d < DEPTH_LEVELS; d++) {
+        side[d].price = 0;
+        side[d].size = 0;
+        if (found) {
+            side[d].price.range(PRICE_BITS - 1, 0) = base + tick;
+            side[d].size = levels[tick].size;
+            tick = next_tick<HIGHEST>(leaf, summary, root, tick, found);
+        }
+    }
+}
+
+void publish_depth(price_level bid_levels[TICKS],
+                   ap_uint<WORD_BITS> bid_leaf[LEAF_WORDS],
+                   ap_uint<WORD_BITS> bid_summary[SUMMARY_WORDS],
+                   ap_uint<SUMMARY_WORDS> bid_root,
+                   price_level ask_levels[TICKS],
+                   ap_uint<WORD_BITS> ask_leaf[LEAF_WORDS],
+                   ap_uint<WORD_BITS> ask_summary[SUMMARY_WORDS],
+                   ap_uint<SUMMARY_WORDS> ask_root,
+                   ap_uint<PRICE_BITS> base,
+                   ap_uint<INSTRUMENT_BITS> instrument,
+                   stream<book_depth>& depth) {
+    #pragma HLS INLINE
+    book_depth snapshot;
+    snapshot.instrument = instrument;
+    depth_side<true>(bid_levels, bid_leaf, bid_summary, bid_root, base, snapshot.bid);
+    depth_side<false>(ask_levels, ask_leaf, ask_summary, ask_root, base, snapshot.ask);
+    depth.write(snapshot);
+}
+
+// Best level of one side, walking the bitmap from the root: highest tick for
+// bids, lowest for asks. An empty side gives an empty order.
+template <bool HIGHEST>
+order best_level(price_level levels[TICKS],
+                 ap_uint<WORD_BITS> leaf[LEAF_WORDS],
+                 ap_uint<WORD_BITS> summary[SUMMARY_WORDS],
+                 ap_uint<SUMMARY_WORDS> root,
+                 ap_uint<PRICE_BITS> base,
+                 ap_uint<3> direction) {
+    #pragma HLS INLINE
+    ap_uint<TICK_BITS> tick = best_tick<HIGHEST>(leaf, summary, root);
+
+    order top;
+    top.price = 0;
+    top.size = 0;
+    top.orderID = 0;
+    top.direction = 0;
+    if (root != 0) {
+        price_level level = levels[tick];
+        top.price.range(PRICE_BITS - 1, 0) = base + tick;
+        top.size = level.size > 255 ? ap_uint<8>(255) : ap_uint<8>(level.size);
+        top.orderID = level.head_id;
+        top.direction = direction;
+    }
+    return top;
+}
+
+// Matches an incoming order against the opposite side, best level first,
+// while it has size left and the level is within its limit (a market order
+// has none). Every fill takes min(remaining, level size) off the level and is
+// reported on executions; all but the last fill clear their level, so the
+// sweep ends after at most input.size fills.
+template <bool HIGHEST>
+void sweep_levels(price_level levels[TICKS],
+                  ap_uint<WORD_BITS> leaf[LEAF_WORDS],
+                  ap_uint<WORD_BITS> summary[SUMMARY_WORDS],
+                  ap_uint<SUMMARY_WORDS>& root,
+                  ap_uint<PRICE_BITS> base,
+                  order& input,
+                  bool limited,
+                  stream<execution>& executions,
+                  ap_uint<32>& steps) {
+    #pragma HLS INLINE
+    SWEEP_LEVELS_LOOP:
+    while (input.size > 0 && root != 0) {
+        #pragma HLS LOOP_TRIPCOUNT max=255
+        steps++;
+        order best = best_level<HIGHEST>(levels, leaf, summary, root, base, 0);
+        bool within_limit = HIGHEST ? best.price >= input.price : best.price <= input.price;
+        if (limited && !within_limit) {
+            break;
+        }
+        // best.size is capped to 255, which is never below the remaining size
+        order fill = best;
+        fill.size = input.size < best.size ? input.size : best.size;
+        execution report;
+        report.orderID = best.orderID;
+        report.price = best.price;
+        report.size = fill.size;
+        report.instrument = input.instrument;
+        executions.write(report);
+        input.size -= fill.size;
+        level_cancel(levels, leaf, summary, root, level_tick(best.price, base), fill);
+    }
+}
+
+#if BOOK_ENGINE == BOOK_ENGINE_PRICE_LEVEL
+// One bank of the price-level engine: the books of the instruments routed to
+// BANK, each with its own level memories and bitmaps
+template <int BANK>
+void book_bank(stream<order> &order_stream,
+               stream<Time> &incoming_time,
+               stream<metadata> &incoming_meta,
+               stream<top_of_book> &tops,
+               stream<execution> &executions,
+               stream<book_depth> &depth,
+               stream<order> &evictions,
+               ap_uint<1> change_only,
+               stream<book_counters> &counters) {
+    // Level memories: one slot per tick, side and instrument
+    static price_level bid_levels[INSTRUMENTS_PER_BANK][TICKS];
+    static price_level ask_levels[INSTRUMENTS_PER_BANK][TICKS];
+    #pragma HLS BIND_STORAGE variable=bid_levels type=ram_2p impl=uram
+    #pragma HLS BIND_STORAGE variable=ask_levels type=ram_2p impl=uram
+
+    // Occupancy bitmaps: leaves in block RAM, summaries and roots in registers
+    static ap_uint<WORD_BITS> bid_leaf[INSTRUMENTS_PER_BANK][LEAF_WORDS];
+    static ap_uint<WORD_BITS> ask_leaf[INSTRUMENTS_PER_BANK][LEAF_WORDS];
+    static ap_uint<WORD_BITS> bid_summary[INSTRUMENTS_PER_BANK][SUMMARY_WORDS];
+    #pragma HLS ARRAY_PARTITION variable=bid_summary complete dim=2
+    static ap_uint<WORD_BITS> ask_summary[INSTRUMENTS_PER_BANK][SUMMARY_WORDS];
+    #pragma HLS ARRAY_PARTITION variable=ask_summary complete dim=2
+    static ap_uint<SUMMARY_WORDS> bid_root[INSTRUMENTS_PER_BANK];
+    static ap_uint<SUMMARY_WORDS> ask_root[INSTRUMENTS_PER_BANK];
+    // First tick of each instrument's level store window (order_book.hpp)
+    static ap_uint<PRICE_BITS> tick_base[INSTRUMENTS_PER_BANK];
+
+    // Top of book output of each instrument (change-only mode and conflation,
+    // order_book.hpp); the instruments of the bank take turns to flush theirs
+    static bbo_state bbos[INSTRUMENTS_PER_BANK];
+    static unsigned flush_book = 0;
+
+    // Performance counters of the bank: no heaps, so only the per-type counts
+    // and the orders refused outside the window
+    static book_counters live;
+    bbos[flush_book].change_only = change_only;
+    flush_bbo(bbos[flush_book], tops);
+    flush_book = flush_book == INSTRUMENTS_PER_BANK - 1 ? 0 : flush_book + 1;
+
+    if (!order_stream.empty() && !incoming_time.empty() && !incoming_meta.empty() &&
+        (change_only || !tops.full()) &&
+        !executions.full() && !depth.full()) {
+
+        order input = order_stream.read();
+        Time time_buffer = incoming_time.read();
+        metadata meta_buffer = incoming_meta.read();
+        unsigned book = input.instrument / BOOK_BANKS;  // book of the instrument within the bank
+        bbo_state& bbo = bbos[book];
+        bbo.change_only = change_only;
+        bbo.instrument = input.instrument;
+        if (input.direction == LIMIT_BID || input.direction == LIMIT_ASK) {
+            latch_window(tick_base[book], bid_root[book] == 0 && ask_root[book] == 0, input.price);
+        }
+        ap_uint<PRICE_BITS> base = tick_base[book];
+        ap_uint<TICK_BITS> tick = level_tick(input.price, base);
+        bool inside = in_window(input.price, base);
+        ap_uint<32> steps = 0;
+        live.messages[input.direction]++;
+
+        if (input.direction == LIMIT_BID) {
+            // Uncross first; whatever is left rests (level_add skips size 0)
+            sweep_levels<false>(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], base, input, true, executions, steps);
+            if (inside) {
+                level_add(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], tick, input);
+            }
+        } else if (input.direction == LIMIT_ASK) {
+            sweep_levels<true>(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], base, input, true, executions, steps);
+            if (inside) {
+                level_add(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], tick, input);
+            }
+        } else if (input.direction == MARKET_BID) {
+            sweep_levels<false>(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], base, input, false, executions, steps);
+        } else if (input.direction == MARKET_ASK) {
+            sweep_levels<true>(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], base, input, false, executions, steps);
+        } else if (input.direction == REMOVE_BID && inside) {
+            level_cancel(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], tick, input);
+        } else if (input.direction == REMOVE_ASK && inside) {
+            level_cancel(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], tick, input);
+        }
+
+        order best_bid = best_level<true>(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], base, LIMIT_BID);
+        order best_ask = best_level<false>(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], base, LIMIT_ASK);
+        publish_bbo(bbo, true, best_bid, true, best_ask, time_buffer, meta_buffer, tops);
+        publish_depth(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book],
+                      ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book],
+                      base, input.instrument, depth);
+        if ((input.direction == LIMIT_BID || input.direction == LIMIT_ASK) && !inside && input.size != 0) {
+            // Left over outside the window: refused
+            evictions.write(input);
+            live.window_drops++;
+        } else if (input.direction == MODIFY_BID || input.direction == MODIFY_ASK) {
+            evictions.write(input);  // no order to amend: refused
+        }
+        live.loop_cycles[input.direction] += steps;
+    }
+
+    ap_uint<32> suppressed = 0;
+    SUPPRESSED_LOOP:
+    for (int b = 0; b < INSTRUMENTS_PER_BANK; b++) {
+        #pragma HLS UNROLL
+        suppressed += bbos[b].suppressed;
+    }
+    live.suppressed = suppressed;
+    counters.write(live);
+}
+
+// order_book() (order_book.cpp) runs this engine's banks
+template void run_banks<BOOK_BANKS>(stream<order> bank_orders[BOOK_BANKS], stream<Time> bank_time[BOOK_BANKS],
+                                    stream<metadata> bank_meta[BOOK_BANKS], stream<top_of_book> bank_tops[BOOK_BANKS],
+                                    stream<execution> bank_executions[BOOK_BANKS],
+                                    stream<book_depth> bank_depth[BOOK_BANKS], stream<order> bank_evictions[BOOK_BANKS],
+                                    ap_uint<1> change_only, stream<book_counters> bank_counters[BOOK_BANKS]);
+#endif  // BOOK_ENGINE == BOOK_ENGINE_PRICE_LEVEL
@@ -0,0 +1,447 @@
+/*How does this work:
+
+  1.The systolic engine replaces the order heaps of order_book.cpp with a sorted shift register per side
+  (systolic_side, order_book.hpp): SYSTOLIC_CELLS cells, each a packed order_word with the orderID and size beside
+  it, best first by price-time priority, the empty cells (the zero word) at the end. Every cell has its own comparator and only talks to its neighbours, so every
+  operation on a side is one step of all the cells at once instead of a walk down the levels of a heap: insert,
+  cancel and the top of book take the same cycles at any depth of the book.
+
+  2.An insert compares the new word with every cell. The cells it ranks before form the tail of the register; each
+  of them takes the word of its left neighbour and the first one takes the new word, so the register is still sorted
+  after one shift. A side that is full takes no insert: a limit order with size left after matching is refused, goes
+  out on the evictions stream and counts as an overflow drop, and every resting order keeps its place.
+
+  3.A cancel compares the orderID with every cell. A partial cancel takes the size off in place; a full one shifts
+  every cell after the match one place left. An amend is a full cancel followed by an insert of the amended word, so
+  it takes two steps; like the heap engine it sends an order to the back of its price on a new price or a larger
+  size and keeps its place on a smaller size. An amend to a price that crosses the spread is cancelled in the same
+  way and goes on as a limit order with the same orderID (4).
+
+  4.Market orders and limit orders that cross the spread fill against cell 0 of the other side, one fill per step: a
+  partial fill takes its size off cell 0 in place and a full one shifts the register left, with no orderID compare.
+  These are the only loop cycles the engine counts; a limit order with no size left after them does not rest.
+
+  5.The level store, depth stream, change-only top of book, banks and counters are shared with the heap engine
+  (order_book.cpp, price_level_book.cpp); the high-water mark is the fullest a side has been. As there, a limit order
+  outside the level store window is refused and an amend out of it cancels its order.
+
+  Built instead of the heap engine with -DBOOK_ENGINE=BOOK_ENGINE_SYSTOLIC (order_book.hpp).*/
+
+#include "order_book.hpp"
+
+#define MARKET_ASK      0
+#define MARKET_BID      1
+#define LIMIT_ASK       2
+#define LIMIT_BID       3
+#define REMOVE_ASK      4
+#define REMOVE_BID      5
+#define MODIFY_ASK      6
+#define MODIFY_BID      7
+
+// Order held by a cell, for the top of book, executions and level store; an
+// empty cell has size 0
+order cell_order(const systolic_cell& cell, bool is_bid) {
+    #pragma HLS INLINE
+    order o = unpack_price(cell.word, is_bid);
+    o.orderID = cell.orderID;
+    o.size = cell.size;
+    return o;
+}
+
+// Cell of a new resting order: its priority word (the handle is unused) and
+// the orderID and size beside it
+systolic_cell pack_cell(const order& o, bool is_bid, ap_uint<SEQ_BITS> arrival) {
+    #pragma HLS INLINE
+    systolic_cell cell;
+    cell.word = pack_order(o, is_bid, arrival, 0);
+    cell.orderID = o.orderID;
+    cell.size = o.size;
+    return cell;
+}
+
+// Inserts cell into the side in one shift. The side must have room: the last
+// cell is empty, so nothing shifts out of it.
+template <int N>
+void systolic_insert(systolic_side<N>& side, systolic_cell cell) {
+    #pragma HLS INLINE
+    bool before[N];
+    #pragma HLS ARRAY_PARTITION variable=before complete
+    INSERT_COMPARE_LOOP:
+    for (int i = 0; i < N; i++) {
+        #pragma HLS UNROLL
+        before[i] = ranks_before(cell.word, side.cell[i].word);  // an empty cell is the zero word
+    }
+    INSERT_SHIFT_LOOP:
+    for (int i = N - 1; i >= 0; i--) {
+        #pragma HLS UNROLL
+        if (before[i]) {
+            side.cell[i] = (i == 0 || !before[i - 1]) ? cell : side.cell[i - 1];
+        }
+    }
+    side.count = side.count + 1;
+}
+
+// Takes req_size off the order with orderID in one step: in place when some
+// is left, otherwise every cell after it shifts one place left. Returns the
+// order's cell as it rested, the empty cell when it is not in the side.
+template <int N>
+systolic_cell systolic_remove(systolic_side<N>& side, ap_uint<32> orderID, ap_uint<8> req_size) {
+    #pragma HLS INLINE
+    bool match[N], after[N];
+    #pragma HLS ARRAY_PARTITION variable=match complete
+    #pragma HLS ARRAY_PARTITION variable=after complete
+    systolic_cell found = { 0, 0, 0 };
+    bool seen = false;
+    REMOVE_MATCH_LOOP:
+    for (int i = 0; i < N; i++) {
+        #pragma HLS UNROLL
+        match[i] = orderID != 0 && side.cell[i].orderID == orderID;
+        if (match[i]) {
+            found = side.cell[i];
+        }
+        seen = seen || match[i];
+        after[i] = seen;
+    }
+    if (found.word == 0) {
+        return found;
+    }
+    if (req_size < found.size) {
+        REMOVE_REDUCE_LOOP:
+        for (int i = 0; i < N; i++) {
+            #pragma HLS UNROLL
+            if (match[i]) {
+                side.cell[i].size = found.size - req_size;
+            }
+        }
+    } else {
+        systolic_cell empty = { 0, 0, 0 };
+        REMOVE_SHIFT_LOOP:
+        for (int i = 0; i < N; i++) {
+            #pragma HLS UNROLL
+            if (after[i]) {
+                side.cell[i] = i == N - 1 ? empty : side.cell[i + 1];
+            }
+        }
+        side.count = side.count - 1;
+    }
+    return found;
+}
+
+// Takes req_size off cell 0, the best order, in one step: in place when some
+// is left, otherwise every cell shifts one place left. The order is known to
+// be in cell 0, so there is no orderID to compare.
+template <int N>
+void systolic_pop(systolic_side<N>& side, ap_uint<8> req_size) {
+    #pragma HLS INLINE
+    if (req_size < side.cell[0].size) {
+        side.cell[0].size = side.cell[0].size - req_size;
+    } else {
+        systolic_cell empty = { 0, 0, 0 };
+        POP_SHIFT_LOOP:
+        for (int i = 0; i < N; i++) {
+            #pragma HLS UNROLL
+            side.cell[i] = i == N - 1 ? empty : side.cell[i + 1];
+        }
+        side.count = side.count - 1;
+    }
+}
+
+// Amends the price and size of the order with the input's orderID: a full
+// cancel and an insert of the amended cell, two steps. A new size of 0 only
+// cancels. Returns the order's cell as it rested, the empty cell when it is
+// not in the side.
+template <int N>
+systolic_cell systolic_modify(systolic_side<N>& side, order& input, bool is_bid) {
+    #pragma HLS INLINE
+    systolic_cell original = systolic_remove(side, input.orderID, 255);
+    if (original.word != 0 && input.size != 0) {
+        order resting = cell_order(original, is_bid);
+        // A new price or a larger size goes to the back of the queue at its
+        // price; a smaller size keeps its place
+        bool requeue = input.price != resting.price || input.size > resting.size;
+        resting.price = input.price;
+        resting.size = input.size;
+        ap_uint<SEQ_BITS> queued = requeue ? side.arrival : word_arrival(original.word);
+        if (requeue) {
+            side.arrival++;
+        }
+        systolic_insert(side, pack_cell(resting, is_bid, queued));  // the cancel made room
+    }
+    return original;
+}
+
+// Matches an incoming order against the other side, whose best order is
+// always cell 0: every fill takes min(remaining, resting size) off it and is
+// reported on executions, while the incoming order has size left and cell 0
+// is within its limit (a market order has none); steps counts the fills.
+// Each fill reads the cell 0 the one before it shifted in and updates the
+// level store, so the loop is left unpipelined.
+template <int N>
+void sweep_cells(order& input, bool limited, systolic_side<N>& side, bool is_bid,
+                 price_level levels[TICKS], ap_uint<WORD_BITS> leaf[LEAF_WORDS],
+                 ap_uint<WORD_BITS> summary[SUMMARY_WORDS], ap_uint<SUMMARY_WORDS>& root,
+                 ap_uint<PRICE_BITS> base, stream<execution>& executions, ap_uint<32>& steps) {
+    #pragma HLS INLINE
+    SWEEP_CELLS_LOOP:
+    while (input.size > 0 && side.cell[0].word != 0) {
+        #pragma HLS LOOP_TRIPCOUNT max=255
+        steps++;
+        order resting = cell_order(side.cell[0], is_bid);
+        bool within_limit = is_bid ? resting.price >= input.price : resting.price <= input.price;
+        if (limited && !within_limit) {
+            break;
+        }
+        ap_uint<8> fill = input.size < resting.size ? input.size : resting.size;
+        execution report;
+        report.orderID = resting.orderID;
+        report.price = resting.price;
+        report.size = fill;
+        report.instrument = input.instrument;
+        executions.write(report);
+        input.size -= fill;
+        resting.size = fill;
+        level_cancel(levels, leaf, summary, root, level_tick(resting.price, base), resting);
+        systolic_pop(side, fill);
+    }
+}
+
+#if BOOK_ENGINE == BOOK_ENGINE_SYSTOLIC
+// One bank of the systolic engine: the books of the instruments routed to
+// BANK, each with its own shift registers and level memories
+template <int BANK>
+void book_bank(stream<order> &order_stream,
+               stream<Time> &incoming_time,
+               stream<metadata> &incoming_meta,
+               stream<top_of_book> &tops,
+               stream<execution> &executions,
+               stream<book_depth> &depth,
+               stream<order> &evictions,
+               ap_uint<1> change_only,
+               stream<book_counters> &counters) {
+    // Shift registers of each side and instrument (zero-initialized: every
+    // cell starts empty), every cell a register of its own
+    static systolic_side<SYSTOLIC_CELLS> bid_books[INSTRUMENTS_PER_BANK];
+    #pragma HLS ARRAY_PARTITION variable=bid_books.cell complete dim=2
+    static systolic_side<SYSTOLIC_CELLS> ask_books[INSTRUMENTS_PER_BANK];
+    #pragma HLS ARRAY_PARTITION variable=ask_books.cell complete dim=2
+
+    // Size aggregated per price tick of each side and instrument, for the
+    // depth stream
+    static price_level bid_levels[INSTRUMENTS_PER_BANK][TICKS];
+    static price_level ask_levels[INSTRUMENTS_PER_BANK][TICKS];
+    #pragma HLS BIND_STORAGE variable=bid_levels type=ram_2p impl=uram
+    #pragma HLS BIND_STORAGE variable=ask_levels type=ram_2p impl=uram
+    static ap_uint<WORD_BITS> bid_leaf[INSTRUMENTS_PER_BANK][LEAF_WORDS];
+    static ap_uint<WORD_BITS> ask_leaf[INSTRUMENTS_PER_BANK][LEAF_WORDS];
+    static ap_uint<WORD_BITS> bid_summary[INSTRUMENTS_PER_BANK][SUMMARY_WORDS];
+    #pragma HLS ARRAY_PARTITION variable=bid_summary complete dim=2
+    static ap_uint<WORD_BITS> ask_summary[INSTRUMENTS_PER_BANK][SUMMARY_WORDS];
+    #pragma HLS ARRAY_PARTITION variable=ask_summary complete dim=2
+    static ap_uint<SUMMARY_WORDS> bid_root[INSTRUMENTS_PER_BANK];
+    static ap_uint<SUMMARY_WORDS> ask_root[INSTRUMENTS_PER_BANK];
+    // First tick of each instrument's level store window (order_book.hpp)
+    static ap_uint<PRICE_BITS> tick_base[INSTRUMENTS_PER_BANK];
+
+    // Top of book output of each instrument (change-only mode and conflation,
+    // order_book.hpp); the instruments of the bank take turns to flush theirs
+    static bbo_state bbos[INSTRUMENTS_PER_BANK];
+    static unsigned flush_book = 0;
+
+    // Performance counters of the bank, summed over its books
+    static book_counters live;
+    bbos[flush_book].change_only = change_only;
+    flush_bbo(bbos[flush_book], tops);
+    flush_book = flush_book == INSTRUMENTS_PER_BANK - 1 ? 0 : flush_book + 1;
+
+    if (!order_stream.empty() && !incoming_time.empty() && !incoming_meta.empty() &&
+        (change_only || !tops.full()) &&
+        !executions.full() && !depth.full()) {
+
+        order input = order_stream.read();
+        Time time_buffer = incoming_time.read();
+        metadata meta_buffer = incoming_meta.read();
+        unsigned book = input.instrument / BOOK_BANKS;  // book of the instrument within the bank
+        systolic_side<SYSTOLIC_CELLS>& bids = bid_books[book];
+        systolic_side<SYSTOLIC_CELLS>& asks = ask_books[book];
+        bbo_state& bbo = bbos[book];
+        bbo.change_only = change_only;
+        bbo.instrument = input.instrument;
+        if (input.direction == LIMIT_BID || input.direction == LIMIT_ASK) {
+            latch_window(tick_base[book], bid_root[book] == 0 && ask_root[book] == 0, input.price);
+        }
+        ap_uint<PRICE_BITS> base = tick_base[book];
+        ap_uint<TICK_BITS> tick = level_tick(input.price, base);
+        bool inside = in_window(input.price, base);
+        ap_uint<32> bid_count = bids.count, ask_count = asks.count;
+        ap_uint<32> steps = 0;
+        bool overflow = false;
+        bool outside = false;
+        order evicted;
+        evicted.size = 0;
+        bool rested = false;
+        ap_uint<3> type = input.direction;
+
+        // An amend to a price that crosses the spread is matched as a limit
+        // order: its cell is cancelled and the amended order comes in with
+        // the same orderID, so the book is never left crossed
+        if (input.direction == MODIFY_BID && input.size != 0 && asks.cell[0].word != 0 &&
+            input.price >= cell_order(asks.cell[0], false).price) {
+            systolic_cell original = systolic_remove(bids, input.orderID, 255);
+            if (original.word != 0) {
+                order previous = cell_order(original, true);
+                level_cancel(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book],
+                             level_tick(previous.price, base), previous);
+                input.direction = LIMIT_BID;
+            }
+        } else if (input.direction == MODIFY_ASK && input.size != 0 && bids.cell[0].word != 0 &&
+                   input.price <= cell_order(bids.cell[0], true).price) {
+            systolic_cell original = systolic_remove(asks, input.orderID, 255);
+            if (original.word != 0) {
+                order previous = cell_order(original, false);
+                level_cancel(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book],
+                             level_tick(previous.price, base), previous);
+                input.direction = LIMIT_ASK;
+            }
+        }
+
+        if (input.direction == LIMIT_BID) {
+            // Uncross first; a bid with no size left, filled or sent without
+            // any, does not rest
+            sweep_cells(input, true, asks, false, ask_levels[book], ask_leaf[book], ask_summary[book],
+                        ask_root[book], base, executions, steps);
+            bool left_over = input.size != 0;
+            if (left_over && !inside) {  // no level to rest at: refused
+                outside = true;
+                evicted = input;
+            } else if (left_over && bids.count == SYSTOLIC_CELLS) {  // no cell to rest in: refused
+                overflow = true;
+                evicted = input;
+            } else if (left_over) {
+                level_add(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], tick, input);
+                systolic_insert(bids, pack_cell(input, true, bids.arrival));
+                bids.arrival++;
+                rested = true;
+            }
+        } else if (input.direction == LIMIT_ASK) {
+            sweep_cells(input, true, bids, true, bid_levels[book], bid_leaf[book], bid_summary[book],
+                        bid_root[book], base, executions, steps);
+            bool left_over = input.size != 0;
+            if (left_over && !inside) {  // no level to rest at: refused
+                outside = true;
+                evicted = input;
+            } else if (left_over && asks.count == SYSTOLIC_CELLS) {
+                overflow = true;
+                evicted = input;
+            } else if (left_over) {
+                level_add(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], tick, input);
+                systolic_insert(asks, pack_cell(input, false, asks.arrival));
+                asks.arrival++;
+                rested = true;
+            }
+        } else if (input.direction == MARKET_BID) {
+            sweep_cells(input, false, asks, false, ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book],
+                        base, executions, steps);
+        } else if (input.direction == MARKET_ASK) {
+            sweep_cells(input, false, bids, true, bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book],
+                        base, executions, steps);
+        } else if (input.direction == REMOVE_BID || input.direction == MODIFY_BID) {
+            outside = input.direction == MODIFY_BID && input.size != 0 && !inside;
+            if (outside) {  // no level to move to: the amend cancels the order
+                input.size = 0;
+            }
+            systolic_cell original = input.direction == REMOVE_BID ? systolic_remove(bids, input.orderID, input.size)
+                                                                   : systolic_modify(bids, input, true);
+            if (original.word != 0) {
+                order previous = cell_order(original, true);
+                if (input.direction == REMOVE_BID && input.size < previous.size) {
+                    previous.size = input.size;
+                }
+                level_cancel(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book],
+                             level_tick(previous.price, base), previous);
+                if (outside) {
+                    evicted = previous;
+                }
+                if (input.direction == MODIFY_BID) {  // the amended order moves to its new level
+                    level_add(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book], tick, input);
+                }
+            }
+        } else if (input.direction == REMOVE_ASK || input.direction == MODIFY_ASK) {
+            outside = input.direction == MODIFY_ASK && input.size != 0 && !inside;
+            if (outside) {  // no level to move to: the amend cancels the order
+                input.size = 0;
+            }
+            systolic_cell original = input.direction == REMOVE_ASK ? systolic_remove(asks, input.orderID, input.size)
+                                                                   : systolic_modify(asks, input, false);
+            if (original.word != 0) {
+                order previous = cell_order(original, false);
+                if (input.direction == REMOVE_ASK && input.size < previous.size) {
+                    previous.size = input.size;
+                }
+                level_cancel(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book],
+                             level_tick(previous.price, base), previous);
+                if (outside) {
+                    evicted = previous;
+                }
+                if (input.direction == MODIFY_ASK) {
+                    level_add(ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book], tick, input);
+                }
+            }
+        }
+
+        // The top of book is cell 0 of each side, reported as the heap engine
+        // does: both sides after an order rests, otherwise the sides that are
+        // not empty or have just been emptied, and only its own side for a
+        // cancel or amend
+        bool update_bid = rested || bids.cell[0].word != 0 || bbo.bid.size != 0;
+        bool update_ask = rested || asks.cell[0].word != 0 || bbo.ask.size != 0;
+        if (input.direction == REMOVE_BID || input.direction == MODIFY_BID) {
+            update_ask = false;
+        } else if (input.direction == REMOVE_ASK || input.direction == MODIFY_ASK) {
+            update_bid = false;
+        }
+        publish_bbo(bbo, update_bid, cell_order(bids.cell[0], true), update_ask, cell_order(asks.cell[0], false),
+                    time_buffer, meta_buffer, tops);
+        publish_depth(bid_levels[book], bid_leaf[book], bid_summary[book], bid_root[book],
+                      ask_levels[book], ask_leaf[book], ask_summary[book], ask_root[book],
+                      base, input.instrument, depth);
+        if (evicted.size != 0) {
+            evicted.instrument = input.instrument;
+            evictions.write(evicted);
+        }
+
+        // The counters follow the change to the one book the order touched
+        live.bid_orders += ap_uint<32>(bids.count) - bid_count;
+        live.ask_orders += ap_uint<32>(asks.count) - ask_count;
+        if (bids.count > live.bid_high_water) {
+            live.bid_high_water = bids.count;
+        }
+        if (asks.count > live.ask_high_water) {
+            live.ask_high_water = asks.count;
+        }
+        if (overflow) {
+            live.overflow_drops++;
+        }
+        if (outside && evicted.size != 0) {
+            live.window_drops++;
+        }
+        live.messages[type]++;
+        live.loop_cycles[type] += steps;
+    }
+
+    ap_uint<32> suppressed = 0;
+    SUPPRESSED_LOOP:
+    for (int b = 0; b < INSTRUMENTS_PER_BANK; b++) {
+        #pragma HLS UNROLL
+        suppressed += bbos[b].suppressed;
+    }
+    live.suppressed = suppressed;
+    counters.write(live);
+}
+
+// order_book() (order_book.cpp) runs this engine's banks
+template void run_banks<BOOK_BANKS>(stream<order> bank_orders[BOOK_BANKS], stream<Time> bank_time[BOOK_BANKS],
+                                    stream<metadata> bank_meta[BOOK_BANKS], stream<top_of_book> bank_tops[BOOK_BANKS],
+                                    stream<execution> bank_executions[BOOK_BANKS],
+                                    stream<book_depth> bank_depth[BOOK_BANKS], stream<order> bank_evictions[BOOK_BANKS],
+                                    ap_uint<1> change_only, stream<book_counters> bank_counters[BOOK_BANKS]);
+#endif  // BOOK_ENGINE == BOOK_ENGINE_SYSTOLIC
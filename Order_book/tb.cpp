@@ -2,6 +2,10 @@
 #include <fstream>
 #include <chrono>
 #include <string>
+#include <map>
+#include <vector>
+#include <random>
+#include <algorithm>
 #include "order_book.hpp"
 
 using namespace std;
@@ -9,14 +13,252 @@ using namespace hls;
 
 string directionToString(ap_uint<3> direction) {
     switch (direction.to_uint()) { 
+        case 0: return "MARKET_ASK";
+        case 1: return "MARKET_BID";
         case 2: return "ASK";
         case 3: return "BID";
         case 4: return "REMOVE_ASK";
         case 5: return "REMOVE_BID";
+        case 6: return "MODIFY_ASK";
+        case 7: return "MODIFY_BID";
         default: return "UNKNOWN";
     }
 }
 
+// Best resting order of the reference book: highest bid / lowest ask, the
+// lower orderID on a tie; 0 when the side is empty
+unsigned reference_best(map<unsigned, order>& orders, bool bid_side) {
+    unsigned best = 0;
+    for (map<unsigned, order>::iterator it = orders.begin(); it != orders.end(); ++it) {
+        if (best == 0 || (bid_side ? it->second.price > orders[best].price : it->second.price < orders[best].price)) {
+            best = it->first;
+        }
+    }
+    return best;
+}
+
+// Reference matching of the heap engine: fills `incoming` against the resting
+// orders of the opposite side, best first, while it has size left and the
+// best order is within its limit
+void reference_match(map<unsigned, order>& resting, bool bid_side, order& incoming, bool limited,
+                     vector<execution>& fills) {
+    while (incoming.size > 0 && !resting.empty()) {
+        unsigned best = reference_best(resting, bid_side);
+        order& top = resting[best];
+        if (limited && (bid_side ? top.price < incoming.price : top.price > incoming.price)) {
+            break;
+        }
+        execution fill = { top.orderID, top.price, incoming.size < top.size ? incoming.size : top.size, incoming.instrument };
+        fills.push_back(fill);
+        incoming.size -= fill.size;
+        if (fill.size == top.size) {
+            resting.erase(best);
+        } else {
+            top.size -= fill.size;
+        }
+    }
+}
+
+// Same for the price-level engine, level by level; the orderID of a fill is
+// not modelled
+void reference_match_levels(map<unsigned, unsigned>& levels, bool bid_side, order& incoming, bool limited,
+                            vector<execution>& fills) {
+    while (incoming.size > 0 && !levels.empty()) {
+        unsigned tick = bid_side ? levels.rbegin()->first : levels.begin()->first;
+        if (limited && (bid_side ? tick < incoming.price.range(15, 0).to_uint()
+                                 : tick > incoming.price.range(15, 0).to_uint())) {
+            break;
+        }
+        execution fill;
+        fill.orderID = 0;
+        fill.price.range(15, 0) = tick;
+        fill.size = min(levels[tick], (unsigned)incoming.size.to_uint());
+        fills.push_back(fill);
+        incoming.size -= fill.size;
+        if (fill.size == levels[tick]) {
+            levels.erase(tick);
+        } else {
+            levels[tick] -= fill.size.to_uint();
+        }
+    }
+}
+
+// Drains executions and compares them with the expected fills
+bool check_executions(stream<execution>& executions, vector<execution>& expected, bool check_ids, unsigned order_number) {
+    bool match = executions.size() == expected.size();
+    for (unsigned f = 0; match && f < expected.size(); f++) {
+        execution fill = executions.read();
+        match = fill.price == expected[f].price && fill.size == expected[f].size &&
+                (!check_ids || fill.orderID == expected[f].orderID);
+    }
+    if (!match) {
+        std::cout << "ERROR executions: order " << order_number << " expected " << expected.size() << " fills\n";
+    }
+    while (!executions.empty()) { executions.read(); }
+    return match;
+}
+
+// Compares one side of a depth snapshot with the best DEPTH_LEVELS levels of
+// the reference (size per tick)
+bool check_depth_side(depth_level side[DEPTH_LEVELS], map<unsigned, unsigned>& levels, bool bid_side) {
+    map<unsigned, unsigned>::iterator up = levels.begin();
+    map<unsigned, unsigned>::reverse_iterator down = levels.rbegin();
+    for (unsigned d = 0; d < DEPTH_LEVELS; d++) {
+        unsigned tick = 0, size = 0;
+        if (bid_side ? down != levels.rend() : up != levels.end()) {
+            tick = bid_side ? down->first : up->first;
+            size = bid_side ? down->second : up->second;
+            if (bid_side) { ++down; } else { ++up; }
+        }
+        if (side[d].price.range(15, 0).to_uint() != tick || side[d].size != size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads one depth snapshot and compares both sides with the reference
+bool check_depth(stream<book_depth>& depth, map<unsigned, unsigned>& bids, map<unsigned, unsigned>& asks,
+                 unsigned order_number) {
+    if (depth.size() != 1) {
+        std::cout << "ERROR depth: order " << order_number << " wrote " << depth.size() << " snapshots\n";
+        return false;
+    }
+    book_depth snapshot = depth.read();
+    if (!check_depth_side(snapshot.bid, bids, true) || !check_depth_side(snapshot.ask, asks, false)) {
+        std::cout << "ERROR depth: order " << order_number << " best bid level " << snapshot.bid[0].price << " x "
+                  << snapshot.bid[0].size << ", best ask level " << snapshot.ask[0].price << " x "
+                  << snapshot.ask[0].size << "\n";
+        return false;
+    }
+    return true;
+}
+
+// The n-th orderID (counting from 1) that the heap engine puts in lane
+// (lane_of, order_book.cpp)
+unsigned lane_member(unsigned lane, unsigned n) {
+    unsigned id = 0;
+    while (n != 0) {
+        id++;
+        if (lane_of(id) == lane) {
+            n--;
+        }
+    }
+    return id;
+}
+
+// A random nonzero 32-bit orderID that does not rest in the book (live)
+unsigned random_order_id(mt19937& rng, map<unsigned, bool>& live) {
+    unsigned id = 0;
+    while (id == 0 || live.count(id)) {
+        id = rng();
+    }
+    return id;
+}
+
+// Size per tick of the resting orders of the heap engine's reference book
+map<unsigned, unsigned> reference_levels(map<unsigned, order>& orders) {
+    map<unsigned, unsigned> levels;
+    for (map<unsigned, order>::iterator it = orders.begin(); it != orders.end(); ++it) {
+        if (it->second.size != 0) {
+            levels[it->second.price.range(15, 0).to_uint()] += it->second.size.to_uint();
+        }
+    }
+    return levels;
+}
+
+// Software reference matching engine for the randomized flows: price-time
+// priority by arrival, whatever the orderIDs. As in the book, an amend to a
+// new price or a larger size goes to the back of its price
+struct reference_engine {
+    map<unsigned, order> orders[2];         // [0] asks, [1] bids, by orderID
+    map<unsigned, unsigned> arrival[2];     // arrival number of each resting order
+    unsigned next_arrival;
+    unsigned capacity;                      // resting orders per side, 0 for no limit
+    vector<order> evicted;                  // limit orders refused by a full side
+};
+
+// Best resting order of one side: better price, then earlier arrival; 0 when
+// the side is empty
+unsigned engine_best(reference_engine& engine, bool bid_side) {
+    map<unsigned, order>& orders = engine.orders[bid_side];
+    map<unsigned, unsigned>& arrival = engine.arrival[bid_side];
+    unsigned best = 0;
+    for (map<unsigned, order>::iterator it = orders.begin(); it != orders.end(); ++it) {
+        order& a = it->second;
+        bool before = best == 0 ||
+            (a.price != orders[best].price ? (bid_side ? a.price > orders[best].price : a.price < orders[best].price)
+                                           : arrival[it->first] < arrival[best]);
+        if (before) {
+            best = it->first;
+        }
+    }
+    return best;
+}
+
+// Applies one order of any type to the reference engine; fills go to `fills`
+// and a full side refuses what is left of a limit order rather than rest it.
+// An amend that crosses the spread cancels its order and comes in as a limit
+// order with the same orderID.
+void engine_apply(reference_engine& engine, order incoming, vector<execution>& fills) {
+    unsigned type = incoming.direction.to_uint();
+    bool bid_side = type % 2 == 1;
+    unsigned id = incoming.orderID.to_uint();
+    map<unsigned, order>& own = engine.orders[bid_side];
+    map<unsigned, unsigned>& own_arrival = engine.arrival[bid_side];
+    unsigned best_other = engine_best(engine, !bid_side);
+    if (type >= 6 && own.count(id) && incoming.size != 0 && best_other != 0 &&
+        (bid_side ? incoming.price >= engine.orders[!bid_side][best_other].price
+                  : incoming.price <= engine.orders[!bid_side][best_other].price)) {
+        own.erase(id);
+        own_arrival.erase(id);
+        type -= 4;
+        incoming.direction = type;
+    }
+    if (type < 4) {  // market or limit: match the other side first
+        bool limited = type >= 2;
+        map<unsigned, order>& other = engine.orders[!bid_side];
+        while (incoming.size > 0 && !other.empty()) {
+            unsigned best = engine_best(engine, !bid_side);
+            order& top = other[best];
+            if (limited && (bid_side ? top.price > incoming.price : top.price < incoming.price)) {
+                break;
+            }
+            execution fill = { top.orderID, top.price, incoming.size < top.size ? incoming.size : top.size, incoming.instrument };
+            fills.push_back(fill);
+            incoming.size -= fill.size;
+            if (fill.size == top.size) {
+                other.erase(best);
+                engine.arrival[!bid_side].erase(best);
+            } else {
+                top.size -= fill.size;
+            }
+        }
+        if (limited && incoming.size > 0) {
+            if (engine.capacity != 0 && own.size() >= engine.capacity) {
+                engine.evicted.push_back(incoming);
+            } else {
+                own[id] = incoming;
+                own_arrival[id] = engine.next_arrival++;
+            }
+        }
+    } else if (own.count(id)) {
+        order& resting = own[id];
+        if (type < 6 ? resting.size <= incoming.size : incoming.size == 0) {  // cancelled
+            own.erase(id);
+            own_arrival.erase(id);
+        } else if (type < 6) {
+            resting.size -= incoming.size;
+        } else {
+            if (incoming.price != resting.price || incoming.size > resting.size) {
+                own_arrival[id] = engine.next_arrival++;
+            }
+            resting.price = incoming.price;
+            resting.size = incoming.size;
+        }
+    }
+}
+
 void order_book(stream<order> &order_stream,
                 stream<Time> &incoming_time,
                 stream<metadata> &incoming_meta,
@@ -25,13 +267,23 @@ void order_book(stream<order> &order_stream,
                 stream<Time> &outgoing_time,
                 stream<metadata> &outgoing_meta,
                 ap_uint<32> &top_bid_id,
-                ap_uint<32> &top_ask_id);
+                ap_uint<32> &top_ask_id,
+                stream<execution> &executions,
+                stream<book_depth> &depth,
+                stream<order> &evictions,
+                ap_uint<1> change_only,
+                ap_uint<32> &suppressed_updates,
+                ap_uint<1> snapshot,
+                book_counters &counters);
 int main() {
 	//Output data-structures
 	stream<order> top_bid_stream;
 	stream<order> top_ask_stream;
 	stream<Time> outgoing_time;
 	stream<metadata> outgoing_meta;
+	stream<execution> executions;
+	stream<book_depth> depth;
+	stream<order> evictions;
 	order top_bid;
 	order top_ask;
 	Time out_time;
@@ -49,6 +301,9 @@ int main() {
 	//AXI-Lite
 	ap_uint<32> top_bid_id;
 	ap_uint<32> top_ask_id;
+	ap_uint<32> suppressed_updates;
+	ap_uint<1> snapshot = 0;
+	book_counters counters = {};
 
     ap_ufixed<16, 8> testprices [544] = {23.79, 32.73, 24.17, 23.26, 25.79, 24.84, 27.22, 25.85, 26.63, 27.53, 25.03, 29.46, 27.35, 27.56, 30.70, 25.07, 25.20, 31.65, 30.90, 31.00, 29.79, 26.20, 32.84, 32.14, 28.78, 28.34, 26.14, 24.10, 28.94, 24.58, 32.02, 26.23, 31.00, 24.10, 25.20, 30.53, 29.46, 29.51, 30.70, 30.53, 27.53, 29.23, 26.36, 32.84, 27.22, 25.73, 29.51, 25.96, 21.07, 30.90, 26.63, 29.88, 33.50, 23.26, 34.29, 24.58, 31.65, 32.14, 25.73, 25.82, 28.94, 26.12, 25.96, 33.50, 26.23, 29.88, 26.33, 25.07, 26.12, 32.73, 27.30, 26.36, 27.56, 27.78, 31.53, 26.20, 27.53, 28.34, 24.84, 31.17, 26.19, 28.27, 26.33, 27.35, 29.79, 33.91, 26.81, 27.59, 33.91, 28.27, 27.59, 26.81, 27.56, 28.78, 29.30, 26.21, 32.25, 26.21, 27.78, 26.79, 22.37, 27.83, 32.02, 27.83, 28.56, 24.71, 25.99, 22.37, 26.79, 29.37, 25.99, 31.53, 21.07, 26.14, 29.53, 25.03, 28.02, 23.99, 32.25, 26.42, 27.53, 29.23, 29.53, 26.19, 24.29, 28.56, 24.17, 25.79, 28.37, 23.99, 29.37, 25.82, 26.42, 24.71, 25.85, 23.02, 28.69, 29.17, 29.17, 29.04, 23.79, 31.22, 23.02, 28.37, 28.02, 28.69, 27.56, 29.04, 24.71, 31.17, 27.30, 29.82, 29.82, 19.67, 23.38, 26.31, 24.71, 26.43, 33.41, 25.33, 19.67, 23.38, 33.41, 24.73, 29.30, 26.31, 31.22, 25.33, 26.43, 24.73, 27.92, 14.04, 27.92, 14.04, 21.39, 21.39, 27.11, 27.11, 29.27, 33.20, 24.77, 28.10, 21.51, 25.00, 25.00, 28.22, 27.05, 21.51, 33.20, 29.27, 27.05, 28.22, 28.10, 26.26, 24.77, 26.26, 28.58, 25.46, 28.63, 25.42, 25.42, 23.62, 23.62, 28.63, 25.46, 28.58, 25.06, 24.34, 31.98, 30.37, 29.10, 30.67, 24.34, 28.52, 26.63, 26.63, 32.15, 30.98, 31.98, 26.26, 25.04, 23.32, 22.49, 27.01, 25.04, 30.67, 25.06, 23.32, 29.10, 21.53, 23.21, 29.41, 30.96, 23.21, 28.52, 28.92, 29.84, 30.96, 29.50, 30.98, 28.92, 26.13, 24.38, 26.26, 27.08, 24.42, 28.38, 26.13, 26.66, 27.01, 28.85, 28.21, 27.08, 26.44, 27.42, 24.26, 28.85, 31.06, 31.25, 29.50, 30.37, 29.41, 30.61, 27.41, 31.06, 27.86, 28.20, 24.42, 26.44, 23.97, 28.20, 27.26, 27.42, 21.53, 23.97, 25.99, 27.41, 28.41, 29.84, 28.38, 24.26, 31.87, 32.94, 30.35, 30.23, 27.91, 30.61, 28.41, 22.72, 28.73, 24.53, 23.97, 30.35, 22.72, 28.61, 30.23, 23.97, 26.70, 28.38, 21.11, 22.99, 31.25, 27.86, 26.66, 27.91, 28.10, 32.15, 24.53, 31.87, 27.26, 28.61, 25.99, 28.38, 22.50, 28.83, 26.70, 23.88, 32.34, 22.99, 23.88, 27.15, 23.74, 26.62, 34.11, 28.83, 30.27, 26.71, 27.01, 26.62, 29.60, 29.24, 30.86, 25.25, 32.90, 30.43, 21.48, 28.24, 28.73, 29.60, 27.69, 34.00, 32.90, 22.50, 23.74, 27.69, 27.20, 28.21, 30.43, 27.01, 24.05, 27.20, 26.35, 23.92, 31.72, 31.44, 27.72, 23.92, 27.66, 25.25, 25.83, 27.42, 24.05, 29.21, 28.10, 31.49, 30.27, 22.70, 31.81, 29.54, 25.38, 29.21, 26.78, 32.34, 27.06, 26.96, 26.70, 32.94, 31.44, 27.06, 25.31, 27.15, 36.56, 29.79, 29.54, 27.17, 27.47, 24.28, 25.96, 28.21, 31.49, 27.99, 24.28, 22.62, 28.21, 28.50, 22.62, 28.52, 21.11, 28.91, 29.79, 28.91, 28.78, 28.31, 28.52, 27.17, 27.94, 22.71, 29.00, 25.08, 28.71, 29.39, 27.99, 29.20, 25.83, 29.75, 31.13, 28.39, 28.78, 22.71, 24.38, 31.04, 22.49, 26.16, 26.59, 29.44, 26.80, 26.78, 20.53, 27.66, 28.39, 32.47, 29.20, 25.88, 28.95, 27.47, 27.94, 31.81, 25.31, 29.48, 30.86, 26.35, 25.60, 28.71, 34.11, 25.49, 25.96, 26.59, 26.90, 25.43, 23.21, 27.25, 30.58, 25.71, 29.41, 31.18, 29.48, 29.56, 26.56, 31.32, 25.43, 22.70, 28.95, 31.06, 31.13, 26.57, 21.01, 26.96, 29.41, 27.01, 28.57, 28.57, 26.13, 23.99, 25.53, 24.96, 23.99, 28.30, 26.90, 32.47, 31.32, 25.60, 25.38, 31.93, 23.70, 31.06, 24.81, 34.11, 28.77, 34.11, 22.94, 34.00, 20.22, 21.01, 26.48, 30.11, 29.66, 23.67, 26.48, 27.44, 24.58, 27.72, 31.17, 31.62, 31.18, 29.61, 26.70, 26.57, 30.11, 26.54, 23.21, 27.66, 25.71, 24.68, 23.67, 27.25, 24.75, 29.44, 20.53, 28.77, 23.73, 27.68, 26.83, 29.56, 28.71, 31.30, 25.08, 29.75, 26.71, 48.19, 27.01, 37.43, 24.68, 30.18, 24.18, 25.49, 31.04, 28.31, 27.31, 24.46, 37.43, 26.28, 13.45, 30.58, 31.72, };
     ap_uint<3> testtypes [544] = {3, 2, 3, 3, 2, 2, 2, 3, 2, 3, 3, 2, 3, 2, 3, 3, 2, 3, 3, 3, 2, 2, 3, 2, 2, 3, 2, 2, 3, 3, 3, 3, 5, 4, 4, 2, 4, 2, 5, 4, 5, 3, 2, 5, 4, 2, 4, 3, 3, 5, 4, 2, 3, 5, 3, 5, 5, 4, 4, 3, 5, 2, 5, 5, 5, 4, 2, 5, 4, 4, 2, 4, 3, 2, 3, 4, 3, 5, 4, 2, 3, 2, 4, 5, 4, 3, 3, 3, 5, 4, 5, 5, 4, 4, 2, 3, 2, 5, 4, 3, 2, 3, 5, 5, 3, 2, 3, 4, 5, 2, 5, 5, 5, 4, 2, 5, 2, 2, 4, 2, 5, 5, 4, 5, 5, 5, 5, 4, 2, 4, 4, 5, 4, 4, 5, 2, 3, 3, 5, 2, 5, 3, 4, 4, 4, 5, 5, 4, 3, 4, 4, 2, 4, 3, 3, 3, 5, 3, 3, 2, 5, 5, 5, 2, 4, 5, 5, 4, 5, 4, 3, 2, 5, 4, 3, 5, 2, 4, 2, 2, 2, 2, 2, 3, 5, 2, 2, 4, 4, 4, 4, 4, 4, 2, 4, 4, 2, 2, 2, 2, 4, 2, 4, 4, 4, 4, 3, 3, 2, 2, 3, 3, 5, 2, 3, 5, 3, 3, 4, 3, 3, 3, 2, 3, 5, 5, 5, 5, 5, 3, 3, 3, 2, 5, 4, 2, 3, 4, 2, 5, 4, 3, 3, 5, 3, 3, 3, 5, 2, 5, 3, 3, 5, 2, 3, 3, 5, 3, 3, 4, 4, 5, 3, 3, 5, 2, 2, 5, 4, 3, 4, 3, 5, 5, 5, 2, 5, 3, 5, 5, 5, 3, 3, 2, 2, 3, 5, 5, 2, 2, 2, 3, 4, 4, 3, 4, 5, 3, 2, 3, 2, 5, 4, 4, 5, 2, 5, 4, 5, 5, 5, 4, 4, 3, 3, 5, 2, 2, 4, 4, 2, 2, 2, 2, 5, 2, 2, 3, 4, 2, 2, 2, 3, 2, 2, 3, 4, 4, 4, 2, 3, 4, 5, 4, 4, 3, 5, 4, 5, 3, 5, 2, 3, 3, 3, 2, 5, 2, 5, 3, 3, 5, 3, 4, 3, 4, 3, 2, 3, 2, 5, 2, 4, 3, 2, 3, 5, 5, 5, 2, 4, 3, 3, 5, 2, 2, 3, 3, 2, 5, 2, 5, 3, 4, 2, 5, 3, 5, 2, 5, 4, 3, 3, 5, 4, 3, 3, 2, 2, 2, 2, 4, 3, 5, 3, 3, 2, 5, 5, 5, 3, 4, 3, 2, 2, 2, 4, 3, 4, 4, 3, 5, 3, 3, 4, 5, 4, 4, 3, 4, 4, 3, 3, 4, 2, 5, 4, 2, 2, 2, 3, 3, 3, 3, 2, 5, 2, 5, 3, 4, 5, 5, 3, 5, 2, 2, 4, 5, 2, 2, 4, 3, 3, 2, 3, 5, 2, 4, 5, 5, 5, 4, 3, 2, 5, 3, 2, 2, 4, 3, 5, 3, 4, 2, 3, 2, 2, 4, 2, 3, 4, 2, 2, 4, 3, 5, 4, 5, 3, 4, 3, 5, 3, 4, 5, 3, 4, 5, 2, 2, 3, 2, 4, 5, 3, 4, 5, 4, 3, 4, 3, 5, 3, 3, 4, 5, 5, 2, 3, 5, 2, 2, 5, 5, };
@@ -63,19 +318,19 @@ int main() {
     3,
     3,
     3,
-    8,
-    8,
-    10,
-    10,
-    10,
-    10,
-    10,
-    15,
+    3,
+    3,
+    3,
+    11,
+    11,
+    11,
+    11,
     15,
     15,
-    18,
-    18,
-    18  
+    16,
+    16,
+    19,
+    20  
 };
 
    ap_uint<32> expected_top_ask_ids[20] = {
@@ -86,19 +341,19 @@ int main() {
     5,
     6,
     6,
-    6,
-    6,
-    6,
-    6,
-    6,
-    6,
-    6,
-    6,
-    6,
-    6,
-    6,
-    6,
-    6  
+    5,
+    5,
+    5,
+    5,
+    5,
+    9,
+    9,
+    2,
+    2,
+    17,
+    17,
+    2,
+    2  
 };
 
 
@@ -111,6 +366,7 @@ int main() {
         test.size = testsizes[i];
         test.orderID = testids[i];
         test.direction = testtypes[i];
+        test.instrument = 0;
         test_stream.write(test);
         test_time.write(t);
         test_meta.write(temp_meta);
@@ -118,7 +374,7 @@ int main() {
         auto start_time = chrono::high_resolution_clock::now();
 
         // Call the order_book function
-        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
 
         auto end_time = chrono::high_resolution_clock::now();
         chrono::duration<double, std::micro> latency = end_time - start_time;
@@ -153,6 +409,8 @@ int main() {
         while (!top_ask_stream.empty()) { top_ask_stream.read(); }
         while (!outgoing_time.empty()) { outgoing_time.read(); }
         while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        while (!executions.empty()) { executions.read(); }
+        while (!depth.empty()) { depth.read(); }
 
         std::cout << "Test Case " << i + 1 << ":\n";
         std::cout << "Price: " << test.price << ", Size: " << test.size << ", Order ID: " << test.orderID << ", Direction: " << directionToString(test.direction) << "\n";
@@ -164,5 +422,1368 @@ int main() {
 
     double correction_rate = static_cast<double>(correct_predictions) / 20 * 100;
     std::cout << "Correction Rate: " << correction_rate << "%\n";
+
+    // The rest of the orders are checked against a reference book: the heap
+    // engine cancels and reduces orders by orderID, the price-level engine
+    // keeps the size aggregated per price. Limit orders that cross the spread
+    // are matched first in both, and every fill must come out on executions.
+    map<unsigned, order> ref_bid_orders, ref_ask_orders;
+    map<unsigned, unsigned> ref_bids, ref_asks;
+    for (unsigned int i = 0; i < 544; i++) {
+        bool bid_side = testtypes[i] == 3 || testtypes[i] == 5;
+        bool insert = testtypes[i] == 2 || testtypes[i] == 3;
+        unsigned tick = testprices[i].range(15, 0).to_uint();
+        map<unsigned, order>& orders = bid_side ? ref_bid_orders : ref_ask_orders;
+        map<unsigned, unsigned>& levels = bid_side ? ref_bids : ref_asks;
+        order incoming = { testprices[i], testsizes[i], testids[i], testtypes[i], 0 };
+        vector<execution> order_fills, level_fills;
+        if (insert) {
+            order resting = incoming;
+            reference_match(bid_side ? ref_ask_orders : ref_bid_orders, !bid_side, resting, true, order_fills);
+            if (order_fills.empty() || resting.size != 0) {
+                orders[testids[i].to_uint()] = resting;
+            }
+            order remainder = incoming;
+            reference_match_levels(bid_side ? ref_asks : ref_bids, !bid_side, remainder, true, level_fills);
+            if (remainder.size != 0) {
+                levels[tick] += remainder.size;
+            }
+        } else {
+            if (orders.count(testids[i].to_uint())) {
+                order& resting = orders[testids[i].to_uint()];
+                if (resting.size <= testsizes[i]) {
+                    orders.erase(testids[i].to_uint());
+                } else {
+                    resting.size -= testsizes[i];
+                }
+            }
+            if (levels.count(tick)) {
+                if (levels[tick] <= testsizes[i]) {
+                    levels.erase(tick);
+                } else {
+                    levels[tick] -= testsizes[i];
+                }
+            }
+        }
+        if (i < 20) {
+            continue;  // already in the book
+        }
+
+        test_stream.write(incoming);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        bool read_top_bid = !top_bid_stream.empty();
+        bool read_top_ask = !top_ask_stream.empty();
+        if (read_top_bid) { top_bid = top_bid_stream.read(); }
+        if (read_top_ask) { top_ask = top_ask_stream.read(); }
+        outgoing_time.read();
+        outgoing_meta.read();
+
+#if BOOK_ENGINE == BOOK_ENGINE_PRICE_LEVEL
+        if (!check_executions(executions, level_fills, false, i + 1) || !check_depth(depth, ref_bids, ref_asks, i + 1)) {
+            return 1;
+        }
+        unsigned bid_tick = ref_bids.empty() ? 0 : ref_bids.rbegin()->first;
+        unsigned bid_size = ref_bids.empty() ? 0 : min(ref_bids.rbegin()->second, 255u);
+        unsigned ask_tick = ref_asks.empty() ? 0 : ref_asks.begin()->first;
+        unsigned ask_size = ref_asks.empty() ? 0 : min(ref_asks.begin()->second, 255u);
+        if (top_bid.price.range(15, 0).to_uint() != bid_tick || top_bid.size != bid_size ||
+            top_ask.price.range(15, 0).to_uint() != ask_tick || top_ask.size != ask_size) {
+            std::cout << "ERROR price level: order " << i + 1 << " best bid " << top_bid.price << " x " << top_bid.size
+                      << ", best ask " << top_ask.price << " x " << top_ask.size << "\n";
+            return 1;
+        }
+#else
+        map<unsigned, unsigned> bid_levels = reference_levels(ref_bid_orders);
+        map<unsigned, unsigned> ask_levels = reference_levels(ref_ask_orders);
+        if (!check_executions(executions, order_fills, true, i + 1) || !check_depth(depth, bid_levels, ask_levels, i + 1)) {
+            return 1;
+        }
+        unsigned best_bid_id = reference_best(ref_bid_orders, true);
+        unsigned best_ask_id = reference_best(ref_ask_orders, false);
+        // A side is reported when it changes or after an insert; an emptied
+        // side keeps its last report
+        if ((read_top_bid && best_bid_id != 0 && top_bid_id != best_bid_id) ||
+            (read_top_ask && best_ask_id != 0 && top_ask_id != best_ask_id) ||
+            (read_top_bid && best_bid_id != 0 && top_bid.size != ref_bid_orders[best_bid_id].size) ||
+            (read_top_ask && best_ask_id != 0 && top_ask.size != ref_ask_orders[best_ask_id].size)) {
+            std::cout << "ERROR cancel by orderID: order " << i + 1 << " top bid " << top_bid_id << " (expected "
+                      << best_bid_id << "), top ask " << top_ask_id << " (expected " << best_ask_id << ")\n";
+            return 1;
+        }
+#endif
+    }
+    // Uncrossing leaves few resting orders; rest fresh asks above every bid
+    // for the tests below
+    for (unsigned int k = 0; k < 6; k++) {
+        order resting = { 50 + k, 40 + 10 * k, 560 + k, 2, 0 };
+        ref_ask_orders[resting.orderID.to_uint()] = resting;
+        ref_asks[resting.price.range(15, 0).to_uint()] += resting.size.to_uint();
+        test_stream.write(resting);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        outgoing_time.read();
+        outgoing_meta.read();
+        depth.read();
+        if (!executions.empty()) {
+            std::cout << "ERROR seeding ask " << resting.orderID << ": crossed the book\n";
+            return 1;
+        }
+    }
+
+#if BOOK_ENGINE == BOOK_ENGINE_PRICE_LEVEL
+    std::cout << "Price levels: best bid and ask and depth match the reference for all 544 orders\n";
+#else
+    std::cout << "Cancel by orderID: top of book and depth match the reference for all 544 orders ("
+              << ref_bid_orders.size() << " bids and " << ref_ask_orders.size() << " asks resting)\n";
+
+    // Modify: each amend moves one resting order (to the top, to the bottom,
+    // size only, size 0 to cancel) and emits exactly one top of book update
+    // for its side
+    for (unsigned int m = 0; m < 8; m++) {
+        bool bid_side = m % 2 == 0;
+        map<unsigned, order>& orders = bid_side ? ref_bid_orders : ref_ask_orders;
+        // Best: better price, lower orderID on a tie; worst: the reverse
+        unsigned best_id = orders.begin()->first, worst_id = best_id;
+        for (map<unsigned, order>::iterator it = orders.begin(); it != orders.end(); ++it) {
+            if (bid_side ? it->second.price > orders[best_id].price : it->second.price < orders[best_id].price) {
+                best_id = it->first;
+            }
+            if (bid_side ? it->second.price <= orders[worst_id].price : it->second.price >= orders[worst_id].price) {
+                worst_id = it->first;
+            }
+        }
+        order amend;
+        switch (m / 2) {
+            case 0:  // worst order jumps ahead of the best
+                amend = orders[worst_id];
+                amend.price = bid_side ? orders[best_id].price + 1 : orders[best_id].price - 1;
+                break;
+            case 1:  // best order falls behind the worst
+                amend = orders[best_id];
+                amend.price = bid_side ? orders[worst_id].price - 1 : orders[worst_id].price + 1;
+                break;
+            case 2:  // size only
+                amend = orders[best_id];
+                amend.size = 7;
+                break;
+            default:  // size 0 cancels
+                amend = orders[best_id];
+                amend.size = 0;
+                break;
+        }
+        amend.direction = bid_side ? 7 : 6;
+        if (amend.size == 0) {
+            orders.erase(amend.orderID.to_uint());
+        } else {
+            orders[amend.orderID.to_uint()].price = amend.price;
+            orders[amend.orderID.to_uint()].size = amend.size;
+        }
+
+        test_stream.write(amend);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        stream<order>& updated = bid_side ? top_bid_stream : top_ask_stream;
+        stream<order>& untouched = bid_side ? top_ask_stream : top_bid_stream;
+        if (updated.size() != 1 || !untouched.empty()) {
+            std::cout << "ERROR modify " << m << ": " << updated.size() << " top of book updates\n";
+            return 1;
+        }
+        order top = updated.read();
+        outgoing_time.read();
+        outgoing_meta.read();
+        map<unsigned, unsigned> bid_levels = reference_levels(ref_bid_orders);
+        map<unsigned, unsigned> ask_levels = reference_levels(ref_ask_orders);
+        if (!check_depth(depth, bid_levels, ask_levels, 551 + m)) {
+            return 1;
+        }
+
+        unsigned expected_id = orders.begin()->first;
+        for (map<unsigned, order>::iterator it = orders.begin(); it != orders.end(); ++it) {
+            if (bid_side ? it->second.price > orders[expected_id].price : it->second.price < orders[expected_id].price) {
+                expected_id = it->first;
+            }
+        }
+        if (top.orderID != expected_id || top.price != orders[expected_id].price || top.size != orders[expected_id].size) {
+            std::cout << "ERROR modify " << m << ": top " << top.orderID << " @ " << top.price << " x " << top.size
+                      << ", expected " << expected_id << " @ " << orders[expected_id].price << " x "
+                      << orders[expected_id].size << "\n";
+            return 1;
+        }
+    }
+    std::cout << "Modify: 8 amends each moved their order with one top of book update and depth\n";
+#endif
+    // Market orders: a buy and a sell of 255 sweep the opposite side from its
+    // best price, the last order they reach partially filled, and publish the
+    // top of book once
+    for (unsigned int m = 0; m < 2; m++) {
+        bool bid_side = m == 0;
+        order market = { 0, 255, 600 + m, bid_side ? 1 : 0, 0 };
+        vector<execution> order_fills, level_fills;
+        order remainder = market;
+        reference_match(bid_side ? ref_ask_orders : ref_bid_orders, !bid_side, remainder, false, order_fills);
+        remainder = market;
+        reference_match_levels(bid_side ? ref_asks : ref_bids, !bid_side, remainder, false, level_fills);
+
+        test_stream.write(market);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        if (top_bid_stream.size() > 1 || top_ask_stream.size() > 1 || outgoing_time.size() != 1) {
+            std::cout << "ERROR market " << directionToString(market.direction) << ": more than one top of book update\n";
+            return 1;
+        }
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        outgoing_time.read();
+        outgoing_meta.read();
+
+#if BOOK_ENGINE == BOOK_ENGINE_PRICE_LEVEL
+        vector<execution>& fills = level_fills;
+        bool check_ids = false;
+        map<unsigned, unsigned>& bid_levels = ref_bids;
+        map<unsigned, unsigned>& ask_levels = ref_asks;
+#else
+        vector<execution>& fills = order_fills;
+        bool check_ids = true;
+        if (top_bid_id != reference_best(ref_bid_orders, true) || top_ask_id != reference_best(ref_ask_orders, false)) {
+            std::cout << "ERROR market " << directionToString(market.direction) << ": top bid " << top_bid_id
+                      << ", top ask " << top_ask_id << "\n";
+            return 1;
+        }
+        map<unsigned, unsigned> bid_levels = reference_levels(ref_bid_orders);
+        map<unsigned, unsigned> ask_levels = reference_levels(ref_ask_orders);
+#endif
+        if (!check_executions(executions, fills, check_ids, 559 + m) ||
+            !check_depth(depth, bid_levels, ask_levels, 559 + m)) {
+            return 1;
+        }
+        std::cout << "Market " << directionToString(market.direction) << " of 255: " << fills.size() << " fills, last "
+                  << fills.back().size << " @ " << fills.back().price << "\n";
+    }
+    // Change-only mode: orders that leave the best bid and ask alone write no
+    // top of book and are counted; one that moves them writes both sides once
+    struct { double price_offset; ap_uint<3> direction; unsigned orderID; bool moves_top; } steps[4] = {
+        { -20.0, 3, 700, false },   // deep bid
+        { 1.0 / 256, 3, 701, true },  // one tick above the best bid
+        { -20.0, 3, 702, false },   // another deep bid
+        { 1.0 / 256, 5, 701, true },  // cancel the new best bid
+    };
+    depth_level best_bid_level = { 0, 0 };
+    for (unsigned int c = 0; c < 4; c++) {
+        ap_uint<32> suppressed_before = suppressed_updates;
+        if (c == 0) {
+            // The book as left by the tests above
+            test_stream.write(order { 0, 0, 999, 5, 0 });  // unknown orderID: removes nothing
+            test_time.write(t);
+            test_meta.write(temp_meta);
+            order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 1, suppressed_updates, snapshot, counters);
+            best_bid_level = depth.read().bid[0];
+            suppressed_before = suppressed_updates;
+        }
+        order step = { 0, 10, steps[c].orderID, steps[c].direction, 0 };
+        step.price = best_bid_level.price + steps[c].price_offset;
+        test_stream.write(step);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 1, suppressed_updates, snapshot, counters);
+        depth.read();
+        unsigned updates = top_bid_stream.size();
+        bool paired = top_ask_stream.size() == updates && outgoing_time.size() == updates && outgoing_meta.size() == updates;
+        order top = updates ? top_bid_stream.read() : order();
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        ap_uint<16> expected_tick = steps[c].direction == 3 ? step.price.range(15, 0) : best_bid_level.price.range(15, 0);
+        bool correct = steps[c].moves_top
+            ? updates == 1 && paired && top.price.range(15, 0) == expected_tick && suppressed_updates == suppressed_before
+            : updates == 0 && paired && suppressed_updates == suppressed_before + 1;
+        if (!correct) {
+            std::cout << "ERROR change-only " << c << ": " << updates << " top of book updates, "
+                      << suppressed_updates - suppressed_before << " suppressed\n";
+            return 1;
+        }
+    }
+    std::cout << "Change-only: " << suppressed_updates << " unchanged top of book updates suppressed\n";
+#if BOOK_ENGINE != BOOK_ENGINE_PRICE_LEVEL
+    // Randomized flows against the reference engine. The book is emptied
+    // first; then limit, market, cancel and amend orders are drawn at random
+    // over a narrow price band, so many orders share a price, with exchange
+    // style orderIDs: random 32-bit values that do not follow arrival order. The
+    // systolic engine holds SYSTOLIC_CELLS orders per side, far fewer than
+    // the flows leave resting, so it is checked against a reference of that
+    // capacity, refused orders included.
+    vector<order> leftovers;
+    for (map<unsigned, order>::iterator it = ref_bid_orders.begin(); it != ref_bid_orders.end(); ++it) {
+        leftovers.push_back(order { 0, 255, it->first, 5, 0 });
+    }
+    for (map<unsigned, order>::iterator it = ref_ask_orders.begin(); it != ref_ask_orders.end(); ++it) {
+        leftovers.push_back(order { 0, 255, it->first, 4, 0 });
+    }
+    leftovers.push_back(order { 0, 255, 700, 5, 0 });  // left by the change-only test
+    leftovers.push_back(order { 0, 255, 702, 5, 0 });
+    book_depth emptied;
+    for (unsigned int k = 0; k < leftovers.size(); k++) {
+        test_stream.write(leftovers[k]);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        emptied = depth.read();
+    }
+    if (emptied.bid[0].size != 0 || emptied.ask[0].size != 0) {
+        std::cout << "ERROR randomized: the book is not empty before the flows\n";
+        return 1;
+    }
+
+    mt19937 rng(20241017);
+    reference_engine engine;
+    engine.next_arrival = 0;
+    engine.capacity = BOOK_ENGINE == BOOK_ENGINE_SYSTOLIC ? SYSTOLIC_CELLS : 0;
+    map<unsigned, bool> live;               // orderID -> bid side, resting in the reference
+    const unsigned RANDOM_ORDERS = 6000;
+    unsigned total_fills = 0, max_resting = 0, requeued = 0, total_evicted = 0;
+    for (unsigned int n = 0; n < RANDOM_ORDERS; n++) {
+        order incoming = { 0, 0, 0, 0, 0 };
+        unsigned draw = rng() % 100;
+        bool bid_side = rng() % 2;
+        if (draw < 50 || live.empty()) {  // limit order, a new orderID
+            int offset = bid_side ? -(int)(rng() % 16) : (int)(rng() % 16);
+            incoming.price = 100 + offset / 16.0;
+            incoming.size = rng() % 61;  // now and then 0, which has nothing to rest
+            incoming.orderID = random_order_id(rng, live);
+            incoming.direction = bid_side ? 3 : 2;
+        } else if (draw < 56) {  // market order
+            incoming.size = 1 + rng() % 100;
+            incoming.orderID = random_order_id(rng, live);
+            incoming.direction = bid_side ? 1 : 0;
+        } else {  // cancel or amend a resting order (now and then an unknown one)
+            map<unsigned, bool>::iterator pick = live.begin();
+            advance(pick, rng() % live.size());
+            bid_side = pick->second;
+            order resting = engine.orders[bid_side][pick->first];
+            incoming = resting;
+            if (rng() % 10 == 0) {
+                incoming.orderID = random_order_id(rng, live);
+            }
+            if (draw < 78) {
+                incoming.size = rng() % 2 ? 255 : 1 + rng() % resting.size;
+                incoming.direction = bid_side ? 5 : 4;
+            } else {
+                unsigned amend = rng() % 6;
+                if (amend < 2) {  // now and then across the spread
+                    int offset = bid_side ? 3 - (int)(rng() % 16) : (int)(rng() % 16) - 3;
+                    incoming.price = 100 + offset / 16.0;
+                } else if (amend < 5) {
+                    incoming.size = 1 + rng() % 60;
+                } else {
+                    incoming.size = 0;
+                }
+                incoming.direction = bid_side ? 7 : 6;
+                if (engine.orders[bid_side].count(incoming.orderID.to_uint()) && incoming.size != 0 &&
+                    (incoming.price != resting.price || incoming.size > resting.size)) {
+                    requeued++;
+                }
+            }
+        }
+        vector<execution> fills;
+        engine_apply(engine, incoming, fills);
+        total_fills += fills.size();
+
+        // Track the orders resting in the reference
+        unsigned id = incoming.orderID.to_uint();
+        bool joined = !live.count(id) && engine.orders[bid_side].count(id);
+        for (map<unsigned, bool>::iterator it = live.begin(); it != live.end();) {
+            if (engine.orders[it->second].count(it->first)) {
+                ++it;
+            } else {
+                live.erase(it++);
+            }
+        }
+        if (joined) {
+            live[id] = bid_side;
+        }
+        max_resting = max(max_resting, (unsigned)max(engine.orders[0].size(), engine.orders[1].size()));
+
+        test_stream.write(incoming);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        bool read_top_bid = !top_bid_stream.empty();
+        bool read_top_ask = !top_ask_stream.empty();
+        if (read_top_bid) { top_bid = top_bid_stream.read(); }
+        if (read_top_ask) { top_ask = top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+
+        map<unsigned, unsigned> bid_levels = reference_levels(engine.orders[1]);
+        map<unsigned, unsigned> ask_levels = reference_levels(engine.orders[0]);
+        if (!check_executions(executions, fills, true, 1000 + n) || !check_depth(depth, bid_levels, ask_levels, 1000 + n)) {
+            return 1;
+        }
+        bool evicted_right = evictions.size() == engine.evicted.size();
+        for (unsigned k = 0; evicted_right && k < engine.evicted.size(); k++) {
+            order evicted = evictions.read();
+            evicted_right = evicted.orderID == engine.evicted[k].orderID && evicted.size == engine.evicted[k].size &&
+                            evicted.price == engine.evicted[k].price;
+        }
+        if (!evicted_right) {
+            std::cout << "ERROR randomized: order " << 1000 + n << " (" << directionToString(incoming.direction)
+                      << " " << incoming.orderID << ") expected " << engine.evicted.size() << " evictions\n";
+            return 1;
+        }
+        total_evicted += engine.evicted.size();
+        engine.evicted.clear();
+        unsigned best_bid_id = engine_best(engine, true);
+        unsigned best_ask_id = engine_best(engine, false);
+        if ((read_top_bid && best_bid_id != 0 &&
+             (top_bid_id != best_bid_id || top_bid.size != engine.orders[1][best_bid_id].size)) ||
+            (read_top_ask && best_ask_id != 0 &&
+             (top_ask_id != best_ask_id || top_ask.size != engine.orders[0][best_ask_id].size))) {
+            std::cout << "ERROR randomized: order " << 1000 + n << " (" << directionToString(incoming.direction)
+                      << " " << incoming.orderID << ") top bid " << top_bid_id << " (expected " << best_bid_id
+                      << "), top ask " << top_ask_id << " (expected " << best_ask_id << ")\n";
+            return 1;
+        }
+    }
+    std::cout << "Randomized: " << RANDOM_ORDERS << " orders with out-of-order orderIDs, " << total_fills
+              << " fills and " << requeued << " requeuing amends match the arrival-priority reference (up to "
+              << max_resting << " resting per side, " << total_evicted << " refused)\n";
+#endif
+
+#if INSTRUMENTS_PER_BANK > 1
+    // Instruments: instrument 1 and 1 + BOOK_BANKS share a bank, instrument 0
+    // (the tests above) is in another; their books are independent even with
+    // crossing prices and the same orderID, every output carries its
+    // instrument, and an order for an unknown instrument is dropped
+    struct { unsigned instrument; ap_uint<3> direction; double price; unsigned size; unsigned orderID; } instrument_steps[4] = {
+        { 1, 3, 90, 10, 42 },                   // bid on instrument 1
+        { 1 + BOOK_BANKS, 2, 80, 5, 42 },       // crosses it, but on another book
+        { 1, 2, 85, 4, 43 },                    // fills 4 of the instrument 1 bid
+        { NUM_INSTRUMENTS, 3, 99, 1, 44 },      // unknown instrument
+    };
+    struct { unsigned fills; double bid_price; unsigned bid_size; double ask_price; unsigned ask_size; } instrument_expected[4] = {
+        { 0, 90, 10, 0, 0 },
+        { 0, 0, 0, 80, 5 },
+        { 1, 90, 6, 0, 0 },
+        { 0, 0, 0, 0, 0 },
+    };
+    for (unsigned int s = 0; s < 4; s++) {
+        order step = { instrument_steps[s].price, instrument_steps[s].size, instrument_steps[s].orderID,
+                       instrument_steps[s].direction, instrument_steps[s].instrument };
+        test_stream.write(step);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+
+        bool correct = executions.size() == instrument_expected[s].fills;
+        while (correct && !executions.empty()) {
+            execution fill = executions.read();
+            correct = fill.instrument == step.instrument && fill.orderID == 42 && fill.price == 90 && fill.size == 4;
+        }
+        if (step.instrument == NUM_INSTRUMENTS) {
+            correct = correct && top_bid_stream.empty() && top_ask_stream.empty() && outgoing_time.empty() && depth.empty();
+        } else {
+            bool bid_side = instrument_expected[s].bid_size != 0;  // the side with an order resting
+            stream<order>& updated = bid_side ? top_bid_stream : top_ask_stream;
+            order top = updated.empty() ? order() : updated.read();
+            correct = correct && top.instrument == step.instrument && top.orderID == (bid_side ? top_bid_id : top_ask_id) &&
+                      (bid_side ? top_bid_id == 42 : top_ask_id == 42) && depth.size() == 1;
+            book_depth snapshot = depth.empty() ? book_depth() : depth.read();
+            correct = correct && snapshot.instrument == step.instrument &&
+                      snapshot.bid[0].price == instrument_expected[s].bid_price &&
+                      snapshot.bid[0].size == instrument_expected[s].bid_size &&
+                      snapshot.ask[0].price == instrument_expected[s].ask_price &&
+                      snapshot.ask[0].size == instrument_expected[s].ask_size &&
+                      snapshot.bid[1].size == 0 && snapshot.ask[1].size == 0;
+        }
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        while (!depth.empty()) { depth.read(); }
+        if (!correct) {
+            std::cout << "ERROR instruments: step " << s << " (" << directionToString(step.direction)
+                      << " on instrument " << step.instrument << ")\n";
+            return 1;
+        }
+    }
+    std::cout << "Instruments: " << NUM_INSTRUMENTS << " books in " << BOOK_BANKS
+              << " banks, outputs tagged and books independent\n";
+
+    // Routing: one order for each bank, all written before a single call, are
+    // all processed in that call, and so are their cancels
+    for (unsigned int pass = 0; pass < 2; pass++) {
+        for (unsigned int b = 0; b < BOOK_BANKS; b++) {
+            order step = { 70, 1, 900 + b, ap_uint<3>(pass == 0 ? 3 : 5), BOOK_BANKS + b };
+            test_stream.write(step);
+            test_time.write(t);
+            test_meta.write(temp_meta);
+        }
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        bool seen[BOOK_BANKS] = {};
+        bool correct = test_stream.empty() && executions.empty() && evictions.empty() && depth.size() == BOOK_BANKS;
+        while (!depth.empty()) {
+            book_depth snapshot = depth.read();
+            unsigned b = snapshot.instrument - BOOK_BANKS;
+            correct = correct && b < BOOK_BANKS && !seen[b];
+            seen[b % BOOK_BANKS] = true;
+        }
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        if (!correct) {
+            std::cout << "ERROR routing: " << (pass == 0 ? "bids" : "cancels") << " not all processed in one call\n";
+            return 1;
+        }
+    }
+    std::cout << "Routing: " << BOOK_BANKS << " orders for different banks processed in one call\n";
+#endif
+
+#if NUM_INSTRUMENTS > 2
+    // Change-only mode on instrument 2: emptying a side is a change of the
+    // top of book like any other, so the cancel that takes the last bid and
+    // the market order that takes the last ask each write both sides once,
+    // the emptied one as an empty order. A cancel on the empty book writes
+    // nothing and is counted.
+    struct { ap_uint<3> direction; unsigned orderID; unsigned tick; unsigned size; unsigned fills;
+             unsigned bid_size; unsigned ask_size; } emptying_steps[5] = {
+        { 3, 901, 0x4000, 10, 0, 10, 0 },
+        { 2, 902, 0x4100, 5, 0, 10, 5 },
+        { 5, 901, 0x4000, 10, 0, 0, 5 },       // the bid side empties
+        { 1, 903, 0x4100, 255, 1, 0, 0 },      // and the ask side
+        { 5, 901, 0x4000, 10, 0, 0, 0 },       // nothing left to report
+    };
+    for (unsigned int e = 0; e < 5; e++) {
+        ap_uint<32> suppressed_before = suppressed_updates;
+        order step = { 0, emptying_steps[e].size, emptying_steps[e].orderID, emptying_steps[e].direction, 2 };
+        step.price.range(15, 0) = emptying_steps[e].tick;
+        test_stream.write(step);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 1, suppressed_updates, snapshot, counters);
+        bool moves_top = e < 4;
+        unsigned updates = top_bid_stream.size();
+        bool correct = updates == (moves_top ? 1u : 0u) && top_ask_stream.size() == updates &&
+                       outgoing_time.size() == updates && outgoing_meta.size() == updates &&
+                       executions.size() == emptying_steps[e].fills &&
+                       suppressed_updates == suppressed_before + (moves_top ? 0 : 1);
+        if (updates != 0) {
+            order bid = top_bid_stream.read();
+            order ask = top_ask_stream.read();
+            correct = correct && bid.instrument == 2 && ask.instrument == 2 &&
+                      bid.size == emptying_steps[e].bid_size && ask.size == emptying_steps[e].ask_size &&
+                      (bid.size == 0 || bid.price.range(15, 0) == 0x4000) &&
+                      (ask.size == 0 || ask.price.range(15, 0) == 0x4100) &&
+                      top_bid_id == (bid.size != 0 ? 901u : 0u) && top_ask_id == (ask.size != 0 ? 902u : 0u);
+        }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        while (!executions.empty()) { executions.read(); }
+        while (!depth.empty()) { depth.read(); }
+        if (!correct) {
+            std::cout << "ERROR change-only emptying " << e << ": " << updates << " top of book updates, "
+                      << suppressed_updates - suppressed_before << " suppressed\n";
+            return 1;
+        }
+    }
+    std::cout << "Change-only: emptied sides reported as empty orders\n";
+#endif
+
+#if NUM_INSTRUMENTS > 5
+    // Amends across the spread, on instrument 5: a bid amended up to the best
+    // ask and an ask amended down below the best bid. The heap and systolic
+    // engines match each one as a limit order with its orderID, so it fills
+    // and what is left rests on the far side of the spread; the price-level
+    // engine cannot find the order and refuses the amend on evictions. Either
+    // way the book is never crossed.
+    struct { ap_uint<3> direction; unsigned orderID; unsigned tick; unsigned size; } amend_steps[9] = {
+        { 4, 42, 0x5000, 255 },     // left by the instruments test
+        { 2, 801, 0x5010, 5 },
+        { 2, 802, 0x5020, 5 },
+        { 3, 803, 0x5000, 10 },
+        { 7, 803, 0x5010, 8 },      // bid amended across the spread
+        { 6, 802, 0x5000, 4 },      // ask amended across it
+        { 4, 801, 0x5010, 255 },    // what is left is cancelled
+        { 4, 802, 0x5020, 255 },
+        { 5, 803, 0x5000, 255 },
+    };
+    struct { unsigned fill_id; unsigned fill_size; bool refused; unsigned bid_tick; unsigned bid_size;
+             unsigned ask_tick; unsigned ask_size; } amend_expected[9] = {
+        { 0, 0, false, 0, 0, 0, 0 },
+        { 0, 0, false, 0, 0, 0x5010, 5 },
+        { 0, 0, false, 0, 0, 0x5010, 5 },
+        { 0, 0, false, 0x5000, 10, 0x5010, 5 },
+#if BOOK_ENGINE == BOOK_ENGINE_PRICE_LEVEL
+        { 0, 0, true, 0x5000, 10, 0x5010, 5 },
+        { 0, 0, true, 0x5000, 10, 0x5010, 5 },
+        { 0, 0, false, 0x5000, 10, 0x5020, 5 },
+        { 0, 0, false, 0x5000, 10, 0, 0 },
+#else
+        { 801, 5, false, 0x5010, 3, 0x5020, 5 },
+        { 803, 3, false, 0, 0, 0x5000, 1 },
+        { 0, 0, false, 0, 0, 0x5000, 1 },
+        { 0, 0, false, 0, 0, 0, 0 },
+#endif
+        { 0, 0, false, 0, 0, 0, 0 },
+    };
+    for (unsigned int a = 0; a < 9; a++) {
+        order step = { 0, amend_steps[a].size, amend_steps[a].orderID, amend_steps[a].direction, 5 };
+        step.price.range(15, 0) = amend_steps[a].tick;
+        test_stream.write(step);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        book_depth book = depth.read();
+        bool correct = executions.size() == (amend_expected[a].fill_size != 0 ? 1u : 0u) &&
+                       evictions.size() == (amend_expected[a].refused ? 1u : 0u);
+        if (correct && amend_expected[a].fill_size != 0) {
+            execution fill = executions.read();
+            correct = fill.orderID == amend_expected[a].fill_id && fill.size == amend_expected[a].fill_size;
+        }
+        if (correct && amend_expected[a].refused) {
+            order refused = evictions.read();
+            correct = refused.orderID == step.orderID && refused.direction == step.direction && refused.instrument == 5;
+        }
+        correct = correct && book.bid[0].size == amend_expected[a].bid_size && book.ask[0].size == amend_expected[a].ask_size &&
+                  (book.bid[0].size == 0 || book.bid[0].price.range(15, 0) == amend_expected[a].bid_tick) &&
+                  (book.ask[0].size == 0 || book.ask[0].price.range(15, 0) == amend_expected[a].ask_tick) &&
+                  (book.bid[0].size == 0 || book.ask[0].size == 0 || book.bid[0].price < book.ask[0].price);
+        if (!correct) {
+            std::cout << "ERROR crossing amend " << a << " (" << directionToString(step.direction) << " "
+                      << step.orderID << "): best bid " << book.bid[0].price << " x " << book.bid[0].size
+                      << ", best ask " << book.ask[0].price << " x " << book.ask[0].size << "\n";
+            return 1;
+        }
+    }
+#if BOOK_ENGINE == BOOK_ENGINE_PRICE_LEVEL
+    std::cout << "Crossing amends: refused on evictions, the book left as it was\n";
+#else
+    std::cout << "Crossing amends: matched as limit orders, the book never crossed\n";
+#endif
+#endif
+
+    // Counters: they are latched on a rising edge of snapshot only, and the
+    // orders between two snapshots show up in them. Bid 1 and the fifth
+    // orderID of its lane share a lane, so the second one takes a push loop
+    // step; cancelling bid 2 empties its lane (with more than one lane), and
+    // as the heaps are compact that takes no loop step at all.
+    struct { ap_uint<3> direction; unsigned price; unsigned orderID; } counted[6] = {
+        { 3, 10, 1 }, { 3, 11, lane_member(lane_of(1), 5) }, { 3, 12, 2 }, { 2, 20, 4 }, { 5, 12, 2 }, { 3, 9, 6 },
+    };
+    book_counters before = {};
+    for (unsigned int c = 0; c <= 6; c++) {
+        if (c == 0 || c == 5) {
+            // Rising edge of snapshot with no order waiting
+            snapshot = 0;
+            order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+            snapshot = 1;
+            order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+            if (c == 0) {
+                before = counters;
+            }
+        }
+        if (c == 6) {
+            break;
+        }
+        // On instrument 2, so on a book of its own
+        order step = { counted[c].price, 5, counted[c].orderID, counted[c].direction, 2 };
+        test_stream.write(step);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        while (!depth.empty()) { depth.read(); }
+    }
+    // counters still hold the second snapshot: the last bid came in with
+    // snapshot held high
+    bool counted_right = counters.messages[3] == before.messages[3] + 3 &&
+                         counters.messages[2] == before.messages[2] + 1 &&
+                         counters.messages[5] == before.messages[5] + 1 &&
+                         counters.overflow_drops == before.overflow_drops &&
+                         counters.suppressed == suppressed_updates;
+#if BOOK_ENGINE == BOOK_ENGINE_SYSTOLIC
+    // Inserts and cancels are one shift of the register, not loop cycles
+    counted_right = counted_right &&
+                    counters.bid_orders == before.bid_orders + 2 &&
+                    counters.ask_orders == before.ask_orders + 1 &&
+                    counters.bid_high_water >= 2 && counters.bid_high_water >= before.bid_high_water &&
+                    counters.loop_cycles[3] == before.loop_cycles[3] &&
+                    counters.loop_cycles[5] == before.loop_cycles[5];
+#elif BOOK_ENGINE == BOOK_ENGINE_HEAP
+    counted_right = counted_right &&
+                    counters.bid_orders == before.bid_orders + 2 &&
+                    counters.ask_orders == before.ask_orders + 1 &&
+                    counters.bid_high_water >= 2 && counters.bid_high_water >= before.bid_high_water &&
+                    counters.loop_cycles[3] > before.loop_cycles[3] &&
+                    (LANES == 1 || counters.loop_cycles[5] == before.loop_cycles[5]);
+#endif
+    if (!counted_right) {
+        std::cout << "ERROR counters: " << counters.messages[3] - before.messages[3] << " bids, "
+                  << counters.bid_orders - before.bid_orders << " resting bids, "
+                  << counters.loop_cycles[5] - before.loop_cycles[5] << " cancel loop cycles between the snapshots\n";
+        return 1;
+    }
+    ap_uint<32> messages = 0, loop_cycles = 0;
+    for (unsigned int type = 0; type < 8; type++) {
+        messages += counters.messages[type];
+        loop_cycles += counters.loop_cycles[type];
+    }
+    std::cout << "Counters: " << messages << " orders, " << loop_cycles << " loop cycles, "
+              << counters.bid_orders << "/" << counters.ask_orders << " resting, high water "
+              << counters.bid_high_water << "/" << counters.ask_high_water << ", "
+              << counters.overflow_drops << " overflow drops\n";
+
+#if BOOK_ENGINE == BOOK_ENGINE_HEAP && LANE_BITS > 0
+    // Lanes: orderIDs that step by a multiple of LANES (an exchange numbering
+    // its orders per gateway, say) must still spread over every lane, each
+    // getting at least half its share
+    const unsigned STRIDED_IDS = 1 << 13;
+    for (unsigned stride = LANES; stride <= 16 * LANES; stride *= 4) {
+        unsigned per_lane[LANES] = {};
+        unsigned ids = 0;
+        for (unsigned id = stride; id < STRIDED_IDS; id += stride) {
+            per_lane[lane_of(id)]++;
+            ids++;
+        }
+        for (unsigned k = 0; k < LANES; k++) {
+            if (2 * per_lane[k] * LANES < ids) {
+                std::cout << "ERROR lanes: stride " << stride << " puts " << per_lane[k] << " of " << ids
+                          << " orderIDs in lane " << k << "\n";
+                return 1;
+            }
+        }
+    }
+    std::cout << "Lanes: orderIDs strided by up to " << 16 * LANES << " spread over all " << LANES << " lanes\n";
+#endif
+
+#if BOOK_ENGINE == BOOK_ENGINE_HEAP
+    // Eviction: fill one bid lane of instrument 3 (orderIDs of lane 0), then
+    // a better bid evicts the worst resting one (lowest price, then latest
+    // arrival) and a bid below all of them is evicted itself. Every evicted
+    // order goes out on evictions, and cancelling what is left must empty the
+    // book.
+    const unsigned LANE_CAPACITY = (1 << LANE_LEVELS) - 1;
+    map<unsigned, order> lane_book;
+    map<unsigned, unsigned> no_asks;
+    vector<unsigned> arrival_order;
+    for (unsigned int k = 1; k <= LANE_CAPACITY + 2; k++) {
+        order bid = { 0, (unsigned)(k % 50 + 1), lane_member(0, k), 3, 3 };
+        unsigned tick = k <= LANE_CAPACITY ? 0x3000 + (k * 37) % 200 : (k == LANE_CAPACITY + 1 ? 0x3100 : 0x2fff);
+        bid.price.range(15, 0) = tick;
+
+        order expected_eviction = bid;
+        expected_eviction.size = 0;
+        if (k > LANE_CAPACITY) {
+            // Worst resting bid: lowest tick, then the latest to arrive
+            unsigned worst_id = 0;
+            for (unsigned a = 0; a < arrival_order.size(); a++) {
+                unsigned id = arrival_order[a];
+                if (lane_book.count(id) && (worst_id == 0 || lane_book[id].price <= lane_book[worst_id].price)) {
+                    worst_id = id;
+                }
+            }
+            expected_eviction = bid.price > lane_book[worst_id].price ? lane_book[worst_id] : bid;
+        }
+        if (expected_eviction.size == 0 || expected_eviction.orderID != bid.orderID) {
+            lane_book[bid.orderID.to_uint()] = bid;
+            arrival_order.push_back(bid.orderID.to_uint());
+        }
+        if (expected_eviction.size != 0) {
+            lane_book.erase(expected_eviction.orderID.to_uint());
+        }
+
+        test_stream.write(bid);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        map<unsigned, unsigned> bid_levels = reference_levels(lane_book);
+        if (!check_depth(depth, bid_levels, no_asks, 2000 + k)) {
+            return 1;
+        }
+        bool evicted_right = expected_eviction.size == 0 ? evictions.empty() : evictions.size() == 1;
+        if (evicted_right && expected_eviction.size != 0) {
+            order evicted = evictions.read();
+            evicted_right = evicted.orderID == expected_eviction.orderID && evicted.price == expected_eviction.price &&
+                            evicted.size == expected_eviction.size && evicted.direction == 3 && evicted.instrument == 3;
+        }
+        if (!evicted_right) {
+            std::cout << "ERROR eviction: bid " << bid.orderID << " expected to evict " << expected_eviction.orderID << "\n";
+            return 1;
+        }
+    }
+    unsigned evicted_orders = LANE_CAPACITY + 2 - lane_book.size();
+
+    // Churn at capacity: new bids into the full lane, partial and full
+    // cancels and amends in random order, so the worst order keeps moving
+    // and changing size. Every new bid into the full lane must evict the
+    // worst order as it rests at that moment (size included), or itself.
+    const unsigned CHURN = 4 * LANE_CAPACITY;
+    mt19937 churn_rng(1017);
+    vector<unsigned> free_ids;
+    for (unsigned id = lane_member(0, LANE_CAPACITY + 3); free_ids.size() < CHURN; id++) {
+        if (lane_of(id) == 0) {
+            free_ids.push_back(id);
+        }
+    }
+    map<unsigned, unsigned> queued;  // arrival rank of every resting bid
+    for (unsigned a = 0; a < arrival_order.size(); a++) {
+        queued[arrival_order[a]] = a;
+    }
+    unsigned next_rank = arrival_order.size(), churn_evictions = 0;
+    for (unsigned r = 0; r < CHURN; r++) {
+        vector<unsigned> resting_ids;
+        for (map<unsigned, order>::iterator it = lane_book.begin(); it != lane_book.end(); ++it) {
+            resting_ids.push_back(it->first);
+        }
+        unsigned action = churn_rng() % 8;  // half new bids, so the lane stays full
+        order step = { 0, 0, 0, 3, 3 };
+        order expected_eviction = step;
+        if (action < 4 || resting_ids.empty()) {
+            // New bid; a full lane evicts its worst bid (lowest tick, then
+            // the latest to queue) unless the new one ranks lower still
+            step.orderID = free_ids.back();
+            step.size = churn_rng() % 50 + 1;
+            step.price.range(15, 0) = 0x3000 + churn_rng() % 200;
+            free_ids.pop_back();
+            arrival_order.push_back(step.orderID.to_uint());
+            bool rests = true;
+            if (lane_book.size() == LANE_CAPACITY) {
+                unsigned worst_id = resting_ids[0];
+                for (unsigned i = 1; i < resting_ids.size(); i++) {
+                    order& o = lane_book[resting_ids[i]];
+                    if (o.price < lane_book[worst_id].price ||
+                        (o.price == lane_book[worst_id].price && queued[resting_ids[i]] > queued[worst_id])) {
+                        worst_id = resting_ids[i];
+                    }
+                }
+                rests = step.price > lane_book[worst_id].price;
+                expected_eviction = rests ? lane_book[worst_id] : step;
+                if (rests) {
+                    lane_book.erase(worst_id);
+                    free_ids.insert(free_ids.begin(), worst_id);
+                } else {
+                    free_ids.insert(free_ids.begin(), step.orderID.to_uint());
+                }
+                churn_evictions++;
+            }
+            if (rests) {
+                lane_book[step.orderID.to_uint()] = step;
+                queued[step.orderID.to_uint()] = next_rank++;
+            }
+        } else {
+            unsigned id = resting_ids[churn_rng() % resting_ids.size()];
+            order& resting = lane_book[id];
+            step.orderID = id;
+            if (action < 6 && resting.size > 1) {  // partial cancel: keeps its place
+                step.direction = 5;
+                step.size = churn_rng() % (resting.size - 1) + 1;
+                resting.size -= step.size;
+            } else if (action == 6) {  // amend to another tick: back of its queue
+                step.direction = 7;
+                step.size = resting.size;
+                step.price = resting.price;
+                step.price.range(15, 0) = 0x3000 + (resting.price.range(15, 0) - 0x3000 + 1 + churn_rng() % 199) % 200;
+                resting.price = step.price;
+                queued[id] = next_rank++;
+            } else {  // full cancel
+                step.direction = 5;
+                step.size = 255;
+                lane_book.erase(id);
+                free_ids.insert(free_ids.begin(), id);
+            }
+        }
+        test_stream.write(step);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        map<unsigned, unsigned> bid_levels = reference_levels(lane_book);
+        if (!check_depth(depth, bid_levels, no_asks, 2500 + r)) {
+            return 1;
+        }
+        bool evicted_right = expected_eviction.size == 0 ? evictions.empty() : evictions.size() == 1;
+        if (evicted_right && expected_eviction.size != 0) {
+            order evicted = evictions.read();
+            evicted_right = evicted.orderID == expected_eviction.orderID && evicted.price == expected_eviction.price &&
+                            evicted.size == expected_eviction.size;
+        }
+        if (!evicted_right) {
+            std::cout << "ERROR eviction churn " << r << ": " << directionToString(step.direction) << " "
+                      << step.orderID << " expected to evict " << expected_eviction.orderID << "\n";
+            return 1;
+        }
+    }
+    evicted_orders += churn_evictions;
+    for (unsigned a = 0; a < arrival_order.size(); a++) {
+        order cancel = { 0, 255, arrival_order[a], 5, 3 };  // the evicted bids find nothing
+        lane_book.erase(arrival_order[a]);
+        test_stream.write(cancel);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        map<unsigned, unsigned> bid_levels = reference_levels(lane_book);
+        if (!check_depth(depth, bid_levels, no_asks, 3000 + a) || !evictions.empty()) {
+            return 1;
+        }
+    }
+    std::cout << "Eviction: a full lane of " << LANE_CAPACITY << " bids evicted " << evicted_orders
+              << " orders (the worst resting bid, or the incoming one), through " << CHURN
+              << " orders of churn, and stayed consistent\n";
+#endif
+
+#if BOOK_ENGINE == BOOK_ENGINE_HEAP && NUM_INSTRUMENTS > 6 && (1 << LANE_LEVELS) > 2 * INDEX_WAYS
+    // Index collisions, on instrument 6. A bid whose orderID already rests is
+    // refused (it goes out on evictions and is counted) instead of taking
+    // over the index entry. Then 17 orderIDs with the same lane and the same
+    // two index buckets: the first 16 fill both buckets, so the 17th is
+    // refused and a cancel of it finds nothing, and once one of the 16 has
+    // left the 17th rests and cancels normally.
+    vector<unsigned> bucket_ids;
+    for (unsigned id = 1; bucket_ids.size() < 2 * INDEX_WAYS + 1; id++) {
+        if (bucket_ids.empty() || (lane_of(id) == lane_of(bucket_ids[0]) &&
+                                   index_set(id, 0) == index_set(bucket_ids[0], 0) &&
+                                   index_set(id, 1) == index_set(bucket_ids[0], 1))) {
+            bucket_ids.push_back(id);
+        }
+    }
+    struct collision_step { ap_uint<3> direction; unsigned orderID; unsigned tick; unsigned size; bool refused; };
+    vector<collision_step> collision_steps;
+    collision_steps.push_back(collision_step { 3, bucket_ids[0], 0x3000, 10, false });
+    collision_steps.push_back(collision_step { 3, bucket_ids[0], 0x3010, 20, true });   // the orderID rests
+    for (unsigned k = 1; k < 2 * INDEX_WAYS; k++) {
+        collision_steps.push_back(collision_step { 3, bucket_ids[k], 0x3000 + k, 10, false });
+    }
+    const unsigned OVERFLOW_ID = bucket_ids[2 * INDEX_WAYS];
+    collision_steps.push_back(collision_step { 3, OVERFLOW_ID, 0x3020, 20, true });     // both buckets full
+    collision_steps.push_back(collision_step { 5, OVERFLOW_ID, 0, 255, false });        // nothing to cancel
+    collision_steps.push_back(collision_step { 5, bucket_ids[3], 0, 255, false });
+    collision_steps.push_back(collision_step { 3, OVERFLOW_ID, 0x3020, 20, false });    // an entry is free again
+    for (unsigned k = 0; k <= 2 * INDEX_WAYS; k++) {
+        if (k != 3) {
+            collision_steps.push_back(collision_step { 5, bucket_ids[k], 0, 255, false });
+        }
+    }
+    map<unsigned, order> collision_book;
+    map<unsigned, unsigned> collision_asks;
+    book_counters collision_counters[2];
+    for (unsigned edge = 0; edge < 2; edge++) {
+        snapshot = edge;
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+    }
+    collision_counters[0] = counters;
+    for (unsigned st = 0; st < collision_steps.size(); st++) {
+        order step = { 0, collision_steps[st].size, collision_steps[st].orderID, collision_steps[st].direction, 6 };
+        step.price.range(15, 0) = collision_steps[st].tick;
+        if (step.direction == 5) {
+            collision_book.erase(step.orderID.to_uint());
+        } else if (!collision_steps[st].refused) {
+            collision_book[step.orderID.to_uint()] = step;
+        }
+        test_stream.write(step);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        map<unsigned, unsigned> bid_levels = reference_levels(collision_book);
+        if (!check_depth(depth, bid_levels, collision_asks, 4000 + st)) {
+            return 1;
+        }
+        bool refused_right = collision_steps[st].refused ? evictions.size() == 1 : evictions.empty();
+        if (refused_right && collision_steps[st].refused) {
+            order refused = evictions.read();
+            refused_right = refused.orderID == step.orderID && refused.size == 20 && refused.instrument == 6;
+        }
+        bool top_right = collision_book.empty() || top_bid_id == reference_best(collision_book, true);
+        if (!refused_right || !top_right) {
+            std::cout << "ERROR index collision: step " << st << " (" << directionToString(step.direction) << " "
+                      << step.orderID << "), top bid " << top_bid_id << "\n";
+            return 1;
+        }
+    }
+    for (unsigned edge = 0; edge < 2; edge++) {
+        snapshot = edge;
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+    }
+    collision_counters[1] = counters;
+    if (collision_counters[1].index_collisions != collision_counters[0].index_collisions + 2 ||
+        collision_counters[1].bid_orders != collision_counters[0].bid_orders) {
+        std::cout << "ERROR index collision: " << collision_counters[1].index_collisions - collision_counters[0].index_collisions
+                  << " collisions counted\n";
+        return 1;
+    }
+    std::cout << "Index collisions: a resting orderID and orderID " << OVERFLOW_ID << " (both index buckets full)"
+              << " were refused and no order was lost\n";
+
+    // Random orderIDs: every lane of instrument 6 is filled to capacity with
+    // random 32-bit orderIDs, then CAPACITY cancels of a random resting bid,
+    // each followed by a new random bid into that lane. The index holds twice
+    // a lane's capacity, so no bid may be refused.
+    mt19937 id_rng(1017);
+    map<unsigned, bool> random_live;
+    vector<unsigned> random_lanes[LANES];
+    const unsigned LANE_FULL = (1 << LANE_LEVELS) - 1;
+    unsigned random_bids = 0;
+    for (unsigned r = 0; r < LANES * LANE_FULL + CAPACITY; r++) {
+        vector<order> steps;
+        order step = { 0, 10, 0, 3, 6 };
+        step.price.range(15, 0) = 0x3000 + id_rng() % 200;
+        if (r >= LANES * LANE_FULL) {
+            unsigned lane = id_rng() % LANES;
+            unsigned pick = id_rng() % random_lanes[lane].size();
+            steps.push_back(order { 0, 255, random_lanes[lane][pick], 5, 6 });
+            random_live.erase(random_lanes[lane][pick]);
+            random_lanes[lane][pick] = random_lanes[lane].back();
+            random_lanes[lane].pop_back();
+            do {
+                step.orderID = random_order_id(id_rng, random_live);
+            } while (lane_of(step.orderID) != lane);
+        } else {
+            do {
+                step.orderID = random_order_id(id_rng, random_live);
+            } while (random_lanes[lane_of(step.orderID)].size() == LANE_FULL);
+        }
+        random_live[step.orderID.to_uint()] = true;
+        random_lanes[lane_of(step.orderID)].push_back(step.orderID.to_uint());
+        random_bids++;
+        steps.push_back(step);
+        for (unsigned k = 0; k < steps.size(); k++) {
+            test_stream.write(steps[k]);
+            test_time.write(t);
+            test_meta.write(temp_meta);
+            order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+            while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+            while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+            while (!outgoing_time.empty()) { outgoing_time.read(); }
+            while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+            depth.read();
+        }
+        if (!evictions.empty()) {
+            std::cout << "ERROR random orderIDs: bid " << step.orderID << " refused after " << random_bids
+                      << " bids\n";
+            return 1;
+        }
+    }
+    for (map<unsigned, bool>::iterator it = random_live.begin(); it != random_live.end(); ++it) {
+        order cancel = { 0, 255, it->first, 5, 6 };
+        test_stream.write(cancel);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        emptied = depth.read();
+    }
+    for (unsigned edge = 0; edge < 2; edge++) {
+        snapshot = edge;
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+    }
+    if (counters.index_collisions != collision_counters[1].index_collisions || emptied.bid[0].size != 0) {
+        std::cout << "ERROR random orderIDs: " << counters.index_collisions - collision_counters[1].index_collisions
+                  << " bids refused\n";
+        return 1;
+    }
+    std::cout << "Random orderIDs: " << random_bids << " bids with random 32-bit orderIDs, every lane full,"
+              << " none refused\n";
+#endif
+
+#if BOOK_ENGINE == BOOK_ENGINE_HEAP && NUM_INSTRUMENTS > 4
+    // Depth benchmark: the bid book of instrument 4 grows from 1 order to one
+    // short of full in every lane (each new bid goes to a lane that is not
+    // fuller than the average), and at each depth PROBES bids are added and
+    // a random resting bid of the same lane cancelled, with a snapshot around
+    // each. The heaps are compact, so a push or pop may take no more loop
+    // cycles than log2 of its lane's occupancy, however large LEVELS is.
+    const unsigned PROBES = 32;
+    mt19937 bench_rng(20261017);
+    vector<unsigned> lane_ids[LANES];
+    map<unsigned, order> bench_book;
+    unsigned next_id = 1, resting_bids = 0;
+    vector<unsigned> bench_depths;
+    for (unsigned d = 1; d < CAPACITY / 2; d *= 2) {
+        bench_depths.push_back(d);
+    }
+    bench_depths.push_back(CAPACITY / 2);
+    bench_depths.push_back(CAPACITY - 2 * LANES);
+    for (unsigned b = 0; b < bench_depths.size(); b++) {
+        unsigned push_cycles = 0, pop_cycles = 0, push_worst = 0, pop_worst = 0, bound = 0;
+        for (unsigned p = 0; resting_bids < bench_depths[b] || p < PROBES; p++) {
+            bool probe = resting_bids == bench_depths[b];
+            while (!probe && lane_ids[lane_of(next_id)].size() > resting_bids / LANES) {
+                next_id++;
+            }
+            order bid = { 0, (unsigned)(bench_rng() % 50 + 1), next_id, 3, 4 };
+            bid.price.range(15, 0) = 0x3000 + bench_rng() % 0x400;
+            vector<unsigned>& lane = lane_ids[lane_of(next_id)];
+            bench_book[next_id] = bid;
+            lane.push_back(next_id++);
+            unsigned occupancy = lane.size();
+            order cancel = { 0, 255, 0, 5, 4 };
+            if (probe) {
+                unsigned pick = bench_rng() % lane.size();
+                cancel.orderID = lane[pick];
+                lane[pick] = lane.back();
+                lane.pop_back();
+            } else {
+                resting_bids++;
+                p = 0;
+            }
+
+            // Snapshot, bid, snapshot, cancel, snapshot for a probe; only the
+            // bid while the book grows
+            book_counters latched[3];
+            for (unsigned phase = 0; phase < 3; phase++) {
+                if (probe) {
+                    for (unsigned edge = 0; edge < 2; edge++) {
+                        snapshot = edge;
+                        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+                    }
+                    latched[phase] = counters;
+                }
+                if (phase == 2 || (phase == 1 && !probe)) {
+                    break;
+                }
+                if (phase == 1) {
+                    bench_book.erase(cancel.orderID.to_uint());
+                }
+                test_stream.write(phase == 0 ? bid : cancel);
+                test_time.write(t);
+                test_meta.write(temp_meta);
+                order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+                while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+                while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+                while (!outgoing_time.empty()) { outgoing_time.read(); }
+                while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+                while (!depth.empty()) { depth.read(); }
+                // Ties on price may go either way, so only the price is compared
+                unsigned best_id = reference_best(bench_book, true);
+                if (!bench_book.count(top_bid_id.to_uint()) ||
+                    bench_book[top_bid_id.to_uint()].price != bench_book[best_id].price) {
+                    std::cout << "ERROR benchmark: top bid " << top_bid_id << " instead of " << best_id
+                              << " at depth " << resting_bids << "\n";
+                    return 1;
+                }
+            }
+            if (!evictions.empty()) {
+                std::cout << "ERROR benchmark: bid " << bid.orderID << " evicted an order at depth " << resting_bids << "\n";
+                return 1;
+            }
+            if (!probe) {
+                continue;
+            }
+            unsigned log2_occupancy = 0;
+            while ((2u << log2_occupancy) <= occupancy) {
+                log2_occupancy++;
+            }
+            unsigned push = latched[1].loop_cycles[3].to_uint() - latched[0].loop_cycles[3].to_uint();
+            unsigned pop = latched[2].loop_cycles[5].to_uint() - latched[1].loop_cycles[5].to_uint();
+            if (push > log2_occupancy || pop > log2_occupancy) {
+                std::cout << "ERROR benchmark: " << push << " push and " << pop << " pop loop cycles in a lane of "
+                          << occupancy << " bids at depth " << resting_bids << "\n";
+                return 1;
+            }
+            push_cycles += push;
+            pop_cycles += pop;
+            push_worst = max(push_worst, push);
+            pop_worst = max(pop_worst, pop);
+            bound = max(bound, log2_occupancy);
+        }
+        std::cout << "Depth " << bench_depths[b] << ": push " << (double)push_cycles / PROBES << " / pop "
+                  << (double)pop_cycles / PROBES << " loop cycles on average, at most " << push_worst << " / "
+                  << pop_worst << " (log2 of the lane: " << bound << ")\n";
+    }
+
+    // Cancelling the full book in random order sends the last order of a lane
+    // up as often as down; the top of book must follow the reference to the end
+    vector<unsigned> drain_ids;
+    for (unsigned k = 0; k < LANES; k++) {
+        drain_ids.insert(drain_ids.end(), lane_ids[k].begin(), lane_ids[k].end());
+    }
+    shuffle(drain_ids.begin(), drain_ids.end(), bench_rng);
+    book_counters drained[2];
+    for (unsigned edge = 0; edge < 2; edge++) {
+        snapshot = edge;
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+    }
+    drained[0] = counters;
+    for (unsigned d = 0; d < drain_ids.size(); d++) {
+        order cancel = { 0, 255, drain_ids[d], 5, 4 };
+        bench_book.erase(drain_ids[d]);
+        test_stream.write(cancel);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        while (!depth.empty()) { depth.read(); }
+        unsigned best_id = reference_best(bench_book, true);
+        bool top_right = bench_book.empty() ||
+                         (bench_book.count(top_bid_id.to_uint()) && bench_book[top_bid_id.to_uint()].price == bench_book[best_id].price);
+        if (!top_right) {
+            std::cout << "ERROR benchmark: top bid " << top_bid_id << " instead of " << best_id
+                      << " after " << d + 1 << " cancels\n";
+            return 1;
+        }
+    }
+    for (unsigned edge = 0; edge < 2; edge++) {
+        snapshot = edge;
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+    }
+    drained[1] = counters;
+    if (drained[0].bid_orders - drained[1].bid_orders != drain_ids.size()) {
+        std::cout << "ERROR benchmark: " << drained[0].bid_orders - drained[1].bid_orders << " of "
+                  << drain_ids.size() << " bids left the book\n";
+        return 1;
+    }
+
+    // A removal whose last order outranks the removed order's parent must sift
+    // it up. In one lane of bids 100 / 50 90 / 40 45 80 85 (level by level),
+    // cancelling 40 moves 85 under 50; only if it went up past 50 does it come
+    // to the top once 100 and 90 are cancelled.
+    struct { ap_uint<3> direction; unsigned tick; } sift_steps[10] = {
+        { 3, 100 }, { 3, 50 }, { 3, 90 }, { 3, 40 }, { 3, 45 }, { 3, 80 }, { 3, 85 },
+        { 5, 40 }, { 5, 100 }, { 5, 90 },
+    };
+    for (unsigned st = 0; st < 10; st++) {
+        order step = { 0, 10, lane_member(0, sift_steps[st].tick), sift_steps[st].direction, 4 };
+        step.price.range(15, 0) = 0x3000 + sift_steps[st].tick;
+        if (step.direction == 3) {
+            bench_book[step.orderID.to_uint()] = step;
+        } else {
+            bench_book.erase(step.orderID.to_uint());
+        }
+        test_stream.write(step);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        while (!depth.empty()) { depth.read(); }
+        if (top_bid_id != reference_best(bench_book, true)) {
+            std::cout << "ERROR sift up: top bid " << top_bid_id << " instead of " << reference_best(bench_book, true)
+                      << " at step " << st << "\n";
+            return 1;
+        }
+    }
+    std::cout << "Depth benchmark: " << drain_ids.size() << " bids cancelled in random order and a sift up, top of book matched throughout\n";
+#endif
+
+#if TICK_BITS < PRICE_BITS && NUM_INSTRUMENTS > 7
+    // Level store window: the first bid on instrument 7 centres the window on
+    // its price. Orders just inside it rest, orders just outside it are
+    // refused on evictions, and so is an amend out of it (engines that amend).
+    // Once the book is empty the window moves to the next limit order.
+    const unsigned CENTER = 0x8000, HALF = TICKS / 2;
+    struct { ap_uint<3> direction; unsigned orderID; unsigned tick; unsigned size; bool refused; } window_steps[9] = {
+        { 3, 801, CENTER, 10, false },
+        { 2, 802, CENTER + HALF - 1, 5, false },    // last tick of the window
+        { 2, 803, CENTER + HALF, 7, true },         // first tick past it
+        { 3, 804, CENTER - HALF - 1, 3, true },     // tick before it
+        { 7, 801, CENTER - HALF - 1, 10, true },    // amend out of the window
+        { 5, 801, CENTER, 255, false },
+        { 4, 802, CENTER + HALF - 1, 255, false },
+        { 2, 805, CENTER + HALF, 7, false },        // empty book: new window
+        { 4, 805, CENTER + HALF, 255, false },
+    };
+    map<unsigned, order> window_book[2];  // [0] asks, [1] bids
+    book_counters window_counters[2];
+    for (unsigned edge = 0; edge < 2; edge++) {
+        snapshot = edge;
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+    }
+    window_counters[0] = counters;
+    unsigned window_refused = 0;
+    for (unsigned st = 0; st < 9; st++) {
+        order step = { 0, window_steps[st].size, window_steps[st].orderID, window_steps[st].direction, 7 };
+        step.price.range(15, 0) = window_steps[st].tick;
+        bool bid_side = step.direction % 2 == 1;
+        bool refused = window_steps[st].refused;
+        order expected_refusal = step;
+        if (step.direction >= 6) {
+            if (BOOK_ENGINE == BOOK_ENGINE_PRICE_LEVEL) {
+                continue;  // amends leave this engine's book unchanged
+            }
+            expected_refusal = window_book[bid_side][step.orderID.to_uint()];
+            window_book[bid_side].erase(step.orderID.to_uint());
+        } else if (step.direction >= 4) {
+            window_book[bid_side].erase(step.orderID.to_uint());
+        } else if (!refused) {
+            window_book[bid_side][step.orderID.to_uint()] = step;
+        }
+        test_stream.write(step);
+        test_time.write(t);
+        test_meta.write(temp_meta);
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+        while (!top_bid_stream.empty()) { top_bid_stream.read(); }
+        while (!top_ask_stream.empty()) { top_ask_stream.read(); }
+        while (!outgoing_time.empty()) { outgoing_time.read(); }
+        while (!outgoing_meta.empty()) { outgoing_meta.read(); }
+        map<unsigned, unsigned> bid_levels = reference_levels(window_book[1]);
+        map<unsigned, unsigned> ask_levels = reference_levels(window_book[0]);
+        if (!check_depth(depth, bid_levels, ask_levels, 5000 + st)) {
+            return 1;
+        }
+        bool refused_right = refused ? evictions.size() == 1 : evictions.empty();
+        if (refused_right && refused) {
+            order out = evictions.read();
+            refused_right = out.orderID == expected_refusal.orderID && out.price == expected_refusal.price &&
+                            out.size == expected_refusal.size && out.instrument == 7;
+            window_refused++;
+        }
+        if (!refused_right) {
+            std::cout << "ERROR window: step " << st << " (" << directionToString(step.direction) << " "
+                      << step.orderID << ") expected " << (refused ? "a refusal" : "no refusal") << "\n";
+            return 1;
+        }
+    }
+    for (unsigned edge = 0; edge < 2; edge++) {
+        snapshot = edge;
+        order_book(test_stream, test_time, test_meta, top_bid_stream, top_ask_stream, outgoing_time, outgoing_meta, top_bid_id, top_ask_id, executions, depth, evictions, 0, suppressed_updates, snapshot, counters);
+    }
+    window_counters[1] = counters;
+    if (window_counters[1].window_drops - window_counters[0].window_drops != window_refused) {
+        std::cout << "ERROR window: " << window_counters[1].window_drops - window_counters[0].window_drops
+                  << " window drops counted, expected " << window_refused << "\n";
+        return 1;
+    }
+    std::cout << "Window: a " << TICKS << "-tick level store refused " << window_refused
+              << " orders outside it and moved once the book was empty\n";
+#endif
     return 0;
-}
\ No newline at end of file
+}
@@ -122,7 +122,8 @@ order createOrder(const order& bid, const order& ask, bool buy) {
         .price = buy ? bid.price : ask.price,
         .size = buy ? bid.size : ask.size,
         .orderID = buy ? bid.orderID : ask.orderID,
-        .direction = buy ? 1 : 0
+        .direction = buy ? 1 : 0,
+        .instrument = buy ? bid.instrument : ask.instrument
     };
 }
 
@@ -23,8 +23,11 @@ struct order{
 	ap_uint<8> size; 		/*Order size in hundreds*/
 	ap_uint<32> orderID; 	/*Unique ID for each order*/
 	ap_uint<3> direction; 	/*Order type: 0 - MARKET SELL 	1 - MARKET BUY   */
-};							/*			  2 - INCOMING ASK 	3 - INCOMING BID */
+							/*			  2 - INCOMING ASK 	3 - INCOMING BID */
 							/*		   	  4 - REMOVE ASK	5 - REMOVE BID	 */
+							/*		   	  6 - MODIFY ASK	7 - MODIFY BID	 */
+	ap_uint<10> instrument;	/*Book the order belongs to*/
+};
 
 void trading_logic(stream<order> &top_bid,
 				stream<order> &top_ask,